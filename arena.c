@@ -0,0 +1,342 @@
+// ****************************************************************************
+//  arena.c                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Region allocator used to bump-allocate the trees built by a parse
+//
+//     Chunks are aligned on their size, so that the chunk containing
+//     an allocation is found by masking the low bits of its address.
+//     Items larger than ARENA_MAX_ITEM_SIZE get a chunk of their own,
+//     which is released as soon as the item is freed.
+//
+//     Items follow each other in a chunk, each with a header giving its
+//     size and telling if it was freed, so that arena_next can find them.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "arena.h"
+#include "recorder.h"
+
+#include <assert.h>
+
+RECORDER(ARENA, 64, "Arena allocations");
+
+
+typedef struct arena_chunk
+// ----------------------------------------------------------------------------
+//   Header at the beginning of each chunk
+// ----------------------------------------------------------------------------
+{
+    arena_p             arena;          // Arena owning the chunk
+    arena_chunk_p       next;           // Older chunk in the same arena
+    arena_chunk_p       previous;       // Newer chunk in the same arena
+    char *              end;            // End of items, see arena_chunk_end
+} arena_chunk_t;
+
+
+typedef union arena_item
+// ----------------------------------------------------------------------------
+//   Header in front of each allocation, keeps the payload 8-byte aligned
+// ----------------------------------------------------------------------------
+{
+    struct
+    {
+        uint32_t        size;           // Size requested by the caller
+        uint32_t        freed;          // Freed, but not reclaimed yet
+    };
+    uint64_t            align;
+} arena_item_t, *arena_item_p;
+
+#define ARENA_ALIGN             sizeof(arena_item_t)
+#define ARENA_ROUND(sz)         (((sz) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_ITEM_SIZE(sz)     (sizeof(arena_item_t) + ARENA_ROUND(sz))
+#define ARENA_HEADER_SIZE       ARENA_ROUND(sizeof(arena_chunk_t))
+#define ARENA_CHUNK(ptr)                                                \
+    ((arena_chunk_p) ((uintptr_t) (ptr) & ~(uintptr_t) (ARENA_CHUNK_SIZE-1)))
+
+
+
+// ============================================================================
+//
+//    Chunks
+//
+// ============================================================================
+
+static arena_chunk_p arena_chunk_new(arena_p arena, size_t size)
+// ----------------------------------------------------------------------------
+//   Allocate a chunk of the given size, aligned on ARENA_CHUNK_SIZE
+// ----------------------------------------------------------------------------
+{
+    void *base = NULL;
+    if (posix_memalign(&base, ARENA_CHUNK_SIZE, size))
+        return NULL;
+    arena_chunk_p chunk = base;
+    chunk->arena = arena;
+    chunk->next = arena->chunks;
+    chunk->previous = NULL;
+    chunk->end = (char *) base + ARENA_HEADER_SIZE;
+    if (arena->chunks)
+        arena->chunks->previous = chunk;
+    arena->chunks = chunk;
+    RECORD(ARENA, "Arena %p new chunk %p size %zu", arena, chunk, size);
+    return chunk;
+}
+
+
+static void arena_chunk_free(arena_p arena, arena_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Unlink a chunk from its arena and free it
+// ----------------------------------------------------------------------------
+{
+    if (chunk->previous)
+        chunk->previous->next = chunk->next;
+    else
+        arena->chunks = chunk->next;
+    if (chunk->next)
+        chunk->next->previous = chunk->previous;
+    free(chunk);
+}
+
+
+static char *arena_chunk_end(arena_p arena, arena_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Return the end of the items in a chunk
+// ----------------------------------------------------------------------------
+//   The end of the current chunk moves with each allocation, so it is
+//   only written in the chunk when the arena moves to another chunk.
+{
+    if (arena->limit && chunk == ARENA_CHUNK(arena->limit - 1))
+        return arena->free;
+    return chunk->end;
+}
+
+
+arena_p arena_owner(void *ptr)
+// ----------------------------------------------------------------------------
+//   Return the arena a pointer was allocated from
+// ----------------------------------------------------------------------------
+//   The pointer must come from arena_alloc, this is not checked.
+{
+    return ARENA_CHUNK(ptr)->arena;
+}
+
+
+
+// ============================================================================
+//
+//    Creating and deleting arenas
+//
+// ============================================================================
+
+arena_p arena_new(void)
+// ----------------------------------------------------------------------------
+//   Create a new, empty arena
+// ----------------------------------------------------------------------------
+{
+    arena_p arena = malloc(sizeof(arena_t));
+    arena->chunks = NULL;
+    arena->free = NULL;
+    arena->limit = NULL;
+    arena->last = NULL;
+    arena->live = 0;
+    arena->allocated = 0;
+    arena->closed = false;
+    arena->escaped = false;
+    RECORD(ARENA, "New arena %p", arena);
+    return arena;
+}
+
+
+static void arena_release(arena_p arena)
+// ----------------------------------------------------------------------------
+//   Release all the chunks in the arena in one pass
+// ----------------------------------------------------------------------------
+{
+    RECORD(ARENA, "Release arena %p, %zu bytes allocated, %zu live",
+           arena, arena->allocated, arena->live);
+    arena_chunk_p chunk = arena->chunks;
+    while (chunk)
+    {
+        arena_chunk_p next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+
+void arena_delete(arena_p arena)
+// ----------------------------------------------------------------------------
+//   Release the arena, memory is reclaimed once no tree lives in it
+// ----------------------------------------------------------------------------
+{
+    arena->closed = true;
+    if (arena->live == 0)
+        arena_release(arena);
+}
+
+
+void arena_drop(arena_p arena)
+// ----------------------------------------------------------------------------
+//   Release a closed arena now, including the items that were not freed
+// ----------------------------------------------------------------------------
+{
+    assert(arena->closed && "Only the owner may release an arena");
+    arena_release(arena);
+}
+
+
+
+// ============================================================================
+//
+//    Allocating memory in an arena
+//
+// ============================================================================
+
+void *arena_alloc(arena_p arena, size_t size)
+// ----------------------------------------------------------------------------
+//   Bump-allocate in the current chunk, or in a chunk of its own if large
+// ----------------------------------------------------------------------------
+{
+    if (size > UINT32_MAX)
+        return NULL;
+
+    size_t required = ARENA_ITEM_SIZE(size);
+    arena_item_p item;
+    if (size > ARENA_MAX_ITEM_SIZE)
+    {
+        arena_chunk_p chunk = arena_chunk_new(arena,
+                                              ARENA_HEADER_SIZE + required);
+        if (!chunk)
+            return NULL;
+        item = (arena_item_p) chunk->end;
+        chunk->end += required;
+    }
+    else
+    {
+        if (arena->free + required > arena->limit)
+        {
+            if (arena->limit)
+                ARENA_CHUNK(arena->limit - 1)->end = arena->free;
+            arena_chunk_p chunk = arena_chunk_new(arena, ARENA_CHUNK_SIZE);
+            if (!chunk)
+                return NULL;
+            arena->free = chunk->end;
+            arena->limit = (char *) chunk + ARENA_CHUNK_SIZE;
+            arena->last = NULL;
+        }
+        item = (arena_item_p) arena->free;
+        arena->last = arena->free;
+        arena->free += required;
+    }
+
+    item->size = size;
+    item->freed = 0;
+    arena->live++;
+    arena->allocated += size;
+    return item + 1;
+}
+
+
+bool arena_resize(arena_p arena, void *ptr, size_t size)
+// ----------------------------------------------------------------------------
+//   Resize an allocation in place if possible, return false if not possible
+// ----------------------------------------------------------------------------
+//   Shrinking always works, but only the last allocation gives space back.
+//   Growing works for the last allocation in the current chunk, which is
+//   the common case when appending to a text or array being built by the
+//   scanner or parser.
+{
+    arena_item_p item = (arena_item_p) ptr - 1;
+    bool is_last = (char *) item == arena->last;
+    if (!is_last)
+        return size <= item->size;
+    if (size > ARENA_MAX_ITEM_SIZE)
+        return false;
+    if ((char *) item + ARENA_ITEM_SIZE(size) > arena->limit)
+        return false;
+    if (size > item->size)
+        arena->allocated += size - item->size;
+    item->size = size;
+    arena->free = (char *) item + ARENA_ITEM_SIZE(size);
+    return true;
+}
+
+
+void arena_free(arena_p arena, void *ptr)
+// ----------------------------------------------------------------------------
+//   Free an allocation in the arena, release arena if closed and empty
+// ----------------------------------------------------------------------------
+{
+    arena_item_p item = (arena_item_p) ptr - 1;
+    assert(arena->live && "Freeing more items than allocated in arena");
+
+    if (item->size > ARENA_MAX_ITEM_SIZE)
+    {
+        // Large items have a chunk of their own
+        arena_chunk_free(arena, ARENA_CHUNK(item));
+    }
+    else if ((char *) item == arena->last)
+    {
+        // Temporaries freed immediately after allocation can be reused
+        arena->free = arena->last;
+        arena->last = NULL;
+    }
+    else
+    {
+        item->freed = 1;
+    }
+
+    arena->live--;
+    if (arena->closed && arena->live == 0)
+        arena_release(arena);
+}
+
+
+size_t arena_size(void *ptr)
+// ----------------------------------------------------------------------------
+//   Return the size of an arena allocation
+// ----------------------------------------------------------------------------
+{
+    arena_item_p item = (arena_item_p) ptr - 1;
+    return item->size;
+}
+
+
+void *arena_next(arena_p arena, void *ptr)
+// ----------------------------------------------------------------------------
+//   Return the allocation not yet freed following ptr, or the first one
+// ----------------------------------------------------------------------------
+//   Nothing may be freed in the arena while iterating.
+{
+    arena_chunk_p chunk = arena->chunks;
+    char *next = chunk ? (char *) chunk + ARENA_HEADER_SIZE : NULL;
+    if (ptr)
+    {
+        arena_item_p item = (arena_item_p) ptr - 1;
+        chunk = ARENA_CHUNK(ptr);
+        next = (char *) item + ARENA_ITEM_SIZE(item->size);
+    }
+
+    while (chunk)
+    {
+        char *end = arena_chunk_end(arena, chunk);
+        while (next < end)
+        {
+            arena_item_p item = (arena_item_p) next;
+            if (!item->freed)
+                return item + 1;
+            next += ARENA_ITEM_SIZE(item->size);
+        }
+        chunk = chunk->next;
+        if (chunk)
+            next = (char *) chunk + ARENA_HEADER_SIZE;
+    }
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef ARENA_H
+#define ARENA_H
+// ****************************************************************************
+//  arena.h                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Region allocator used to bump-allocate the trees built by a parse
+//
+//     An arena hands out memory from large chunks, and releases all the
+//     chunks at once. Trees allocated in an arena are still reference
+//     counted: freeing such a tree only decrements a live count in the
+//     arena, and the chunks are released once the arena owner has called
+//     arena_delete and the last live tree in the arena has been freed.
+//     This way, trees that escape the arena remain valid.
+//
+//     Callers must know which pointers come from an arena, e.g. trees
+//     have the TREE_ARENA flag, since arena_owner does not check it.
+//     Once closed, an arena can also be dropped at once with arena_drop,
+//     when the caller knows that none of the live items is still needed.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+typedef struct arena_chunk *arena_chunk_p;
+
+typedef struct arena
+// ----------------------------------------------------------------------------
+//   A region from which trees can be allocated
+// ----------------------------------------------------------------------------
+{
+    arena_chunk_p       chunks;         // Chunks in use, most recent first
+    char *              free;           // Next free byte in current chunk
+    char *              limit;          // End of current chunk
+    char *              last;           // Last allocation, may grow in place
+    size_t              live;           // Allocations not yet freed
+    size_t              allocated;      // Total bytes allocated in arena
+    bool                closed;         // Owner released the arena
+    bool                escaped;        // Items outlive the owner, see tree.c
+} arena_t, *arena_p;
+
+
+// Size of arena chunks, must be a power of two. Larger items get a chunk each.
+#define ARENA_CHUNK_SIZE        (64 * 1024)
+#define ARENA_MAX_ITEM_SIZE     (ARENA_CHUNK_SIZE / 4)
+
+
+// Creating and deleting arenas
+extern arena_p  arena_new(void);
+extern void     arena_delete(arena_p arena);
+extern void     arena_drop(arena_p arena);
+
+// Allocating and freeing memory in an arena
+extern void *   arena_alloc(arena_p arena, size_t size);
+extern bool     arena_resize(arena_p arena, void *ptr, size_t size);
+extern void     arena_free(arena_p arena, void *ptr);
+extern size_t   arena_size(void *ptr);
+
+// Find which arena a pointer allocated from an arena belongs to
+extern arena_p  arena_owner(void *ptr);
+
+// Iterate over the allocations not freed yet, starting with NULL
+extern void *   arena_next(arena_p arena, void *ptr);
+
+#endif // ARENA_H
@@ -45,8 +45,7 @@ void array_append_data(array_p *array_ptr, size_t sz, tree_p *data)
     {
         if (!in_place)
         {
-            memcpy(result, array, old_size);
-            result->tree.refcount = 0;
+            tree_copy_memory((tree_p) result, (tree_p) array, old_size);
 
             // Since we make a new in_place, we must reference these items
             tree_p *children = array_data(result);
@@ -68,9 +67,17 @@ void array_append_data(array_p *array_ptr, size_t sz, tree_p *data)
         }
         result->length += sz;
     }
-    array_unref(array);
-    if (result != array)
+    if (in_place)
+    {
+        // The realloc may have moved the array, so unref the new location
+        array_unref(result);
+        *array_ptr = result;
+    }
+    else
+    {
+        array_unref(array);
         array_set(array_ptr, result);
+    }
 }
 
 
@@ -92,8 +99,7 @@ void array_range(array_p *array_ptr, size_t first, size_t length)
     if (array_ref(array))
     {
         in_place = (array_p) tree_malloc(resized_bytes);
-        memcpy(in_place, array, sizeof(array_t));
-        in_place->tree.refcount = 0;
+        tree_copy_memory((tree_p) in_place, (tree_p) array, sizeof(array_t));
     }
     tree_p *src_data = array_data(array) + first;
     tree_p *dst_data = array_data(in_place);
@@ -119,10 +125,14 @@ void array_range(array_p *array_ptr, size_t first, size_t length)
     {
         // We did the in_place in place: need to truncate result
         in_place = (array_p) tree_realloc((tree_p) in_place, resized_bytes);
+        array_unref(in_place);
+        *array_ptr = in_place;
     }
-    array_unref(array);
-    if (in_place != array)
+    else
+    {
+        array_unref(array);
         array_set(array_ptr, in_place);
+    }
 }
 
 
@@ -279,28 +289,6 @@ tree_p array_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "array";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (is dynamic for arrays)
-        return (tree_p) (sizeof(array_t) + array->length * sizeof(tree_p));
-
-    case TREE_ARITY:
-        // Arrays have a variable number of children
-        return (tree_p) array->length;
-
-    case TREE_CHILDREN:
-        // Return pointer to first child, which is right after the array
-        return (tree_p) (array + 1);
-
-    case TREE_CAST:
-        // Check if we cast to array type, if so, success
-        if (tree_cast_handler(va) == array_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
     case TREE_INITIALIZE:
         // Fetch pointer to data and size from varargs list (see array_new)
         size = va_arg(va, size_t);
@@ -347,6 +335,22 @@ tree_p array_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
+tree_class_t array_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for arrays, with children following the array_t header
+// ----------------------------------------------------------------------------
+{
+    .name       = "array",
+    .handler    = array_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(array_t),
+    .children   = sizeof(array_t),
+    .length     = offsetof(array_t, length),
+    .item_size  = sizeof(tree_p),
+    .item_arity = 1,
+};
+
+
 
 
 // ============================================================================
@@ -59,7 +59,7 @@ extern int      array_search(array_p array, tree_p key,
 
 // Private array handler, should not be called directly in general
 extern tree_p  array_handler(tree_cmd_t cmd, tree_p tree, va_list va);
-inline array_p array_make(tree_handler_fn h, srcpos_t, size_t, tree_p *data);
+inline array_p array_make(tree_class_p, srcpos_t, size_t, tree_p *data);
 
 // Formatting of array rendering
 extern name_p  array_opening, array_closing, array_separator;
@@ -74,13 +74,13 @@ extern name_p  array_opening, array_closing, array_separator;
 //
 // ============================================================================
 
-inline array_p array_make(tree_handler_fn h,
+inline array_p array_make(tree_class_p class,
                           srcpos_t pos, size_t sz, tree_p *data)
 // ----------------------------------------------------------------------------
 //   Create an array with the given parameters
 // ----------------------------------------------------------------------------
 {
-    return (array_p) tree_make(h, pos, sz, data);
+    return (array_p) tree_make(class, pos, sz, data);
 }
 
 
@@ -89,7 +89,7 @@ inline array_p array_new(srcpos_t position, size_t length, tree_p *data)
 //    Allocate a array with the given data
 // ----------------------------------------------------------------------------
 {
-    return array_make(array_handler, position, length, data);
+    return array_make(&array_class, position, length, data);
 }
 
 
@@ -191,7 +191,8 @@ inline void array_pop(array_p *array)
                                                                         \
     inline type##_p type##_new(srcpos_t pos, size_t sz, item##_p *data) \
     {                                                                   \
-        return (type##_p) array_new(pos, sz, (tree_p *) data);          \
+        return (type##_p) array_make(&type##_class, pos, sz,           \
+                                     (tree_p *) data);                  \
     }                                                                   \
                                                                         \
     inline void type##_append(type##_p *t1, type##_p t2)                \
@@ -238,4 +239,19 @@ inline void array_pop(array_p *array)
         type##_range(type, 0, type##_length(*type)-1);                  \
     }
 
+
+#define array_type_class(type)                                          \
+                                                                        \
+    tree_class_t type##_class =                                         \
+    {                                                                   \
+        .name       = #type,                                            \
+        .handler    = array_handler,                                    \
+        .parent     = &array_class,                                     \
+        .size       = sizeof(array_t),                                  \
+        .children   = sizeof(array_t),                                  \
+        .length     = offsetof(array_t, length),                        \
+        .item_size  = sizeof(tree_p),                                   \
+        .item_arity = 1,                                                \
+    }
+
 #endif // ARRAY_H
@@ -24,6 +24,7 @@
 
 #include "renderer.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,35 +36,45 @@ void blob_append_data(blob_p *blob_ptr, size_t sz, const char *data)
 //   We can append in place if:
 //   - There is only one user of this blob (who, presumably, is calling us)
 //   - The realloc can extend memory without copy
+//   Immediates are never in place, and are read from a box
 {
+    tree_box_t box;
     blob_p blob = *blob_ptr;
     blob_p in_place = blob;
     if (blob_ref(blob))
         in_place = NULL;
-    size_t old_size = sizeof(blob_t) + blob->length;
+    blob_p source = (blob_p) tree_unbox((tree_p) blob, &box);
+    size_t old_size = sizeof(blob_t) + source->length;
     size_t new_size = old_size + sz;
     blob_p result = (blob_p) tree_realloc((tree_p) in_place, new_size);
     if (result)
     {
         if (!in_place)
         {
-            memcpy(result, blob, old_size);
+            // Do not read the refcount, other threads may change it
+            tree_set_class(&result->tree, tree_class_of((tree_p) blob));
             result->tree.refcount = 0;
+            result->tree.position = source->tree.position;
+            memcpy(&result->length, &source->length,
+                   old_size - offsetof(blob_t, length));
         }
-        char *append_dst = blob_data(result) + blob_length(blob);
+        char *append_dst = (char *) result + old_size;
         if (data)
             memcpy(append_dst, data, sz);
         else
             memset(append_dst, 0, sz);
         result->length += sz;
     }
-    blob_unref(blob);
-    if (result != blob)
+    if (in_place)
     {
-        if (in_place)
-            *blob_ptr = result;
-        else
-            blob_set(blob_ptr, result);
+        // The realloc may have moved the blob, so unref the new location
+        blob_unref(result);
+        *blob_ptr = result;
+    }
+    else
+    {
+        blob_unref(blob);
+        blob_set(blob_ptr, result);
     }
 }
 
@@ -74,29 +85,35 @@ void blob_range(blob_p *blob_ptr, size_t first, size_t length)
 // ----------------------------------------------------------------------------
 //   We can move in place if there is only one user of this blob
 {
+    tree_box_t box;
     blob_p blob = *blob_ptr;
     blob_p in_place = blob;
+    blob_p source = (blob_p) tree_unbox((tree_p) blob, &box);
     size_t end = first + length;
-    if (end > blob->length)
-        end = blob->length;
-    if (first > blob->length)
-        first = blob->length;
+    if (end > source->length)
+        end = source->length;
+    if (first > source->length)
+        first = source->length;
     size_t resized = end - first;
     if (blob_ref(blob))
     {
         in_place = (blob_p) tree_malloc(sizeof(blob_t) + resized);
-        memcpy(in_place, blob, sizeof(blob_t));
-        in_place->tree.refcount = 0;
+        tree_copy_memory((tree_p) in_place, (tree_p) source, sizeof(blob_t));
     }
-    memmove(in_place + 1, blob_data(blob) + first, resized);
+    memmove(in_place + 1, blob_data(source) + first, resized);
     in_place->length = resized;
     if (in_place == blob)
+    {
         in_place = (blob_p) tree_realloc((tree_p) in_place,
                                          sizeof(blob_t) + resized);
-    blob_unref(blob);
-
-    if (in_place != blob)
+        blob_unref(in_place);
+        *blob_ptr = in_place;
+    }
+    else
+    {
+        blob_unref(blob);
         blob_set(blob_ptr, in_place);
+    }
 }
 
 
@@ -105,6 +122,12 @@ int blob_compare(blob_p b1, blob_p b2)
 //   Compare two blobs (lexical order)
 // ----------------------------------------------------------------------------
 {
+    if (b1 == b2)
+        return 0;
+
+    tree_box_t box1, box2;
+    b1 = (blob_p) tree_unbox((tree_p) b1, &box1);
+    b2 = (blob_p) tree_unbox((tree_p) b2, &box2);
     char *  p1  = blob_data(b1);
     char *  p2  = blob_data(b2);
     size_t  l1  = blob_length(b1);
@@ -135,24 +158,6 @@ tree_p blob_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "blob";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (is dynamic for blobs)
-        return (tree_p) (sizeof(blob_t) + blob->length);
-
-    case TREE_ARITY:
-        // The arity for blobs is normally 0
-        return (tree_p) 0;
-
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == blob_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
     case TREE_INITIALIZE:
         // Fetch pointer to data and size from varargs list (see blob_new)
         size = va_arg(va, size_t);
@@ -188,3 +193,17 @@ tree_p blob_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     }
     return tree_handler(cmd, tree, va);
 }
+
+
+tree_class_t blob_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for blobs, with bytes following the blob_t header
+// ----------------------------------------------------------------------------
+{
+    .name       = "blob",
+    .handler    = blob_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(blob_t),
+    .length     = offsetof(blob_t, length),
+    .item_size  = 1,
+};
@@ -49,7 +49,7 @@ inline size_t   blob_length(blob_p blob);
 extern int      blob_compare(blob_p blob1, blob_p blob2);
 
 // Private blob handler, should not be called directly in general
-inline blob_p   blob_make(tree_handler_fn h, srcpos_t, size_t, const char *);
+inline blob_p   blob_make(tree_class_p, srcpos_t, size_t, const char *);
 extern tree_p   blob_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 #undef inline
@@ -62,13 +62,13 @@ extern tree_p   blob_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 //
 // ============================================================================
 
-inline blob_p blob_make(tree_handler_fn h, srcpos_t pos,
+inline blob_p blob_make(tree_class_p class, srcpos_t pos,
                         size_t sz, const char *data)
 // ----------------------------------------------------------------------------
 //   Create a blob with the given parameters
 // ----------------------------------------------------------------------------
 {
-    return (blob_p) tree_make(h, pos, sz, data);
+    return (blob_p) tree_make(class, pos, sz, data);
 }
 
 
@@ -77,7 +77,7 @@ inline blob_p blob_new(srcpos_t position, size_t sz, const char *data)
 //    Allocate a blob with the given data
 // ----------------------------------------------------------------------------
 {
-    return blob_make(blob_handler, position, sz, data);
+    return blob_make(&blob_class, position, sz, data);
 }
 
 
@@ -86,6 +86,8 @@ inline void blob_append(blob_p *blob, blob_p blob2)
 //   Append one blob to another
 // ----------------------------------------------------------------------------
 {
+    tree_box_t box;
+    blob2 = (blob_p) tree_unbox((tree_p) blob2, &box);
     blob_append_data(blob, blob_length(blob2), blob_data(blob2));
 }
 
@@ -94,7 +96,10 @@ inline char *blob_data(blob_p blob)
 // ----------------------------------------------------------------------------
 //   Return the data for the blob
 // ----------------------------------------------------------------------------
+//   Short texts and names may be immediates, which have no memory to point
+//   to. Callers that may get one use tree_unbox first.
 {
+    assert(!tree_is_immediate((tree_p) blob) && "Immediates must be unboxed");
     return (char *) (blob + 1);
 }
 
@@ -104,6 +109,8 @@ inline size_t blob_length(blob_p blob)
 //   Return the data for the blob
 // ----------------------------------------------------------------------------
 {
+    if (tree_is_immediate((tree_p) blob))
+        return tree_variable_length((tree_p) blob);
     return blob->length;
 }
 
@@ -119,17 +126,17 @@ inline size_t blob_length(blob_p blob)
                                                                         \
     tree_type(type);                                                    \
                                                                         \
-    inline text_p type##_make(tree_handler_fn h, srcpos_t pos,          \
+    inline text_p type##_make(tree_class_p class, srcpos_t pos,         \
                               size_t sz, const item *data)              \
     {                                                                   \
         sz *= sizeof(item);                                             \
-        return (text_p) tree_make(h, pos, sz, data);                    \
+        return (text_p) tree_make(class, pos, sz, data);                \
     }                                                                   \
                                                                         \
     inline type##_p type##_new(srcpos_t pos,                            \
                                size_t sz, const item *data)             \
     {                                                                   \
-        return (type##_p) type##_make(type##_handler, pos,sz, data);    \
+        return (type##_p) type##_make(&type##_class, pos,sz, data);     \
     }                                                                   \
                                                                         \
     inline void type##_append(type##_p *type, type##_p type2)           \
@@ -189,23 +196,16 @@ inline size_t blob_length(blob_p blob)
     }
 
 
-#define blob_type_handler(type)                                         \
+#define blob_type_class(type)                                           \
                                                                         \
-    tree_p type##_handler(tree_cmd_t cmd,tree_p tree,va_list va)        \
+    tree_class_t type##_class =                                         \
     {                                                                   \
-        switch(cmd)                                                     \
-        {                                                               \
-        case TREE_TYPENAME:                                             \
-            return (tree_p) #type;                                      \
-                                                                        \
-        case TREE_CAST:                                                 \
-            if (tree_cast_handler(va) == type##_handler)                \
-                return tree;                                            \
-            break;                                                      \
-        default:                                                        \
-            break;                                                      \
-        }                                                               \
-        return blob_handler(cmd, tree, va);                             \
+        .name       = #type,                                            \
+        .handler    = blob_handler,                                     \
+        .parent     = &blob_class,                                      \
+        .size       = sizeof(blob_t),                                   \
+        .length     = offsetof(blob_t, length),                         \
+        .item_size  = 1,                                                \
     }
 
 
@@ -26,6 +26,17 @@
 #include <strings.h>
 
 
+static void block_use_names(block_p block)
+// ----------------------------------------------------------------------------
+//   Reference the opening, closing and separator of a copied block
+// ----------------------------------------------------------------------------
+{
+    name_use(block->opening);
+    name_use(block->closing);
+    name_use(block->separator);
+}
+
+
 void block_append_data(block_p *block_ptr, size_t sz, tree_p *data)
 // ----------------------------------------------------------------------------
 //   Append data to the block - In place if possible
@@ -45,10 +56,10 @@ void block_append_data(block_p *block_ptr, size_t sz, tree_p *data)
     {
         if (!in_place)
         {
-            memcpy(result, block, old_size);
-            result->tree.refcount = 0;
+            tree_copy_memory((tree_p) result, (tree_p) block, old_size);
 
             // Since we make a new in_place, we must reference these items
+            block_use_names(result);
             tree_p *children = block_data(result);
             size_t length = block_length(result);
             for (size_t i = 0; i < length; i++)
@@ -68,9 +79,17 @@ void block_append_data(block_p *block_ptr, size_t sz, tree_p *data)
         }
         result->length += sz;
     }
-    block_unref(block);
-    if (result != block)
+    if (in_place)
+    {
+        // The realloc may have moved the block, so unref the new location
+        block_unref(result);
+        *block_ptr = result;
+    }
+    else
+    {
+        block_unref(block);
         block_set(block_ptr, result);
+    }
 }
 
 
@@ -92,8 +111,8 @@ void block_range(block_p *block_ptr, size_t first, size_t length)
     if (block_ref(block))
     {
         in_place = (block_p) tree_malloc(resized_bytes);
-        memcpy(in_place, block, sizeof(block_t));
-        in_place->tree.refcount = 0;
+        tree_copy_memory((tree_p) in_place, (tree_p) block, sizeof(block_t));
+        block_use_names(in_place);
     }
     tree_p *src_data = block_data(block) + first;
     tree_p *dst_data = block_data(in_place);
@@ -119,10 +138,14 @@ void block_range(block_p *block_ptr, size_t first, size_t length)
     {
         // We did the in_place in place: need to truncate result
         in_place = (block_p) tree_realloc((tree_p) in_place, resized_bytes);
+        block_unref(in_place);
+        *block_ptr = in_place;
     }
-    block_unref(block);
-    if (in_place != block)
+    else
+    {
+        block_unref(block);
         block_set(block_ptr, in_place);
+    }
 }
 
 
@@ -141,28 +164,6 @@ tree_p block_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "block";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (is dynamic for blocks)
-        return (tree_p) (sizeof(block_t) + block->length * sizeof(tree_p));
-
-    case TREE_ARITY:
-        // Blocks have a variable number of children
-        return (tree_p) (block->length + 3);
-
-    case TREE_CHILDREN:
-        // Return pointer to first child, which is right after the block
-        return (tree_p) &block->opening;
-
-    case TREE_CAST:
-        // Check if we cast to block type, if so, success
-        if (tree_cast_handler(va) == block_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
     case TREE_INITIALIZE:
         // Fetch creation arguments from new
         opening = va_arg(va, name_p);
@@ -206,3 +207,20 @@ tree_p block_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     }
     return tree_handler(cmd, tree, va);
 }
+
+
+tree_class_t block_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for blocks, children are opening, closing, separator, items
+// ----------------------------------------------------------------------------
+{
+    .name       = "block",
+    .handler    = block_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(block_t),
+    .arity      = 3,
+    .children   = offsetof(block_t, opening),
+    .length     = offsetof(block_t, length),
+    .item_size  = sizeof(tree_p),
+    .item_arity = 1,
+};
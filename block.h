@@ -59,7 +59,7 @@ inline name_p   block_separator(block_p block);
 
 // Private block handler, should not be called directly in general
 extern tree_p  block_handler(tree_cmd_t cmd, tree_p tree, va_list va);
-inline block_p block_make(tree_handler_fn h, srcpos_t,
+inline block_p block_make(tree_class_p, srcpos_t,
                           name_p opening, name_p closing, name_p separator,
                           size_t, tree_p *data);
 
@@ -73,14 +73,15 @@ inline block_p block_make(tree_handler_fn h, srcpos_t,
 //
 // ============================================================================
 
-inline block_p block_make(tree_handler_fn h, srcpos_t pos,
+inline block_p block_make(tree_class_p class, srcpos_t pos,
                           name_p opening, name_p closing, name_p separator,
                           size_t sz, tree_p *data)
 // ----------------------------------------------------------------------------
 //   Create an block with the given parameters
 // ----------------------------------------------------------------------------
 {
-    return (block_p) tree_make(h, pos, opening, closing, separator, sz, data);
+    return (block_p) tree_make(class, pos,
+                               opening, closing, separator, sz, data);
 }
 
 
@@ -89,7 +90,7 @@ inline block_p block_new(srcpos_t position, name_p open, name_p close)
 //    Allocate a block with the given data
 // ----------------------------------------------------------------------------
 {
-    return block_make(block_handler, position, open, close, NULL, 0, NULL);
+    return block_make(&block_class, position, open, close, NULL, 0, NULL);
 }
 
 
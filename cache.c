@@ -0,0 +1,255 @@
+// ****************************************************************************
+//  cache.c                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     On-disk cache of parse trees
+//
+//     Each entry is a tree frozen with positions relative to the start of
+//     the source file, so that it can be thawed wherever the file is
+//     opened in the global positions.
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "cache.h"
+#include "arena.h"
+#include "error.h"
+#include "recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RECORDER(CACHE, 32, "Parse cache");
+RECORDER(cache_warning, 16, "Warnings about the parse cache");
+
+
+static uint64_t cache_data_hash(size_t size, const unsigned char *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of some source code
+// ----------------------------------------------------------------------------
+{
+    uint64_t result = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+        result = (result ^ data[i]) * 1099511628211ull;
+    return result;
+}
+
+
+static bool cache_source_hash(const char *filename,
+                              uint64_t *hash, size_t *size)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of the contents of a source file
+// ----------------------------------------------------------------------------
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    struct stat st;
+    bool ok = fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+    uint64_t result = cache_data_hash(0, NULL);
+    if (ok && st.st_size)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                         fileno(f), 0);
+        ok = map != MAP_FAILED;
+        if (ok)
+        {
+            result = cache_data_hash(st.st_size, map);
+            munmap(map, st.st_size);
+        }
+    }
+    fclose(f);
+
+    *hash = result;
+    *size = ok ? st.st_size : 0;
+    return ok;
+}
+
+
+static char *cache_entry(const char *cache, uint64_t source, uint64_t syntax)
+// ----------------------------------------------------------------------------
+//   Return the name of the cache entry for the given hashes
+// ----------------------------------------------------------------------------
+{
+    size_t size = strlen(cache) + 40;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%016llx%016llx.xlc", cache,
+             (unsigned long long) source, (unsigned long long) syntax);
+    return path;
+}
+
+
+static unsigned cache_read(void *stream, unsigned size, void *data)
+// ----------------------------------------------------------------------------
+//   Read a cache entry
+// ----------------------------------------------------------------------------
+{
+    return fread(data, 1, size, (FILE *) stream);
+}
+
+
+static unsigned cache_write(void *stream, unsigned size, void *data)
+// ----------------------------------------------------------------------------
+//   Write a cache entry
+// ----------------------------------------------------------------------------
+{
+    return fwrite(data, 1, size, (FILE *) stream);
+}
+
+
+static tree_p cache_load(const char *path, const char *filename, size_t size,
+                         positions_p positions)
+// ----------------------------------------------------------------------------
+//   Thaw a cache entry as if the file had been parsed, NULL if none
+// ----------------------------------------------------------------------------
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    // Thawing needs the classes, even if nothing was parsed yet
+    parser_classes_register();
+
+    // Thaw in an arena like the parser, see parser_new_with_arena
+    srcpos_t start = position(positions);
+    arena_p arena = arena_new();
+    arena_p saved = tree_set_arena(arena);
+    tree_p tree = tree_thaw_relative(start, cache_read, f);
+    tree_set_arena(saved);
+    arena_delete(arena);
+    fclose(f);
+
+    if (!tree)
+    {
+        record(cache_warning, "Ignoring invalid cache entry %s for %s",
+               path, filename);
+        return NULL;
+    }
+
+    // Record positions like the scanner would
+    position_open_source_file(positions, filename);
+    position_skip(positions, size);
+    RECORD(CACHE, "Loaded %s from %s", filename, path);
+    return tree;
+}
+
+
+static void cache_store(const char *path, tree_p tree, srcpos_t start)
+// ----------------------------------------------------------------------------
+//   Write a cache entry, renaming it at the end so that it is never partial
+// ----------------------------------------------------------------------------
+{
+    size_t size = strlen(path) + 8;
+    char *temp = malloc(size);
+    snprintf(temp, size, "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool ok = f && tree_freeze_relative(tree, start, cache_write, f);
+    if (f)
+        ok = fclose(f) == 0 && ok;
+    else if (fd >= 0)
+        close(fd);
+    if (ok)
+        ok = rename(temp, path) == 0;
+    if (!ok)
+    {
+        record(cache_warning, "Could not write cache entry %s", path);
+        if (fd >= 0)
+            unlink(temp);
+    }
+    else
+    {
+        RECORD(CACHE, "Stored %s", path);
+    }
+    free(temp);
+}
+
+
+static tree_p cache_parse_source(const char *cache, bool share,
+                                 const char *filename,
+                                 size_t size, const char *data,
+                                 positions_p positions, syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Load the source from the cache, or parse it, from data if not NULL
+// ----------------------------------------------------------------------------
+{
+    uint64_t source, hash = syntax_hash(syntax);
+    char *path = NULL;
+    tree_p tree = NULL;
+    bool hashed = true;
+    if (data)
+        source = cache_data_hash(size, (const unsigned char *) data);
+    else
+        hashed = cache_source_hash(filename, &source, &size);
+    if (hashed)
+    {
+        path = cache_entry(cache, source, hash);
+        tree = cache_load(path, filename, size, positions);
+        if (tree)
+        {
+            free(path);
+            return tree;
+        }
+    }
+
+    // Not in cache, parse the file and cache it if this can be reused
+    srcpos_t start = position(positions);
+    errors_p saved = errors_save();
+    parser_p parser = data
+        ? parser_new_with_data(filename, size, data, positions, syntax)
+        : parser_new_with_arena(filename, positions, syntax);
+    parser_set_sharing(parser, share);
+    tree = tree_use(parser_parse(parser));
+    parser_delete(parser);
+    bool cacheable = errors_count() == 0 && syntax_hash(syntax) == hash;
+    errors_commit(saved);
+
+    if (path && tree && cacheable)
+    {
+        mkdir(cache, 0777);
+        cache_store(path, tree, start);
+    }
+    free(path);
+    if (tree)
+        tree_unref(tree);
+    return tree;
+}
+
+
+tree_p cache_parse(const char *cache, bool share, const char *filename,
+                   positions_p positions, syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Parse a file, or load its parse tree from the given cache directory
+// ----------------------------------------------------------------------------
+//   Like parser_parse, the result is not referenced. If share is set,
+//   identical subtrees are shared while parsing, see parser_set_sharing.
+{
+    return cache_parse_source(cache, share, filename, 0, NULL,
+                              positions, syntax);
+}
+
+
+tree_p cache_parse_data(const char *cache, bool share, const char *filename,
+                        size_t size, const char *data,
+                        positions_p positions, syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Like cache_parse, for a file whose contents were already read
+// ----------------------------------------------------------------------------
+{
+    return cache_parse_source(cache, share, filename, size, data,
+                              positions, syntax);
+}
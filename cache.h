@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+// ****************************************************************************
+//  cache.h                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     On-disk cache of parse trees
+//
+//     A source file is parsed only if the cache directory does not hold
+//     a frozen tree for the same file contents parsed with the same syntax.
+//     Entries are named after a hash of the source and a hash of the
+//     syntax, so that they remain valid if files are moved, and that
+//     changing the syntax files invalidates them.
+//     Files that change the syntax while being parsed, e.g. with 'syntax'
+//     statements, or that have errors, are not cached, since a cache hit
+//     would neither change the syntax nor report the errors.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "parser.h"
+
+
+// Parse a file, or load its parse tree from the given cache directory
+extern tree_p cache_parse(const char *cache, bool share, const char *filename,
+                          positions_p positions, syntax_p syntax);
+extern tree_p cache_parse_data(const char *cache, bool share,
+                               const char *filename,
+                               size_t size, const char *data,
+                               positions_p positions, syntax_p syntax);
+
+#endif // CACHE_H
@@ -30,36 +30,12 @@ tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 {
     size_t           size;
     renderer_p       renderer;
-    tree_handler_fn  cast_type;
     delimited_text_p dt;
     text_p           value;
     name_p           opening, closing;
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "delimited_text";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (may be dynamic for subtypes)
-        return (tree_p) sizeof(delimited_text_t);
-
-    case TREE_ARITY:
-        // This has three children
-        return (tree_p) 3;
-
-    case TREE_CHILDREN:
-        // The children are right after the tree_t part
-        return (tree_p) (tree + 1);
-
-    case TREE_CAST:
-        // Return the tree if we cast to tree
-        cast_type = tree_cast_handler(va);
-        if (cast_type == delimited_text_handler)
-            return tree;
-        break;                  // Fall through to regular text handling
-
     case TREE_INITIALIZE:
         value = va_arg(va, text_p);
         opening = va_arg(va, name_p);
@@ -69,10 +45,13 @@ tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         dt->value = text_use(value);
         dt->opening = name_use(opening);
         dt->closing = name_use(closing);
+        return (tree_p) dt;
 
     case TREE_DELETE:
     case TREE_COPY:
     case TREE_CLONE:
+    case TREE_FREEZE:
+    case TREE_THAW:
         // These cases are handled directly by the tree handler
         return tree_handler(cmd, tree, va);
 
@@ -86,13 +65,6 @@ tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         render(renderer, (tree_p) dt->closing);
         return tree;
 
-    case TREE_FREEZE:
-        assert(!"Not yet implemented");
-        return tree;
-    case TREE_THAW:
-        assert(!"Not yet implemented");
-        return tree;
-
     default:
         break;
     }
@@ -101,3 +73,17 @@ tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     dt = (delimited_text_p) tree;
     return text_handler(cmd, (tree_p) dt->value, va);
 }
+
+
+tree_class_t delimited_text_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for delimited text, children are value, opening and closing
+// ----------------------------------------------------------------------------
+{
+    .name       = "delimited_text",
+    .handler    = delimited_text_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(delimited_text_t),
+    .arity      = 3,
+    .children   = offsetof(delimited_text_t, value),
+};
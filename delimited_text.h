@@ -42,10 +42,10 @@ typedef struct delimited_text
 tree_type(delimited_text);
 inline delimited_text_p delimited_text_new(srcpos_t position, text_p value,
                                            name_p opening, name_p closing);
-inline delimited_text_p delimited_text_make(tree_handler_fn h,
+inline delimited_text_p delimited_text_make(tree_class_p class,
                                             srcpos_t position, text_p value,
                                             name_p opening, name_p closing);
-extern tree_p dellmited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va);
+extern tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 #undef inline
 
@@ -56,14 +56,15 @@ extern tree_p dellmited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 //
 // ============================================================================
 
-inline delimited_text_p delimited_text_make(tree_handler_fn h,
+inline delimited_text_p delimited_text_make(tree_class_p class,
                                             srcpos_t position, text_p value,
                                             name_p opening, name_p closing)
 // ----------------------------------------------------------------------------
-//   Make a delimited text with a specific handler
+//   Make a delimited text with a specific class
 // ----------------------------------------------------------------------------
 {
-    return (delimited_text_p) tree_make(h, position, value, opening, closing);
+    return (delimited_text_p) tree_make(class, position,
+                                        value, opening, closing);
 }
 
 inline delimited_text_p delimited_text_new(srcpos_t position, text_p value,
@@ -72,7 +73,7 @@ inline delimited_text_p delimited_text_new(srcpos_t position, text_p value,
 //   Build new delimited text
 // ----------------------------------------------------------------------------
 {
-    return delimited_text_make(delimited_text_handler,
+    return delimited_text_make(&delimited_text_class,
                                position, value, opening, closing);
 }
 
@@ -38,9 +38,10 @@
 array_type(text, errors);
 #undef inline
 
-static errors_p    errors    = NULL;
-static positions_p positions = NULL;
-static renderer_p  renderer  = NULL;
+// Each thread has its own errors, positions and renderer
+static __thread errors_p    errors    = NULL;
+static __thread positions_p positions = NULL;
+static __thread renderer_p  renderer  = NULL;
 
 RECORDER(ERROR, 64, "Error messages being recorder");
 
@@ -51,33 +52,28 @@ RECORDER(ERROR, 64, "Error messages being recorder");
 //
 // ============================================================================
 
-static void error_display(text_p error)
+static void error_display_info(text_p error, position_p posinfo, bool ok)
 // ----------------------------------------------------------------------------
-//    Display the error
+//    Display the error with the given file / line information
 // ----------------------------------------------------------------------------
 {
-    // Retrieve file / line information from position
-    srcpos_t pos = text_position(error);
-    position_t posinfo = { 0 };
-    bool ok = position_info(positions, pos, &posinfo);
-
     // Printout the message
     if (ok)
     {
         fprintf(stderr, "%s:%d: %.*s\n",
-                posinfo.file, posinfo.line,
+                posinfo->file, posinfo->line,
                 (int) text_length(error), text_data(error));
 
         // Retrieve source code
-        size_t size = posinfo.line_length + 1;
+        size_t size = posinfo->line_length + 1;
         char *buffer = malloc(size);
-        ok = position_source(&posinfo, buffer, size);
+        ok = position_source(posinfo, buffer, size);
         if (ok)
         {
             fprintf(stderr, "  %s\n", buffer);
 
             // Display caret to show column position
-            int col = (int) posinfo.column;
+            int col = (int) posinfo->column;
             fprintf(stderr, "  %*s^\n", col, "");
         }
         free(buffer);
@@ -90,15 +86,44 @@ static void error_display(text_p error)
 }
 
 
+static void error_display(text_p error)
+// ----------------------------------------------------------------------------
+//    Display the error
+// ----------------------------------------------------------------------------
+{
+    // Retrieve file / line information from position
+    srcpos_t pos = text_position(error);
+    position_t posinfo = { 0 };
+    bool ok = position_info(positions, pos, &posinfo);
+    error_display_info(error, &posinfo, ok);
+}
+
+
 static void errors_display(errors_p *errors)
 // ----------------------------------------------------------------------------
 //   Display all errors in a saved errors list and clear it
 // ----------------------------------------------------------------------------
 {
     size_t count = errors_length(*errors);
+    if (!count)
+    {
+        errors_dispose(errors);
+        return;
+    }
     text_p *errs = errors_data(*errors);
+
+    // Retrieve file / line information for all errors at once
+    srcpos_t *pos = malloc(count * sizeof(srcpos_t));
+    position_t *posinfo = malloc(count * sizeof(position_t));
+    for (size_t e = 0; e < count; e++)
+        pos[e] = text_position(errs[e]);
+    positions_info(positions, count, pos, posinfo);
+
     for (size_t e = 0; e < count; e++)
-        error_display(errs[e]);
+        error_display_info(errs[e], &posinfo[e], posinfo[e].file != NULL);
+
+    free(posinfo);
+    free(pos);
     errors_dispose(errors);
 }
 
@@ -204,7 +229,7 @@ errors_p errors_save()
 {
     errors_p result = errors;
     srcpos_t position = positions ? positions->position : 0;
-    errors_set(&errors, errors_new(position, 0, NULL));
+    errors = errors_use(errors_new(position, 0, NULL));
     return result;
 }
 
@@ -218,7 +243,8 @@ void errors_commit(errors_p saved_errors)
     {
         // Append errors to previous ones
         errors_append(&saved_errors, errors);
-        errors_set(&errors, (errors_p) saved_errors);
+        errors_dispose(&errors);
+        errors = saved_errors;
     }
     else
     {
@@ -238,6 +264,25 @@ void errors_clear(errors_p saved_errors)
 }
 
 
+void errors_report(errors_p reported)
+// ----------------------------------------------------------------------------
+//   Add errors saved elsewhere, e.g. in another thread, to current context
+// ----------------------------------------------------------------------------
+{
+    if (!reported)
+        return;
+    if (errors)
+    {
+        errors_append(&errors, reported);
+        errors_dispose(&reported);
+    }
+    else
+    {
+        errors_display(&reported);
+    }
+}
+
+
 unsigned errors_count()
 // ----------------------------------------------------------------------------
 //   Return the number of errors in the current error list
@@ -248,4 +293,4 @@ unsigned errors_count()
 }
 
 
-blob_type_handler(errors);
+array_type_class(errors);
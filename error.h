@@ -43,6 +43,7 @@ extern renderer_p   error_set_renderer(renderer_p);
 extern errors_p     errors_save(void);
 extern void         errors_commit(errors_p errors);
 extern void         errors_clear(errors_p errors);
+extern void         errors_report(errors_p errors);
 extern unsigned     errors_count(void);
 
 #endif // ERROR_H
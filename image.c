@@ -0,0 +1,554 @@
+// ****************************************************************************
+//  image.c                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Tree images, i.e. files that contain trees laid out in memory form
+//
+//     In the image, fields that point to other trees hold a reference,
+//     which is the offset of a tree in the image (0 for NULL) or the
+//     index of a class, tagged in the low bits. Trees are aligned,
+//     so offsets always have the low bits clear.
+//     Each tree in the image has a reference count that is one more than
+//     the number of references to it in the image, so that it is never
+//     freed, since its memory belongs to the image.
+//     With the compact tree layout, the class of a tree is a 16-bit index,
+//     so the relocation of the class field is flagged in the relocation
+//     table, and the index in the image is replaced with the class_id.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "image.h"
+#include "recorder.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+RECORDER(image_warning, 16, "Warnings about tree images");
+
+
+// Tags in the low bits of references
+#define IMAGE_TREE              0
+#define IMAGE_CLASS             1
+#define IMAGE_TAG_BITS          2
+#define IMAGE_TAG_MASK          ((1 << IMAGE_TAG_BITS) - 1)
+
+// Flag in the relocation table for class_id fields, see TREE_COMPACT
+#define IMAGE_CLASS_ID          0x80000000u
+
+// Alignment of trees and tables in the image
+#define IMAGE_ALIGN             16
+#define IMAGE_ALIGNED(sz)       (((sz) + IMAGE_ALIGN-1) & ~(IMAGE_ALIGN-1))
+
+
+typedef struct image_class
+// ----------------------------------------------------------------------------
+//   Entry in the class table, followed by the class name and alignment
+// ----------------------------------------------------------------------------
+{
+    uint32_t            size;           // Size of the fixed part of trees
+    uint32_t            length;         // Length of the class name
+} image_class_t;
+
+
+typedef struct image_entry
+// ----------------------------------------------------------------------------
+//   A tree already written, in the hash table of the writer
+// ----------------------------------------------------------------------------
+{
+    tree_p              tree;           // Tree, NULL if entry is free
+    uintptr_t           ref;            // Reference to the tree in image
+    uint32_t            refs;           // Number of references to tree
+} image_entry_t;
+
+
+typedef struct image_child
+// ----------------------------------------------------------------------------
+//   A child that remains to be written, and where to store its reference
+// ----------------------------------------------------------------------------
+{
+    size_t              slot;           // Offset of the child field
+    tree_p              tree;           // Child tree
+} image_child_t;
+
+
+typedef struct image_writer
+// ----------------------------------------------------------------------------
+//   State while writing an image
+// ----------------------------------------------------------------------------
+{
+    char *              buffer;
+    size_t              size;
+    size_t              allocated;
+    srcpos_t            base;           // Positions are relative to this
+
+    // Trees already written
+    image_entry_t *     table;
+    size_t              table_size;     // Always a power of two
+    size_t              table_count;
+
+    // Classes, in order of appearance
+    tree_class_p *      classes;
+    size_t              class_count;
+
+    // Fields to relocate, as an index in units of pointers
+    uint32_t *          relocations;
+    size_t              relocation_count;
+
+    // Children remaining to write
+    image_child_t *     stack;
+    size_t              stack_count;
+} image_writer_t, *image_writer_p;
+
+
+
+// ============================================================================
+//
+//    Writing images
+//
+// ============================================================================
+
+static void *image_append(image_writer_p w, size_t size, size_t *offset)
+// ----------------------------------------------------------------------------
+//   Reserve aligned space at the end of the buffer, return its address
+// ----------------------------------------------------------------------------
+{
+    size = IMAGE_ALIGNED(size);
+    if (w->size + size > w->allocated)
+    {
+        size_t allocated = w->allocated ? w->allocated : 64 * 1024;
+        while (allocated < w->size + size)
+            allocated *= 2;
+        w->buffer = realloc(w->buffer, allocated);
+        w->allocated = allocated;
+    }
+    *offset = w->size;
+    memset(w->buffer + w->size, 0, size);
+    w->size += size;
+    return w->buffer + *offset;
+}
+
+
+#define image_grow(w, array, count)                                     \
+    do                                                                  \
+    {                                                                   \
+        size_t n = (count);                                             \
+        if ((n & (n - 1)) == 0)                                         \
+            (array) = realloc((array), (n ? 2 * n : 1) * sizeof(*(array))); \
+    } while (0)
+
+
+static void image_relocate(image_writer_p w, size_t slot)
+// ----------------------------------------------------------------------------
+//   Record that the pointer-sized field at the given offset is a reference
+// ----------------------------------------------------------------------------
+{
+    image_grow(w, w->relocations, w->relocation_count);
+    w->relocations[w->relocation_count++] = slot / sizeof(uintptr_t);
+}
+
+
+#if TREE_COMPACT
+static void image_relocate_class(image_writer_p w, size_t offset)
+// ----------------------------------------------------------------------------
+//   Record that the tree at the given offset has a class index to patch
+// ----------------------------------------------------------------------------
+{
+    image_grow(w, w->relocations, w->relocation_count);
+    w->relocations[w->relocation_count++] =
+        (offset / sizeof(uintptr_t)) | IMAGE_CLASS_ID;
+}
+#endif // TREE_COMPACT
+
+
+static uintptr_t image_class_ref(image_writer_p w, tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Return the reference for a class, adding it to the class table
+// ----------------------------------------------------------------------------
+{
+    size_t index;
+    for (index = 0; index < w->class_count; index++)
+        if (w->classes[index] == class)
+            break;
+    if (index == w->class_count)
+    {
+        image_grow(w, w->classes, w->class_count);
+        w->classes[w->class_count++] = class;
+    }
+    return (index << IMAGE_TAG_BITS) | IMAGE_CLASS;
+}
+
+
+static image_entry_t *image_find(image_writer_p w, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Find the entry for a tree, or the free entry where to put it
+// ----------------------------------------------------------------------------
+{
+    if (2 * (w->table_count + 1) > w->table_size)
+    {
+        image_entry_t *old = w->table;
+        size_t old_size = w->table_size;
+        w->table_size = old_size ? 2 * old_size : 1024;
+        w->table = calloc(w->table_size, sizeof(image_entry_t));
+        for (size_t i = 0; i < old_size; i++)
+        {
+            if (!old[i].tree)
+                continue;
+            image_entry_t *entry = image_find(w, old[i].tree);
+            *entry = old[i];
+        }
+        free(old);
+    }
+
+    uintptr_t key = (uintptr_t) tree;
+    size_t mask = w->table_size - 1;
+    size_t index = ((key >> 4) ^ (key >> 12)) & mask;
+    while (w->table[index].tree && w->table[index].tree != tree)
+        index = (index + 1) & mask;
+    return &w->table[index];
+}
+
+
+static uintptr_t image_tree_ref(image_writer_p w, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the reference for a tree, writing the tree if needed
+// ----------------------------------------------------------------------------
+//   Children are not written recursively, but pushed on the stack.
+{
+    if (!tree)
+        return 0;
+
+    image_entry_t *entry = image_find(w, tree);
+    if (entry->tree)
+    {
+        entry->refs++;
+        return entry->ref;
+    }
+    entry->tree = tree;
+    entry->refs = 1;
+    w->table_count++;
+
+    // Copy the tree, and replace the class with a reference
+    // Immediates are written as regular trees, since their encoding
+    // depends on how the program that reads the image was built
+    tree_box_t box;
+    tree_p source = tree_unbox(tree, &box);
+    tree_class_p class = tree_class_of(tree);
+    size_t offset;
+    size_t size = tree_size(tree);
+    tree_p copy = image_append(w, size, &offset);
+    memcpy(copy, source, size);
+    copy->position -= w->base;
+    copy->flags = 0;
+#if TREE_COMPACT
+    copy->class_id = image_class_ref(w, class) >> IMAGE_TAG_BITS;
+    image_relocate_class(w, offset);
+#else
+    copy->class = (tree_class_p) image_class_ref(w, class);
+    image_relocate(w, offset + offsetof(tree_t, class));
+#endif // TREE_COMPACT
+    entry->ref = offset;
+
+    // Children will be written later, in order
+    size_t arity = tree_arity(tree);
+    size_t first = offset + class->children;
+    tree_p *children = tree_children(tree);
+    while (arity--)
+    {
+        if (!children[arity])
+            continue;
+        image_grow(w, w->stack, w->stack_count);
+        image_child_t *child = &w->stack[w->stack_count++];
+        child->slot = first + arity * sizeof(tree_p);
+        child->tree = children[arity];
+    }
+    return entry->ref;
+}
+
+
+bool image_write(tree_p tree, srcpos_t base, tree_io_fn output, void *stream)
+// ----------------------------------------------------------------------------
+//   Write the tree as an image, with positions relative to base
+// ----------------------------------------------------------------------------
+//   This works for trees where all pointers are children, like parse trees.
+//   Like for tree_freeze_relative, base is typically the start of a file.
+{
+    image_writer_t w = { 0 };
+    w.base = base;
+    size_t offset;
+    image_append(&w, sizeof(image_header_t), &offset);
+
+    // Write all the trees
+    uintptr_t root = image_tree_ref(&w, tree);
+    while (w.stack_count)
+    {
+        image_child_t child = w.stack[--w.stack_count];
+        uintptr_t ref = image_tree_ref(&w, child.tree);
+        *(uintptr_t *) (w.buffer + child.slot) = ref;
+        image_relocate(&w, child.slot);
+    }
+
+    // The image holds one more reference to each tree than its parents,
+    // so that trees are never freed into the mapping
+    for (size_t i = 0; i < w.table_size; i++)
+    {
+        image_entry_t *entry = &w.table[i];
+        if (entry->tree)
+        {
+            tree_p copy = (tree_p) (w.buffer + entry->ref);
+            copy->refcount = entry->refs + 1;
+        }
+    }
+
+    // Write the classes
+    size_t classes = w.size;
+    for (size_t c = 0; c < w.class_count; c++)
+    {
+        tree_class_p class = w.classes[c];
+        size_t length = strlen(class->name);
+        image_class_t *entry = image_append(&w, sizeof(image_class_t) + length,
+                                            &offset);
+        entry->size = class->size;
+        entry->length = length;
+        memcpy(entry + 1, class->name, length);
+    }
+
+    // Write the relocations
+    size_t relocations = w.size;
+    size_t relocations_size = w.relocation_count * sizeof(uint32_t);
+    void *reloc = image_append(&w, relocations_size, &offset);
+    memcpy(reloc, w.relocations, relocations_size);
+
+    // Fill the header and write the whole image at once
+    image_header_t *header = (image_header_t *) w.buffer;
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    header->version = IMAGE_VERSION;
+    header->pointer_size = sizeof(void *);
+    header->tree_size = sizeof(tree_t);
+    header->size = w.size;
+    header->root = root;
+    header->classes = classes;
+    header->class_count = w.class_count;
+    header->relocations = relocations;
+    header->relocation_count = w.relocation_count;
+    bool ok = output(stream, w.size, w.buffer) == w.size;
+
+    free(w.buffer);
+    free(w.table);
+    free(w.classes);
+    free(w.relocations);
+    free(w.stack);
+    return ok;
+}
+
+
+
+// ============================================================================
+//
+//    Loading images
+//
+// ============================================================================
+
+static tree_p image_resolve(image_p image, tree_class_p *classes,
+                            uintptr_t ref)
+// ----------------------------------------------------------------------------
+//   Convert a reference into a pointer, NULL if the reference is invalid
+// ----------------------------------------------------------------------------
+{
+    image_header_t *header = image->header;
+    uintptr_t index = ref >> IMAGE_TAG_BITS;
+    switch (ref & IMAGE_TAG_MASK)
+    {
+    case IMAGE_TREE:
+        if (ref < sizeof(image_header_t) || ref >= header->classes)
+            return NULL;
+        return (tree_p) ((char *) header + ref);
+    case IMAGE_CLASS:
+        if (index >= header->class_count)
+            return NULL;
+        return (tree_p) classes[index];
+    default:
+        return NULL;
+    }
+}
+
+
+static bool image_load(image_p image, srcpos_t position)
+// ----------------------------------------------------------------------------
+//   Check the header, find classes, and relocate the image
+// ----------------------------------------------------------------------------
+//   Only the header and the tables are checked, trees are not walked.
+//   Relocating the class of a tree also adds position to its position.
+{
+    image_header_t *header = image->header;
+    char *base = (char *) header;
+    size_t size = image->size;
+    if (size < sizeof(image_header_t) ||
+        memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION ||
+        header->pointer_size != sizeof(void *) ||
+        header->tree_size != sizeof(tree_t) ||
+        header->size != size ||
+        header->classes > header->relocations ||
+        header->relocations > size ||
+        header->class_count >
+        (header->relocations - header->classes) / sizeof(image_class_t) ||
+        header->relocation_count >
+        (size - header->relocations) / sizeof(uint32_t))
+    {
+        record(image_warning, "Invalid image header");
+        return false;
+    }
+
+    // Find the classes, they must have the same layout as when written
+    bool ok = true;
+    size_t offset = header->classes;
+    tree_class_p *classes = calloc(header->class_count, sizeof(tree_class_p));
+    for (size_t c = 0; ok && c < header->class_count; c++)
+    {
+        image_class_t *entry = (image_class_t *) (base + offset);
+        if (offset + sizeof(image_class_t) > header->relocations ||
+            entry->length > header->relocations - offset
+                                                - sizeof(image_class_t))
+        {
+            record(image_warning, "Invalid class table");
+            ok = false;
+            break;
+        }
+        tree_class_p class = tree_class_find(entry->length,
+                                             (const char *) (entry + 1));
+        if (!class || class->size != entry->size)
+        {
+            record(image_warning, "Class %.*s is unknown or has changed",
+                   (int) entry->length, (const char *) (entry + 1));
+            ok = false;
+            break;
+        }
+        tree_class_register(class);
+        classes[c] = class;
+        offset += IMAGE_ALIGNED(sizeof(image_class_t) + entry->length);
+    }
+
+    // Replace references with pointers
+    uint32_t *relocations = (uint32_t *) (base + header->relocations);
+    uintptr_t *fields = (uintptr_t *) base;
+    size_t first = sizeof(image_header_t) / sizeof(uintptr_t);
+    size_t limit = header->classes / sizeof(uintptr_t);
+    for (size_t r = 0; ok && r < header->relocation_count; r++)
+    {
+        size_t index = relocations[r];
+#if TREE_COMPACT
+        if (index & IMAGE_CLASS_ID)
+        {
+            // Replace the index in the class table with the class_id,
+            // and rebase the position of the tree
+            size_t offset = (index & ~IMAGE_CLASS_ID) * sizeof(uintptr_t);
+            tree_p tree = (tree_p) (base + offset);
+            ok = offset >= sizeof(image_header_t) &&
+                offset + sizeof(tree_t) <= header->classes &&
+                tree->class_id < header->class_count;
+            if (ok)
+            {
+                tree->class_id = classes[tree->class_id]->id;
+                tree->position += position;
+            }
+            continue;
+        }
+#endif // TREE_COMPACT
+        if (index < first || index >= limit)
+        {
+            ok = false;
+            break;
+        }
+        uintptr_t ref = fields[index];
+        tree_p target = image_resolve(image, classes, ref);
+        if (!target)
+        {
+            ok = false;
+            break;
+        }
+        fields[index] = (uintptr_t) target;
+
+#if !TREE_COMPACT
+        // Each tree has exactly one class field, rebase its position there
+        if ((ref & IMAGE_TAG_MASK) == IMAGE_CLASS)
+        {
+            size_t at = index * sizeof(uintptr_t) - offsetof(tree_t, class);
+            ((tree_p) (base + at))->position += position;
+        }
+#endif // TREE_COMPACT
+    }
+
+    if (ok)
+    {
+        image->root = image_resolve(image, classes, header->root);
+        ok = image->root || !header->root;
+    }
+    if (!ok)
+        record(image_warning, "Invalid references in image");
+    free(classes);
+    return ok;
+}
+
+
+image_p image_open(const char *path, srcpos_t base)
+// ----------------------------------------------------------------------------
+//   Map an image in memory, return NULL if it cannot be used
+// ----------------------------------------------------------------------------
+//   Positions in the image are rebased by adding base, see image_write.
+//   The mapping is private, so that pages that are not relocated and
+//   trees whose reference count does not change remain shared.
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fileno(f), 0);
+    fclose(f);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    image_p image = malloc(sizeof(image_t));
+    image->header = map;
+    image->size = st.st_size;
+    image->root = NULL;
+    if (!image_load(image, base))
+    {
+        image_close(image);
+        return NULL;
+    }
+    return image;
+}
+
+
+void image_close(image_p image)
+// ----------------------------------------------------------------------------
+//   Unmap an image
+// ----------------------------------------------------------------------------
+//   Trees in the image must no longer be used after this.
+{
+    munmap(image->header, image->size);
+    free(image);
+}
+
+
+tree_p image_root(image_p image)
+// ----------------------------------------------------------------------------
+//   Return the root tree of the image
+// ----------------------------------------------------------------------------
+{
+    return image->root;
+}
@@ -0,0 +1,72 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+// ****************************************************************************
+//  image.h                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Tree images, i.e. files that contain trees laid out in memory form
+//
+//     An image is loaded with a single mmap, and its trees are used in
+//     place with the regular tree functions. In the file, the class and
+//     the children of each tree are offsets or indexes, and a relocation
+//     table lists where they are, so that loading only has to patch
+//     these fields in one linear pass, without allocating any tree.
+//     Names in parse trees are not interned, so they are regular trees
+//     in the image.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+typedef struct image_header
+// ----------------------------------------------------------------------------
+//   Header at the beginning of an image file
+// ----------------------------------------------------------------------------
+//   Offsets are from the beginning of the image. Trees follow the header,
+//   then the classes and the relocations.
+{
+    char                magic[4];       // IMAGE_MAGIC
+    uint32_t            version;        // IMAGE_VERSION
+    uint32_t            pointer_size;   // Size of pointers that wrote image
+    uint32_t            tree_size;      // Size of tree_t that wrote image
+    uint64_t            size;           // Total size of the image
+    uint64_t            root;           // Reference to the root tree
+    uint64_t            classes;        // Offset of class table
+    uint64_t            class_count;
+    uint64_t            relocations;    // Offset of relocation table
+    uint64_t            relocation_count;
+} image_header_t;
+
+
+typedef struct image
+// ----------------------------------------------------------------------------
+//   A loaded image
+// ----------------------------------------------------------------------------
+{
+    image_header_t *    header;         // Mapped image
+    size_t              size;           // Size of the mapping
+    tree_p              root;           // Root tree, once relocated
+} image_t, *image_p;
+
+#define IMAGE_MAGIC     "XLIM"
+#define IMAGE_VERSION   3
+
+
+// Writing a tree as an image, reading it back
+extern bool     image_write(tree_p tree, srcpos_t base,
+                            tree_io_fn output, void *stream);
+extern image_p  image_open(const char *path, srcpos_t base);
+extern void     image_close(image_p image);
+extern tree_p   image_root(image_p image);
+
+#endif // IMAGE_H
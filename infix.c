@@ -39,28 +39,6 @@ tree_p infix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "infix";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (is dynamic for infixs)
-        return (tree_p) (sizeof(infix_t));
-
-    case TREE_ARITY:
-        // Infix nodes have three children
-        return (tree_p) 3;
-
-    case TREE_CAST:
-        // Check if we cast to infix type, if so, success
-        if (tree_cast_handler(va) == infix_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
-    case TREE_CHILDREN:
-        // Pointer to the children is right after the tree 'header
-        return tree + 1;
-
     case TREE_INITIALIZE:
         // Fetch pointer to data and size from varargs list (see infix_new)
         opcode = va_arg(va, name_p);
@@ -88,3 +66,17 @@ tree_p infix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     }
     return tree_handler(cmd, tree, va);
 }
+
+
+tree_class_t infix_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for infix, children are left, right and opcode
+// ----------------------------------------------------------------------------
+{
+    .name       = "infix",
+    .handler    = infix_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(infix_t),
+    .arity      = 3,
+    .children   = offsetof(infix_t, left),
+};
@@ -47,7 +47,7 @@ inline tree_p       infix_left(infix_p infix);
 inline tree_p       infix_right(infix_p infix);
 
 // Private infix handler, should not be called directly in general
-inline infix_p      infix_make(tree_handler_fn h, srcpos_t pos,
+inline infix_p      infix_make(tree_class_p class, srcpos_t pos,
                                name_p opcode, tree_p left, tree_p right);
 extern tree_p       infix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
@@ -61,13 +61,13 @@ extern tree_p       infix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 //
 // ============================================================================
 
-inline infix_p infix_make(tree_handler_fn handler, srcpos_t pos,
+inline infix_p infix_make(tree_class_p class, srcpos_t pos,
                           name_p opcode, tree_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //   Create a infix with the given parameters
 // ----------------------------------------------------------------------------
 {
-    return (infix_p) tree_make(handler, pos, opcode, left, right);
+    return (infix_p) tree_make(class, pos, opcode, left, right);
 }
 
 
@@ -77,7 +77,7 @@ inline infix_p infix_new(srcpos_t position,
 //    Allocate a prefix with the given children
 // ----------------------------------------------------------------------------
 {
-    return infix_make(infix_handler, position, opcode, left, right);
+    return infix_make(&infix_class, position, opcode, left, right);
 }
 
 
@@ -19,49 +19,463 @@
 //   See LICENSE file for details.
 // ****************************************************************************
 
+#include "cache.h"
 #include "error.h"
+#include "image.h"
 #include "name.h"
 #include "number.h"
 #include "parser.h"
 #include "position.h"
 #include "recorder.h"
 #include "renderer.h"
+#include "scanner.h"
 #include "text.h"
 
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#ifndef PREFIX_PATH
+#define PREFIX_PATH  "/Users/ddd/Work/xl/"
+#endif
 
 
 RECORDER(MAIN, 32, "Main function");
 
+
+typedef struct main_job
+// ----------------------------------------------------------------------------
+//   A file given on the command line, and the result of parsing it
+// ----------------------------------------------------------------------------
+{
+    int                 arg;            // Index in command-line arguments
+    const char *        filename;       // File to parse
+    char *              data;           // Contents read before parsing
+    size_t              size;           // Number of bytes in data
+    positions_p         positions;      // Positions reserved for the file
+    srcpos_t            start;          // First position of the file
+    tree_p              tree;           // Parse tree, referenced
+    errors_p            errors;         // Errors found while parsing
+    bool                syntax_changed; // The file changed the syntax
+} main_job_t, *main_job_p;
+
+
+typedef struct main_jobs
+// ----------------------------------------------------------------------------
+//   Files parsed by worker threads
+// ----------------------------------------------------------------------------
+{
+    main_job_p          jobs;
+    size_t              count;
+    size_t              next;           // Next job to take, atomic
+    const char *        cache;          // Cache directory or NULL
+    bool                share;          // Share identical subtrees
+    syntax_p            syntax;         // Syntax files start with
+    uint64_t            syntax_hash;    // Hash of that syntax
+} main_jobs_t, *main_jobs_p;
+
+
+static unsigned main_freeze_write(void *stream, unsigned size, void *data)
+// ----------------------------------------------------------------------------
+//   Write a frozen tree
+// ----------------------------------------------------------------------------
+{
+    return fwrite(data, 1, size, (FILE *) stream);
+}
+
+
+static unsigned main_freeze_read(void *stream, unsigned size, void *data)
+// ----------------------------------------------------------------------------
+//   Read a frozen tree
+// ----------------------------------------------------------------------------
+{
+    return fread(data, 1, size, (FILE *) stream);
+}
+
+
+static tree_p main_freeze(const char *path, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Freeze the tree in the given file, and thaw it back, NULL if error
+// ----------------------------------------------------------------------------
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return NULL;
+    bool ok = tree_freeze(tree, main_freeze_write, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        return NULL;
+
+    f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    tree_p thawed = tree_thaw(main_freeze_read, f);
+    fclose(f);
+    return thawed;
+}
+
+
+static unsigned main_image_write(void *stream, unsigned size, void *data)
+// ----------------------------------------------------------------------------
+//   Write an image file
+// ----------------------------------------------------------------------------
+{
+    return fwrite(data, 1, size, (FILE *) stream);
+}
+
+
+static image_p main_image(const char *path, tree_p tree, srcpos_t base)
+// ----------------------------------------------------------------------------
+//   Write the tree as an image, and map it back, NULL in case of error
+// ----------------------------------------------------------------------------
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return NULL;
+    bool ok = image_write(tree, base, main_image_write, f);
+    ok = fclose(f) == 0 && ok;
+    return ok ? image_open(path, base) : NULL;
+}
+
+
+static void main_print_names(tree_p tree, positions_p positions)
+// ----------------------------------------------------------------------------
+//   Print the position of each name in the tree, in depth-first order
+// ----------------------------------------------------------------------------
+//   Names are printed as is, except for control characters like new-line
+{
+    if (!tree)
+        return;
+    name_p name = name_cast(tree);
+    if (name)
+    {
+        tree_box_t box;
+        name = (name_p) tree_unbox((tree_p) name, &box);
+        position_t pos;
+        if (position_info(positions, name_position(name), &pos))
+            fprintf(stderr, "\n%s:%u:%u: ", pos.file, pos.line, pos.column);
+        else
+            fprintf(stderr, "\nUnknown position %lu: ",
+                    (unsigned long) name_position(name));
+        const char *data = name_data(name);
+        for (size_t i = 0; i < name_length(name); i++)
+            fprintf(stderr, isprint((unsigned char) data[i]) ? "%c" : "\\%o",
+                    data[i]);
+    }
+    size_t arity = tree_arity(tree);
+    tree_p *children = tree_children(tree);
+    for (size_t c = 0; c < arity; c++)
+        main_print_names(children[c], positions);
+}
+
+
+static void main_print(tree_p tree, positions_p positions, bool names)
+// ----------------------------------------------------------------------------
+//   Print a tree, and the positions of its names if requested
+// ----------------------------------------------------------------------------
+{
+    tree_print(stderr, tree);
+    if (names)
+        main_print_names(tree, positions);
+}
+
+
+static tree_p main_parse(const char *cache, bool share, const char *filename,
+                         size_t size, const char *data,
+                         positions_p positions, syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Parse a file, possibly using the cache, and return a referenced tree
+// ----------------------------------------------------------------------------
+//   If data is not NULL, it holds the contents of the file.
+{
+    if (cache)
+        return tree_use(data
+                        ? cache_parse_data(cache, share, filename, size, data,
+                                           positions, syntax)
+                        : cache_parse(cache, share,
+                                      filename, positions, syntax));
+
+    parser_p parser = data
+        ? parser_new_with_data(filename, size, data, positions, syntax)
+        : parser_new_with_arena(filename, positions, syntax);
+    parser_set_sharing(parser, share);
+    tree_p tree = tree_use(parser_parse(parser));
+    parser_delete(parser);
+    return tree;
+}
+
+
+static char *main_read(const char *filename, size_t *size)
+// ----------------------------------------------------------------------------
+//   Read the contents of a file, NULL if it cannot be opened
+// ----------------------------------------------------------------------------
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return NULL;
+
+    size_t allocated = 4096;
+    size_t length = 0;
+    char *data = malloc(allocated);
+    size_t count;
+    while ((count = fread(data + length, 1, allocated - length, f)) > 0)
+    {
+        length += count;
+        if (length == allocated)
+        {
+            allocated *= 2;
+            data = realloc(data, allocated);
+        }
+    }
+    fclose(f);
+    *size = length;
+    return data;
+}
+
+
+static void *main_worker(void *data)
+// ----------------------------------------------------------------------------
+//   Parse files until there are none left
+// ----------------------------------------------------------------------------
+//   Each worker has its own renderer for error messages, with positions for
+//   the style sheet, and its own copy of the syntax, since syntax statements
+//   in a file change it. It takes a new copy after such a file, so that each
+//   file starts with the same syntax. Errors are saved in the job, to be
+//   reported in file order.
+{
+    main_jobs_p jobs = data;
+    positions_p positions = positions_new();
+    error_set_positions(positions);
+    renderer_p renderer = renderer_new(PREFIX_PATH "xl.stylesheet");
+    error_set_renderer(renderer);
+
+    syntax_p syntax = NULL;
+    size_t index;
+    while ((index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED))
+           < jobs->count)
+    {
+        main_job_p job = &jobs->jobs[index];
+        if (!syntax)
+            syntax = syntax_use(syntax_copy(jobs->syntax));
+
+        error_set_positions(job->positions);
+        errors_p saved = errors_save();
+        job->tree = main_parse(jobs->cache, jobs->share, job->filename,
+                               job->size, job->data, job->positions, syntax);
+
+        // Positions past the reserved range would belong to the next file
+        srcpos_t end = job->start + job->size + 1;
+        if (position(job->positions) > end)
+            error(end, "Parsing %s went past its %zu bytes",
+                  job->filename, job->size);
+
+        job->errors = errors_save();
+        errors_clear(saved);
+        if (syntax_hash(syntax) != jobs->syntax_hash)
+        {
+            job->syntax_changed = true;
+            syntax_dispose(&syntax);
+        }
+        free(job->data);
+        job->data = NULL;
+        RECORD(MAIN, "Parsed %s", job->filename);
+    }
+
+    syntax_dispose(&syntax);
+    error_set_renderer(NULL);
+    renderer_delete(renderer);
+    error_set_positions(NULL);
+    positions_delete(positions);
+    tree_pool_release();
+    return NULL;
+}
+
+
+static bool main_parse_parallel(main_jobs_p jobs, unsigned threads,
+                                positions_p positions)
+// ----------------------------------------------------------------------------
+//   Parse all files with the given number of threads, false if we cannot
+// ----------------------------------------------------------------------------
+//   Files are read first, so that each file gets a range of positions that
+//   matches the bytes the scanner will see, and positions in the resulting
+//   trees remain unique. The range has one more position, for the closing
+//   quote the scanner adds to a text at the end of the input. The files
+//   are added to the global positions once all of them have been parsed.
+//
+//   A file that changes the syntax changes how the following files parse,
+//   which workers cannot know. We refuse to parse such files in parallel.
+{
+    for (size_t j = 0; j < jobs->count; j++)
+    {
+        main_job_p job = &jobs->jobs[j];
+        job->data = main_read(job->filename, &job->size);
+        job->positions = positions_new();
+        job->start = position_skip(positions, job->size + 1);
+        position_skip(job->positions, job->start);
+    }
+
+    bool names_shared = name_set_shared(true);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    for (unsigned t = 0; t < threads; t++)
+        pthread_create(&workers[t], NULL, main_worker, jobs);
+    for (unsigned t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+    free(workers);
+    name_set_shared(names_shared);
+
+    const char *changed = NULL;
+    for (size_t j = 0; j < jobs->count; j++)
+    {
+        main_job_p job = &jobs->jobs[j];
+        positions_merge(positions, job->positions);
+        positions_delete(job->positions);
+        job->positions = NULL;
+        if (job->syntax_changed && j + 1 < jobs->count && !changed)
+            changed = job->filename;
+    }
+    if (!changed)
+        return true;
+
+    fprintf(stderr, "Cannot parse in parallel, %s changes the syntax\n",
+            changed);
+    for (size_t j = 0; j < jobs->count; j++)
+    {
+        main_job_p job = &jobs->jobs[j];
+        tree_dispose(&job->tree);
+        tree_dispose((tree_p *) &job->errors);
+    }
+    return false;
+}
+
+
 int main(int argc, char *argv[])
 // ----------------------------------------------------------------------------
 //   Main entry point for the XL interpreter / compiler
 // ----------------------------------------------------------------------------
+//   Options are:
+//   -cache DIR: reuse parse trees stored in the DIR directory
+//   -freeze FILE: show parse trees after freezing them in FILE and back
+//   -image FILE: show parse trees after a round trip through image FILE
+//   -j N: parse files with N threads. Each file starts with the default
+//         syntax, so if a file changes it, files are parsed again serially
+//   -share: build identical subtrees only once
 {
     RECORD(MAIN, "Starting %s with %d args", argv[0], argc);
     recorder_dump_on_common_signals(0,0);
 
-#ifndef PREFIX_PATH
-#define PREFIX_PATH  "/Users/ddd/Work/xl/"
-#endif
-
     positions_p positions = positions_new();
     error_set_positions(positions);
 
     renderer_p renderer = renderer_new(PREFIX_PATH "xl.stylesheet");
     error_set_renderer(renderer);
 
-    syntax_p syntax = syntax_use(syntax_new(PREFIX_PATH "xl.syntax"));
+    main_jobs_t jobs = { 0 };
+    const char *freeze = NULL;
+    const char *image = NULL;
+    bool names = false;
+    unsigned threads = 1;
+    jobs.jobs = calloc(argc, sizeof(main_job_t));
     for (int arg = 1; arg < argc; arg++)
     {
-        parser_p parser = parser_new(argv[arg], positions, syntax);
-        tree_p tree = tree_use(parser_parse(parser));
-        fprintf(stderr, "File #%d: %s: ", arg, argv[arg]);
-        tree_print(stderr, tree);
-        parser_delete(parser);
-        tree_dispose(&tree);
+        if (strcmp(argv[arg], "-cache") == 0 && arg + 1 < argc)
+        {
+            jobs.cache = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-freeze") == 0 && arg + 1 < argc)
+        {
+            freeze = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-image") == 0 && arg + 1 < argc)
+        {
+            image = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-positions") == 0)
+        {
+            names = true;
+        }
+        else if (strcmp(argv[arg], "-share") == 0)
+        {
+            jobs.share = true;
+        }
+        else if (strcmp(argv[arg], "-mmap") == 0)
+        {
+            scanner_input_default(SCANNER_MMAP);
+        }
+        else if (strcmp(argv[arg], "-stream") == 0)
+        {
+            scanner_input_default(SCANNER_STREAM);
+        }
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+        {
+            threads = atoi(argv[++arg]);
+            if (threads < 1)
+                threads = 1;
+        }
+        else
+        {
+            main_job_p job = &jobs.jobs[jobs.count++];
+            job->arg = arg;
+            job->filename = argv[arg];
+        }
+    }
+
+    syntax_p syntax = syntax_use(syntax_new(PREFIX_PATH "xl.syntax"));
+    bool parallel = threads > 1;
+    if (parallel)
+    {
+        // Threads create trees, make sure classes are known beforehand
+        parser_classes_register();
+        jobs.syntax = syntax;
+        jobs.syntax_hash = syntax_hash(syntax);
+        parallel = main_parse_parallel(&jobs, threads, positions);
+    }
+
+    for (size_t j = 0; j < jobs.count; j++)
+    {
+        main_job_p job = &jobs.jobs[j];
+        if (parallel)
+        {
+            errors_report(job->errors);
+        }
+        else
+        {
+            job->start = position(positions);
+            job->tree = main_parse(jobs.cache, jobs.share, job->filename,
+                                   0, NULL, positions, syntax);
+        }
+        fprintf(stderr, "File #%d: %s: ", job->arg, job->filename);
+        if (image)
+        {
+            image_p mapped = main_image(image, job->tree, job->start);
+            if (mapped)
+            {
+                main_print(image_root(mapped), positions, names);
+                image_close(mapped);
+            }
+            else
+            {
+                fprintf(stderr, "Cannot use image %s\n", image);
+            }
+        }
+        else if (freeze)
+        {
+            tree_p thawed = tree_use(main_freeze(freeze, job->tree));
+            if (thawed || !job->tree)
+                main_print(thawed, positions, names);
+            else
+                fprintf(stderr, "Cannot freeze in %s\n", freeze);
+            tree_dispose(&thawed);
+        }
+        else
+        {
+            main_print(job->tree, positions, names);
+        }
+        tree_dispose(&job->tree);
     }
+    free(jobs.jobs);
 
     syntax_dispose(&syntax);
     renderer_delete(renderer);
@@ -22,6 +22,7 @@
 #define NAME_C
 #include "name.h"
 #include "renderer.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -31,6 +32,8 @@ bool name_is_operator(name_p name)
 //   Return true if the name is an operator (e.g. + or -=)
 // ----------------------------------------------------------------------------
 {
+    tree_box_t box;
+    name = (name_p) tree_unbox((tree_p) name, &box);
     return ispunct(*name_data(name));
 }
 
@@ -82,6 +85,220 @@ bool name_is_valid(size_t size, const char *data)
 }
 
 
+// ============================================================================
+//
+//    Interning names
+//
+// ============================================================================
+//   The intern table is an open-addressing hash table with linear probing.
+//   It does not hold a reference on the names it contains. A name removes
+//   itself from the table when it is deleted.
+//   The table is protected by a lock, since names are shared by threads.
+//   While threads share names, a name whose last reference goes away
+//   stays in the table, because another thread may be interning it again.
+
+typedef struct name_entry
+// ----------------------------------------------------------------------------
+//   An entry in the intern table
+// ----------------------------------------------------------------------------
+{
+    unsigned    hash;           // Hash of the name spelling
+    name_p      name;           // Interned name, NULL if entry is free
+} name_entry_t;
+
+static name_entry_t *name_table          = NULL;
+static size_t        name_table_size     = 0; // Always a power of two
+static size_t        name_table_count    = 0;
+static bool          name_table_shared   = false;
+static pthread_mutex_t name_table_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned name_hash(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of the name spelling
+// ----------------------------------------------------------------------------
+{
+    unsigned hash = 2166136261u;
+    while (size--)
+        hash = (hash ^ (unsigned char) *data++) * 16777619u;
+    return hash;
+}
+
+
+static size_t name_table_find(unsigned hash, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Return the index of the entry matching the data, or of a free entry
+// ----------------------------------------------------------------------------
+{
+    size_t mask = name_table_size - 1;
+    size_t index = hash & mask;
+    for (;;)
+    {
+        name_entry_t *entry = &name_table[index];
+        name_p name = entry->name;
+        if (!name)
+            return index;
+        if (entry->hash == hash && name_length(name) == size &&
+            memcmp(name_data(name), data, size) == 0)
+            return index;
+        index = (index + 1) & mask;
+    }
+}
+
+
+static inline void name_table_enter(void)
+// ----------------------------------------------------------------------------
+//   Lock the intern table if threads share it
+// ----------------------------------------------------------------------------
+//   name_table_shared only changes while a single thread uses names.
+{
+    if (name_table_shared)
+        pthread_mutex_lock(&name_table_lock);
+}
+
+
+static inline void name_table_leave(void)
+// ----------------------------------------------------------------------------
+//   Unlock the intern table if threads share it
+// ----------------------------------------------------------------------------
+{
+    if (name_table_shared)
+        pthread_mutex_unlock(&name_table_lock);
+}
+
+
+static void name_table_grow(void)
+// ----------------------------------------------------------------------------
+//   Double the size of the intern table and rehash all entries
+// ----------------------------------------------------------------------------
+{
+    name_entry_t *old = name_table;
+    size_t old_size = name_table_size;
+
+    name_table_size = old_size ? 2 * old_size : 256;
+    name_table = calloc(name_table_size, sizeof(name_entry_t));
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (old[i].name)
+        {
+            size_t mask = name_table_size - 1;
+            size_t index = old[i].hash & mask;
+            while (name_table[index].name)
+                index = (index + 1) & mask;
+            name_table[index] = old[i];
+        }
+    }
+    free(old);
+}
+
+
+name_p name_intern(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Return the unique name with the given spelling, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    unsigned hash = name_hash(size, data);
+    name_table_enter();
+    if (2 * (name_table_count + 1) > name_table_size)
+        name_table_grow();
+
+    size_t index = name_table_find(hash, size, data);
+    name_entry_t *entry = &name_table[index];
+    name_p name = entry->name;
+    if (!name)
+    {
+        // Interned names outlive the parse that created them: use the heap
+        arena_p arena = tree_set_arena(NULL);
+        name = name_new(0, size, data);
+        ((tree_p) name)->flags |= TREE_INTERNED;
+        tree_set_arena(arena);
+
+        entry->hash = hash;
+        entry->name = name;
+        name_table_count++;
+    }
+    name_table_leave();
+    return name;
+}
+
+
+static bool name_unintern(name_p name)
+// ----------------------------------------------------------------------------
+//   Remove a name from the intern table, return false if it must be kept
+// ----------------------------------------------------------------------------
+//   Entries that follow in the same cluster are moved back, so that
+//   lookups never need to skip over deleted entries.
+{
+    if (!(((tree_p) name)->flags & TREE_INTERNED))
+        return true;
+
+    size_t size = name_length(name);
+    const char *data = name_data(name);
+    unsigned hash = name_hash(size, data);
+
+    name_table_enter();
+    size_t index = name_table_count ? name_table_find(hash, size, data) : 0;
+    if (!name_table_count || name_table[index].name != name)
+    {
+        name_table_leave();
+        return true;
+    }
+    if (name_table_shared)
+    {
+        name_table_leave();
+        return false;
+    }
+
+    size_t mask = name_table_size - 1;
+    size_t hole = index;
+    for (size_t next = (hole + 1) & mask;
+         name_table[next].name;
+         next = (next + 1) & mask)
+    {
+        // Move the entry in the hole unless its home is between them
+        size_t home = name_table[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            name_table[hole] = name_table[next];
+            hole = next;
+        }
+    }
+    name_table[hole].name = NULL;
+    name_table_count--;
+    name_table_leave();
+    return true;
+}
+
+
+bool name_set_shared(bool shared)
+// ----------------------------------------------------------------------------
+//   Indicate if threads share names, return the previous state
+// ----------------------------------------------------------------------------
+//   This must be called while no other thread uses names. When threads
+//   stop sharing names, names that were kept only because they might be
+//   interned again are deleted.
+{
+    bool old = name_table_shared;
+    name_table_shared = shared;
+    if (!old || shared)
+        return old;
+
+    size_t count = 0;
+    name_p *unused = malloc(name_table_count * sizeof(name_p));
+    for (size_t i = 0; i < name_table_size; i++)
+    {
+        name_p name = name_table[i].name;
+        if (name && name_refcount(name) == 0)
+            unused[count++] = name;
+    }
+    for (size_t i = 0; i < count; i++)
+        name_delete(unused[i]);
+    free(unused);
+    return old;
+}
+
+
+
 tree_p name_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 // ----------------------------------------------------------------------------
 //   The handler for names deals mostly with variable-sized initialization
@@ -91,19 +308,10 @@ tree_p name_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     size_t        size;
     renderer_p    renderer;
     const char *  data;
+    tree_serial_p serial;
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "name";
-
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == name_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
     case TREE_INITIALIZE:
         // Fetch pointer to data and size from varargs list (see name_make)
         size = va_arg(va, size_t);
@@ -116,6 +324,21 @@ tree_p name_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         name->text.blob.length = size;
         return (tree_p) name;
 
+    case TREE_DELETE:
+        // Remove the name from the intern table before it goes away
+        if (!name_unintern(name))
+            return NULL;
+        break;
+
+    case TREE_THAW:
+        // Check the spelling, which the blob handler does not do
+        serial = va_arg(va, tree_serial_p);
+        va_arg(va, tree_class_p);
+        data = tree_thaw_string(serial, &size);
+        if (!data || !name_is_valid(size, data))
+            return NULL;
+        return (tree_p) name_new(va_arg(va, srcpos_t), size, data);
+
     case TREE_RENDER:
         // Dump the name as a string of characters, doubling quotes
         renderer = va_arg(va, renderer_p);
@@ -135,3 +358,17 @@ tree_p name_handler(tree_cmd_t cmd, tree_p tree, va_list va)
     // Other cases are handled correctly by the blob handler
     return blob_handler(cmd, tree, va);
 }
+
+
+tree_class_t name_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for names, with characters following the name_t header
+// ----------------------------------------------------------------------------
+{
+    .name       = "name",
+    .handler    = name_handler,
+    .parent     = &blob_class,
+    .size       = sizeof(name_t),
+    .length     = offsetof(blob_t, length),
+    .item_size  = 1,
+};
@@ -10,10 +10,11 @@
 //     Name nodes are used to represent names like ABC and symbols like +=
 //     It is extremely similar to text internally
 //
-//
-//
-//
-//
+//     Names created with name_intern are unique for a given spelling,
+//     so that they can be compared by pointer. The scanner and syntax
+//     only produce interned names. Since an interned name is shared by
+//     all uses of the spelling, it has no position, and the parser puts
+//     a new name with the position of each token in the parse tree.
 //
 // ****************************************************************************
 //  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
@@ -39,13 +40,17 @@ typedef struct name
 blob_type(char, name);
 extern bool name_is_operator(name_p name);
 extern bool name_is_valid(size_t size, const char *data);
+extern name_p name_intern(size_t size, const char *data);
+extern bool name_set_shared(bool shared);
 inline bool name_eq(name_p, const char *value);
+inline name_p name_new_short(srcpos_t pos, size_t sz, const char *data);
 
 // Private name handler, should not be called directly in general
 extern tree_p   name_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 // Helper macro to initialize with a C constant
 #define name_cnew(pos, name)    name_new(pos, strlen(name), name)
+#define name_cintern(name)      name_intern(strlen(name), name)
 
 #undef inline
 
@@ -65,4 +70,20 @@ inline bool name_eq(name_p name, const char *str)
 }
 
 
+inline name_p name_new_short(srcpos_t pos, size_t sz, const char *data)
+// ----------------------------------------------------------------------------
+//   Return an immediate name if the data is short enough, else a new name
+// ----------------------------------------------------------------------------
+{
+    tree_p tree = tree_immediate_text(TREE_IMMEDIATE_NAME, pos, sz, data);
+    if (tree)
+    {
+        assert(name_is_valid(sz, data) && "Name must respect XL syntax");
+        tree_class_register(&name_class);
+        return (name_p) tree;
+    }
+    return name_new(pos, sz, data);
+}
+
+
 #endif // NAME_H
@@ -27,7 +27,56 @@
 #include <string.h>
 
 
-#define NUMBER(number, printf_format, reptype, va_type)                 \
+// ============================================================================
+//
+//   Freezing number values
+//
+// ============================================================================
+//   The last column in number.tbl selects how values are frozen. Naturals
+//   are varints. Integers are zigzag-encoded varints, so that small negative
+//   values take few bytes. Reals are their bytes in memory.
+
+#define NUMBER_FREEZE_NAT(serial, value)                                \
+    tree_freeze_value(serial, sizeof(value), &(value))
+#define NUMBER_THAW_NAT(serial, value)                                  \
+    tree_thaw_value(serial, sizeof(value), &(value))
+#define NUMBER_FREEZE_INT(serial, value)                                \
+    tree_freeze_signed(serial, value)
+#define NUMBER_THAW_INT(serial, value)                                  \
+    number_thaw_integer(serial, sizeof(value), &(value))
+#define NUMBER_FREEZE_REAL(serial, value)                               \
+    tree_freeze_bytes(serial, sizeof(value), &(value))
+#define NUMBER_THAW_REAL(serial, value)                                 \
+    tree_thaw_bytes(serial, sizeof(value), &(value))
+
+
+static bool number_thaw_integer(tree_serial_p serial, size_t size, void *value)
+// ----------------------------------------------------------------------------
+//   Read an integer written by tree_freeze_signed, fail if it does not fit
+// ----------------------------------------------------------------------------
+{
+    intmax_t bits;
+    if (!tree_thaw_signed(serial, &bits))
+        return false;
+    if (size < sizeof(bits))
+    {
+        intmax_t limit = INTMAX_C(1) << (8 * size - 1);
+        if (bits < -limit || bits >= limit)
+            return false;
+    }
+    if (size == 1)
+        *(int8_t *) value = bits;
+    else if (size == 2)
+        *(int16_t *) value = bits;
+    else if (size == 4)
+        *(int32_t *) value = bits;
+    else
+        *(int64_t *) value = bits;
+    return true;
+}
+
+
+#define NUMBER(number, printf_format, reptype, va_type, immediate, freeze) \
                                                                         \
 tree_p number##_handler(tree_cmd_t cmd, tree_p tree, va_list va)        \
 {                                                                       \
@@ -35,24 +84,12 @@ tree_p number##_handler(tree_cmd_t cmd, tree_p tree, va_list va)        \
     size_t        size;                                                 \
     reptype       value;                                                \
     renderer_p    renderer;                                             \
+    tree_serial_p serial;                                               \
+    tree_class_p  class;                                                \
     char          buffer[32];                                           \
                                                                         \
     switch(cmd)                                                         \
     {                                                                   \
-    case TREE_TYPENAME:                                                 \
-        return (tree_p) #number;                                        \
-                                                                        \
-    case TREE_SIZE:                                                     \
-        return (tree_p) sizeof(number##_t);                             \
-                                                                        \
-    case TREE_ARITY:                                                    \
-        return (tree_p) 0;                                              \
-                                                                        \
-    case TREE_CAST:                                                     \
-        if (tree_cast_handler(va) == number##_handler)                  \
-            return tree;                                                \
-        break;                                                          \
-                                                                        \
     case TREE_INITIALIZE:                                               \
         value = va_arg(va, va_type);                                    \
         number = (number##_p) tree_malloc(sizeof(number##_t));          \
@@ -68,6 +105,25 @@ tree_p number##_handler(tree_cmd_t cmd, tree_p tree, va_list va)        \
         render_text(renderer, size, buffer);                            \
         return tree;                                                    \
                                                                         \
+    case TREE_FREEZE:                                                   \
+        serial = va_arg(va, tree_serial_p);                             \
+        if (!NUMBER_FREEZE_##freeze(serial, number->value))              \
+            return NULL;                                                \
+        return tree;                                                    \
+                                                                        \
+    case TREE_THAW:                                                     \
+        serial = va_arg(va, tree_serial_p);                             \
+        class = va_arg(va, tree_class_p);                               \
+        if (!NUMBER_THAW_##freeze(serial, value))                        \
+            return NULL;                                                \
+        if (class == &number##_class)                                   \
+            return (tree_p) number##_new(va_arg(va, srcpos_t), value);  \
+        number = (number##_p) tree_malloc(class->size);                 \
+        tree_set_class(&number->tree, class);                           \
+        tree_set_position(&number->tree, va_arg(va, srcpos_t));         \
+        number->value = value;                                          \
+        return (tree_p) number;                                         \
+                                                                        \
     default:                                                            \
         break;                                                          \
     }                                                                   \
@@ -82,24 +138,12 @@ tree_p based_##number##_handler(tree_cmd_t cmd,tree_p tree,va_list va)  \
     reptype            value;                                           \
     unsigned           base;                                            \
     renderer_p         renderer;                                        \
+    tree_serial_p      serial;                                          \
+    tree_class_p       class;                                           \
     char               buffer[32];                                      \
                                                                         \
     switch(cmd)                                                         \
     {                                                                   \
-    case TREE_TYPENAME:                                                 \
-        return (tree_p) "based_" #number;                               \
-                                                                        \
-    case TREE_SIZE:                                                     \
-        return (tree_p) sizeof(based_##number##_t);                     \
-                                                                        \
-    case TREE_ARITY:                                                    \
-        return (tree_p) 0;                                              \
-                                                                        \
-    case TREE_CAST:                                                     \
-        if (tree_cast_handler(va) == based_##number##_handler)          \
-            return tree;                                                \
-        break;                                                          \
-                                                                        \
     case TREE_INITIALIZE:                                               \
         value = va_arg(va, va_type);                                    \
         base = va_arg(va, unsigned);                                    \
@@ -120,11 +164,49 @@ tree_p based_##number##_handler(tree_cmd_t cmd,tree_p tree,va_list va)  \
         render_text(renderer, size, buffer);                            \
         return tree;                                                    \
                                                                         \
+    case TREE_FREEZE:                                                   \
+        serial = va_arg(va, tree_serial_p);                             \
+        value = number->number.value;                                   \
+        if (!NUMBER_FREEZE_##freeze(serial, value) ||                    \
+            !tree_freeze_value(serial, sizeof(base), &number->base))    \
+            return NULL;                                                \
+        return tree;                                                    \
+                                                                        \
+    case TREE_THAW:                                                     \
+        serial = va_arg(va, tree_serial_p);                             \
+        class = va_arg(va, tree_class_p);                               \
+        if (!NUMBER_THAW_##freeze(serial, value) ||                      \
+            !tree_thaw_value(serial, sizeof(base), &base))              \
+            return NULL;                                                \
+        number = (based_##number##_p) tree_malloc(class->size);         \
+        tree_set_class(&number->number.tree, class);                    \
+        tree_set_position(&number->number.tree, va_arg(va, srcpos_t));  \
+        number->number.value = value;                                   \
+        number->base = base;                                            \
+        return (tree_p) number;                                         \
+                                                                        \
     default:                                                            \
         break;                                                          \
     }                                                                   \
     return number##_handler(cmd, tree, va);                             \
-}
+}                                                                       \
+                                                                        \
+                                                                        \
+tree_class_t number##_class =                                           \
+{                                                                       \
+    .name       = #number,                                              \
+    .handler    = number##_handler,                                     \
+    .parent     = &tree_class,                                          \
+    .size       = sizeof(number##_t),                                   \
+};                                                                      \
+                                                                        \
+tree_class_t based_##number##_class =                                   \
+{                                                                       \
+    .name       = "based_" #number,                                     \
+    .handler    = based_##number##_handler,                             \
+    .parent     = &number##_class,                                      \
+    .size       = sizeof(based_##number##_t),                           \
+};
 
 
 #include "number.tbl"
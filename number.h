@@ -25,7 +25,7 @@
 
 
 // Declaration of a number type
-#define NUMBER(number, printf_format, reptype, vatype)                  \
+#define NUMBER(number, printf_format, reptype, vatype, immediate, freeze) \
 typedef struct number                                                   \
 {                                                                       \
     tree_t      tree;                                                   \
@@ -46,7 +46,7 @@ typedef struct based_##number                                           \
 #endif
 
 
-#define NUMBER(number, printf_format, reptype, vatype)                  \
+#define NUMBER(number, printf_format, reptype, vatype, immediate, freeze) \
                                                                         \
 tree_type(number);                                                      \
 tree_type(based_##number);                                              \
@@ -57,7 +57,7 @@ inline number##_p  based_##number##_new(srcpos_t position,              \
                                         reptype value, unsigned base);  \
 inline reptype     number##_value(number##_p number);                   \
                                                                         \
-inline number##_p  number##_make(tree_handler_fn, srcpos_t pos,         \
+inline number##_p  number##_make(tree_class_p, srcpos_t pos,            \
                                  reptype value, unsigned base);         \
 extern tree_p      number##_handler(tree_cmd_t, tree_p, va_list);       \
 extern tree_p      based_##number##_handler(tree_cmd_t,tree_p,va_list);
@@ -67,27 +67,39 @@ extern tree_p      based_##number##_handler(tree_cmd_t,tree_p,va_list);
 #undef inline
 
 
-#define NUMBER(number, printf_format, reptype, vatype)                  \
+#define NUMBER(number, printf_format, reptype, vatype, immediate, freeze) \
                                                                         \
-inline number##_p number##_make(tree_handler_fn h, srcpos_t pos,        \
+inline number##_p number##_make(tree_class_p class, srcpos_t pos,       \
                                 reptype value, unsigned base)           \
 {                                                                       \
-    return (number##_p) tree_make(h, pos, value, base);                 \
+    return (number##_p) tree_make(class, pos, value, base);             \
 }                                                                       \
                                                                         \
 inline number##_p number##_new(srcpos_t position, reptype value)        \
 {                                                                       \
-    return number##_make(number##_handler, position, value, 10);        \
+    tree_p tree = TREE_IMMEDIATE_##immediate                            \
+        ? tree_immediate(TREE_IMMEDIATE_##immediate,                    \
+                         position, (intptr_t) value)                    \
+        : NULL;                                                         \
+    if (tree)                                                           \
+    {                                                                   \
+        tree_class_register(&number##_class);                           \
+        return (number##_p) tree;                                       \
+    }                                                                   \
+    return number##_make(&number##_class, position, value, 10);         \
 }                                                                       \
                                                                         \
 inline number##_p based_##number##_new(srcpos_t position,               \
                                        reptype value, unsigned base)    \
 {                                                                       \
-    return number##_make(based_##number##_handler,position,value,base); \
+    return number##_make(&based_##number##_class,position,value,base);  \
 }                                                                       \
                                                                         \
 inline reptype number##_value(number##_p number)                        \
 {                                                                       \
+    if (TREE_IMMEDIATE_##immediate &&                                   \
+        tree_is_immediate((tree_p) number))                             \
+        return (reptype) tree_immediate_value((tree_p) number);         \
     return number->value;                                               \
 }                                                                       \
                                                                         \
@@ -19,12 +19,15 @@
 // ****************************************************************************
 
 #include "parser.h"
+#include "arena.h"
 #include "number.h"
 #include "pfix.h"
 #include "infix.h"
 #include "block.h"
 #include "delimited_text.h"
 
+#include <string.h>
+
 
 
 // ============================================================================
@@ -33,20 +36,27 @@
 //
 // ============================================================================
 
-parser_p parser_new(const char *filename,
-                    positions_p positions,
-                    syntax_p syntax)
+static parser_p parser_create(scanner_p s)
 // ----------------------------------------------------------------------------
-//   Create a new parser
+//   Create a new parser reading from the given scanner
 // ----------------------------------------------------------------------------
 {
-    scanner_p s = scanner_new(positions, syntax);
-    scanner_open(s, filename);
-
     parser_p p = malloc(sizeof(parser_t));
     p->scanner = s;
     p->comment = NULL;
     p->pending = tokNONE;
+    p->arena = NULL;
+    p->data = NULL;
+    p->data_size = 0;
+    p->data_read = 0;
+    p->syntax_name = name_use(name_cintern("syntax"));
+    p->newline_name = name_use(name_cintern("\n"));
+    p->indent_name = name_use(name_cintern(SYNTAX_INDENT));
+    p->unindent_name = name_use(name_cintern(SYNTAX_UNINDENT));
+    p->shared = NULL;
+    p->shared_size = 0;
+    p->shared_count = 0;
+    p->sharing = false;
     p->had_space_before = false;
     p->had_space_after = false;
     p->beginning_line = false;
@@ -55,18 +65,329 @@ parser_p parser_new(const char *filename,
 }
 
 
+parser_p parser_new(const char *filename,
+                    positions_p positions,
+                    syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Create a new parser
+// ----------------------------------------------------------------------------
+{
+    scanner_p s = scanner_new(positions, syntax);
+    scanner_open(s, filename);
+    return parser_create(s);
+}
+
+
+parser_p parser_new_with_arena(const char *filename,
+                               positions_p positions,
+                               syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Create a new parser that allocates the trees it builds in an arena
+// ----------------------------------------------------------------------------
+//   The arena is released when both the parser and all the trees
+//   it produced have been deleted.
+{
+    parser_p p = parser_new(filename, positions, syntax);
+    p->arena = arena_new();
+    return p;
+}
+
+
+static unsigned parser_data_read(void *stream, unsigned size, void *buffer)
+// ----------------------------------------------------------------------------
+//   Read the input given to parser_new_with_data
+// ----------------------------------------------------------------------------
+{
+    parser_p p = stream;
+    size_t left = p->data_size - p->data_read;
+    if (size > left)
+        size = left;
+    memcpy(buffer, p->data + p->data_read, size);
+    p->data_read += size;
+    return size;
+}
+
+
+parser_p parser_new_with_data(const char *name,
+                              size_t size, const char *data,
+                              positions_p positions,
+                              syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Create a parser with an arena that reads the given bytes
+// ----------------------------------------------------------------------------
+//   This is for input that was already read, e.g. to know its size.
+//   The name is only used for positions. The data must outlive the parser.
+{
+    scanner_p s = scanner_new(positions, syntax);
+    parser_p p = parser_create(s);
+    p->arena = arena_new();
+    p->data = data;
+    p->data_size = size;
+    scanner_open_stream(s, name, parser_data_read, p);
+    return p;
+}
+
+
 void parser_delete(parser_p p)
 // ----------------------------------------------------------------------------
 //    Delete a parser
 // ----------------------------------------------------------------------------
 {
-    scanner_close(p->scanner, (FILE *) p->scanner->stream);
+    if (p->data)
+        scanner_close_stream(p->scanner, p);
+    else
+        scanner_close(p->scanner, (FILE *) p->scanner->stream);
     scanner_delete(p->scanner);
     text_dispose(&p->comment);
+    name_dispose(&p->syntax_name);
+    name_dispose(&p->newline_name);
+    name_dispose(&p->indent_name);
+    name_dispose(&p->unindent_name);
+    if (p->arena)
+        arena_delete(p->arena);
     free(p);
 }
 
 
+void parser_classes_register(void)
+// ----------------------------------------------------------------------------
+//   Register all the classes of trees the parser can build
+// ----------------------------------------------------------------------------
+//   This is needed to thaw parse trees before anything was parsed.
+{
+    static tree_class_p classes[] =
+    {
+        &natural_class, &integer_class, &real_class, &character_class,
+        &blob_class, &text_class, &name_class, &delimited_text_class,
+        &infix_class, &prefix_class, &postfix_class, &block_class
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(*classes); i++)
+        tree_class_register(classes[i]);
+}
+
+
+
+// ============================================================================
+//
+//    Sharing identical subtrees (hash-consing)
+//
+// ============================================================================
+//   The table holds a reference to each shared tree for the duration
+//   of parser_parse. Nodes are looked up before being built, so that
+//   no memory is allocated for duplicates, which matters in an arena.
+//   Since children were themselves shared, two nodes are identical if
+//   they have the same class and the same child pointers. Leaf children,
+//   like names, numbers or text, are replaced with the first identical leaf,
+//   so that shared names keep the position of their first occurrence.
+
+typedef struct parser_shared
+// ----------------------------------------------------------------------------
+//   An entry in the table of shared trees
+// ----------------------------------------------------------------------------
+{
+    tree_p      tree;           // Shared tree, NULL if entry is free
+    unsigned    hash;           // Hash of the class and contents
+} parser_shared_t;
+
+
+bool parser_set_sharing(parser_p p, bool sharing)
+// ----------------------------------------------------------------------------
+//   Select if the parser shares identical subtrees, return old setting
+// ----------------------------------------------------------------------------
+{
+    bool old = p->sharing;
+    p->sharing = sharing;
+    return old;
+}
+
+
+static unsigned parser_shared_hash(tree_class_p class,
+                                   size_t size, const void *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of a class and of the children or value of a tree
+// ----------------------------------------------------------------------------
+{
+    const unsigned char *bytes = (const unsigned char *) &class;
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(class); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = data;
+    while (size--)
+        hash = (hash ^ *bytes++) * 16777619u;
+    return hash;
+}
+
+
+static parser_shared_t *parser_shared_lookup(parser_p p, unsigned hash,
+                                             tree_class_p class,
+                                             size_t count, tree_p *children,
+                                             tree_p leaf)
+// ----------------------------------------------------------------------------
+//   Find the entry for a node with the given children or for a leaf
+// ----------------------------------------------------------------------------
+//   If there is no identical tree, return the free entry where to put it
+{
+    if (2 * (p->shared_count + 1) > p->shared_size)
+    {
+        parser_shared_t *old = p->shared;
+        size_t old_size = p->shared_size;
+        p->shared_size = old_size ? 2 * old_size : 1024;
+        p->shared = calloc(p->shared_size, sizeof(parser_shared_t));
+        size_t mask = p->shared_size - 1;
+        for (size_t i = 0; i < old_size; i++)
+        {
+            if (!old[i].tree)
+                continue;
+            size_t index = old[i].hash & mask;
+            while (p->shared[index].tree)
+                index = (index + 1) & mask;
+            p->shared[index] = old[i];
+        }
+        free(old);
+    }
+
+    size_t mask = p->shared_size - 1;
+    size_t index = hash & mask;
+    parser_shared_t *entry;
+    while ((entry = &p->shared[index])->tree)
+    {
+        tree_p tree = entry->tree;
+        if (entry->hash == hash && tree_class_of(tree) == class)
+        {
+            if (!leaf)
+            {
+                if (tree_arity(tree) == count &&
+                    memcmp(tree_children(tree), children,
+                           count * sizeof(tree_p)) == 0)
+                    return entry;
+            }
+            else if (tree_is_immediate(leaf))
+            {
+                if ((uint32_t) (uintptr_t) tree == (uint32_t) (uintptr_t) leaf)
+                    return entry;
+            }
+            else if (!tree_is_immediate(tree) &&
+                     tree_size(tree) == tree_size(leaf) &&
+                     memcmp(tree + 1, leaf + 1,
+                            tree_size(leaf) - sizeof(tree_t)) == 0)
+            {
+                return entry;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+    return entry;
+}
+
+
+static tree_p parser_shared_enter(parser_p p,
+                                  parser_shared_t *entry, unsigned hash,
+                                  tree_p tree)
+// ----------------------------------------------------------------------------
+//   Enter a tree in the free entry returned by parser_shared_lookup
+// ----------------------------------------------------------------------------
+{
+    entry->tree = tree_use(tree);
+    entry->hash = hash;
+    p->shared_count++;
+    return tree;
+}
+
+
+static void parser_shared_release(parser_p p)
+// ----------------------------------------------------------------------------
+//   Release the references held by the table of shared trees
+// ----------------------------------------------------------------------------
+{
+    for (size_t i = 0; i < p->shared_size; i++)
+        tree_dispose(&p->shared[i].tree);
+    free(p->shared);
+    p->shared = NULL;
+    p->shared_size = 0;
+    p->shared_count = 0;
+}
+
+
+static tree_p parser_share_leaf(parser_p p, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the first leaf identical to the given one, except for position
+// ----------------------------------------------------------------------------
+//   Nodes are shared when they are built
+{
+    if (!tree || tree_arity(tree))
+        return tree;
+
+    tree_class_p class = tree_class_of(tree);
+    uint32_t bits = (uintptr_t) tree;
+    unsigned hash = tree_is_immediate(tree)
+        ? parser_shared_hash(class, sizeof(bits), &bits)
+        : parser_shared_hash(class, tree_size(tree) - sizeof(tree_t), tree + 1);
+    parser_shared_t *entry = parser_shared_lookup(p, hash, class,
+                                                  0, NULL, tree);
+    if (entry->tree)
+        return entry->tree;
+    return parser_shared_enter(p, entry, hash, tree);
+}
+
+
+static tree_p parser_share_node(parser_p p, tree_class_p class, srcpos_t pos,
+                                tree_p left, tree_p right, name_p opcode)
+// ----------------------------------------------------------------------------
+//   Return an identical infix, prefix, postfix or pfix, or build it
+// ----------------------------------------------------------------------------
+//   The children are in the order of tree_children, opcode only for infix
+{
+    tree_p children[3] = { left, right, (tree_p) opcode };
+    size_t count = opcode ? 3 : 2;
+    parser_shared_t *entry = NULL;
+    unsigned hash = 0;
+    if (p->sharing)
+    {
+        children[0] = parser_share_leaf(p, left);
+        children[1] = parser_share_leaf(p, right);
+        if (opcode)
+            children[2] = parser_share_leaf(p, (tree_p) opcode);
+        hash = parser_shared_hash(class, count * sizeof(tree_p), children);
+        entry = parser_shared_lookup(p, hash, class, count, children, NULL);
+        if (entry->tree)
+            return entry->tree;
+    }
+
+    tree_p tree = opcode
+        ? tree_make(class, pos, children[2], children[0], children[1])
+        : tree_make(class, pos, children[0], children[1]);
+    if (entry)
+        parser_shared_enter(p, entry, hash, tree);
+    return tree;
+}
+
+
+static tree_p parser_share_block(parser_p p, tree_p block)
+// ----------------------------------------------------------------------------
+//   Return an identical block built earlier, or share the given block
+// ----------------------------------------------------------------------------
+//   Blocks grow while being parsed, so they can only be looked up when
+//   complete. The caller holds a reference to the given block, and the
+//   block is deleted when the caller replaces it with an identical one.
+{
+    if (!p->sharing)
+        return block;
+
+    size_t count = tree_arity(block);
+    tree_p *children = tree_children(block);
+    for (size_t i = 0; i < count; i++)
+        tree_set(&children[i], parser_share_leaf(p, children[i]));
+
+    tree_class_p class = tree_class_of(block);
+    unsigned hash = parser_shared_hash(class, count * sizeof(tree_p), children);
+    parser_shared_t *entry = parser_shared_lookup(p, hash, class,
+                                                  count, children, NULL);
+    if (entry->tree)
+        return entry->tree;
+    return parser_shared_enter(p, entry, hash, block);
+}
+
+
 
 // ============================================================================
 //
@@ -79,19 +400,31 @@ typedef struct pending
 //   A stack used to store the pending operations during parsing
 // ----------------------------------------------------------------------------
 // For example, when parsing A+B*C, it will hold (A, +) and (B, *)
-// We push 3 trees for each level: the opcode, the argument and the priority
+// We push the opcode, the argument, the priority and the source position
 {
     name_p      opcode;         // The opcode, e.g. + or *
     tree_p      argument;       // The argument, e.g. A or B
     unsigned    priority;       // The priority, to know when to pop
+    srcpos_t    position;       // The position of the opcode or prefix
 } pending_t, *pending_p;
 
 #define inline extern inline
 blob_type(pending_t, pending_stack);
-blob_type_handler(pending_stack);
+blob_type_class(pending_stack);
 #undef inline
 
 
+static inline name_p parser_name(srcpos_t pos, name_p name)
+// ----------------------------------------------------------------------------
+//   Return a name with the spelling of an interned name, for the parse tree
+// ----------------------------------------------------------------------------
+//   Interned names have no position, so each token gets its own name.
+//   Short names are immediates, which need no memory.
+{
+    return name_new_short(pos, name_length(name), name_data(name));
+}
+
+
 static token_t parser_token(parser_p p)
 // ----------------------------------------------------------------------------
 //    Return next parser token, skipping comments and gathering long text
@@ -104,6 +437,7 @@ static token_t parser_token(parser_p p)
     name_p      opening   = NULL;
     name_p      closing   = NULL;
     token_t     result    = tokNONE;
+    const syntax_entry_t *entry;
 
     while (result == tokNONE)
     {
@@ -127,13 +461,17 @@ static token_t parser_token(parser_p p)
         case tokNAME:
         case tokSYMBOL:
             name_set(&opening, scanner->scanned.name);
-            if (name_eq(opening, "syntax"))
+            if (opening == p->syntax_name)
             {
+                // The syntax was not a token, read the next one
                 syntax_read(scanner->syntax, scanner);
+                result = tokNONE;
                 continue;
             }
-            else if (syntax_is_comment(syntax, opening, &closing))
+            entry = syntax_lookup(syntax, opening);
+            if (entry && entry->comment)
             {
+                name_set(&closing, entry->comment);
                 // Skip comments, keep looking to get the right indentation
                 text_p comment = text_use(scanner_skip(scanner, closing));
                 if (p->comment)
@@ -141,19 +479,27 @@ static token_t parser_token(parser_p p)
                 else
                     text_set(&p->comment, comment);
                 text_dispose(&comment);
-                if (name_eq(closing, "\n") && pend == tokNONE)
+                if (closing == p->newline_name && pend == tokNONE)
                 {
                     p->pending = tokNEWLINE;
                     p->beginning_line = true;
                 }
+
+                // The comment was not a token, read the next one
+                result = tokNONE;
                 continue;
             }
-            else if (syntax_is_text(syntax, opening, &closing))
+            else if (entry && entry->text)
             {
+                name_set(&closing, entry->text);
+                srcpos_t pos = scanner->source_position;
                 text_p val = scanner_skip(scanner, closing);
-                name_p op = (name_p) opening;
-                name_p cl = (name_p) closing;
-                srcpos_t pos = name_position(op);
+                srcpos_t end = position(scanner->positions);
+                size_t length = name_length(closing);
+                name_p op = parser_name(pos, opening);
+                name_p cl = parser_name(end >= pos + length ? end - length
+                                                            : end,
+                                        closing);
                 delimited_text_p dt = delimited_text_new(pos, val, op, cl);
                 tree_set(&scanner->scanned.tree, (tree_p) dt);
                 if (pend == tokNEWLINE)
@@ -162,7 +508,7 @@ static token_t parser_token(parser_p p)
                     result = tokNEWLINE;
                     continue;
                 }
-                if (name_eq(closing, "\n") && pend == tokNONE)
+                if (closing == p->newline_name && pend == tokNONE)
                 {
                     p->pending = tokNEWLINE;
                     p->beginning_line = true;
@@ -177,12 +523,12 @@ static token_t parser_token(parser_p p)
 
             // If the next token has a substatement infix priority,
             // this takes over any pending newline. Example: else
-            if (pend == tokNEWLINE)
+            if (pend == tokNEWLINE && entry)
             {
-                int prefixPrio = syntax_prefix_priority(syntax, opening);
+                int prefixPrio = entry->prefix;
                 if (prefixPrio == syntax->default_priority)
                 {
-                    int infixPrio = syntax_infix_priority(syntax, opening);
+                    int infixPrio = entry->infix;
                     if (infixPrio < syntax->statement_priority)
                         p->pending = tokNONE;
                 }
@@ -237,7 +583,8 @@ static token_t parser_token(parser_p p)
 }
 
 
-static inline tree_p parser_prefix_new(name_p left, tree_p right)
+static inline tree_p parser_prefix_new(parser_p p, srcpos_t pos,
+                                       name_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //   Create a prefix, special-case unary minus with constants
 // ----------------------------------------------------------------------------
@@ -249,6 +596,8 @@ static inline tree_p parser_prefix_new(name_p left, tree_p right)
             return (tree_p) integer_new(natural_position(n), -natural_value(n));
 
         integer_p i = integer_cast(right);
+        if (i && tree_is_immediate(right))
+            return (tree_p) integer_new(integer_position(i), -integer_value(i));
         if (i)
         {
             i->value = -i->value;
@@ -262,29 +611,32 @@ static inline tree_p parser_prefix_new(name_p left, tree_p right)
             return (tree_p) r;
         }
     }
-    return (tree_p) prefix_new(name_position(left), left, right);
+    return parser_share_node(p, &prefix_class, pos, (tree_p) left, right, NULL);
 }
 
 
-static inline tree_p parser_pfix_new(tree_p left, tree_p right)
+static inline tree_p parser_pfix_new(parser_p p, srcpos_t pos,
+                                     tree_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //    If left is a name, create a prefix, else a pfix
 // ----------------------------------------------------------------------------
 {
     name_p name = name_cast(left);
     if (name)
-        return parser_prefix_new(name, right);
-    return (tree_p) pfix_new(tree_position(left), left, right);
+        return parser_prefix_new(p, pos, name, right);
+    return parser_share_node(p, &prefix_class, pos, left, right, NULL);
 }
 
 
 static tree_p parser_block(parser_p p,
+                           srcpos_t opening_pos,
                            name_p   block_opening,
                            name_p   block_closing,
                            int      block_priority)
 // ----------------------------------------------------------------------------
 //    Parse input until we reach block_end
 // ----------------------------------------------------------------------------
+// Opening and closing are interned names, opening was found at opening_pos.
 // XL parsing is not very difficult, but a bit unusual, because it is based
 // solely on dynamic information and not, for instance, on keywords.
 // Consider the following cases, where p is "prefix-op" and i is "infix-op"
@@ -304,6 +656,9 @@ static tree_p parser_block(parser_p p,
     scanner_p   scanner            = p->scanner;
     positions_p positions          = scanner->positions;
     srcpos_t    pos                = position(positions);
+    srcpos_t    token_pos          = pos;
+    srcpos_t    result_pos         = pos;
+    srcpos_t    infix_pos          = pos;
 
     tree_p      result             = NULL;
     tree_p      left               = NULL;
@@ -312,11 +667,13 @@ static tree_p parser_block(parser_p p,
     name_p      name               = NULL;
     name_p      opening            = NULL;
     name_p      closing            = NULL;
+    name_p      separator          = NULL;
     block_p     block              = NULL;
     stack_p     stack              = pending_stack_new(pos, 0, NULL);
     syntax_p    syntax             = syntax_use(scanner->syntax);
     syntax_p    child_syntax       = NULL;
     name_p      child_syntax_end   = NULL;
+    const syntax_entry_t *entry;
 
     int         default_priority   = syntax->default_priority;
     int         function_priority  = syntax->function_priority;
@@ -333,10 +690,10 @@ static tree_p parser_block(parser_p p,
     bool        done               = false;
 
 
-#define STACK_PUSH(op, arg, prio)                       \
+#define STACK_PUSH(op, arg, prio, where)                \
     do                                                  \
     {                                                   \
-        pending_t pending = { (op), (arg), (prio) };    \
+        pending_t pending = { (op), (arg), (prio), (where) };\
         if (pending.opcode)                             \
             name_ref(pending.opcode);                   \
         tree_ref(pending.argument);                     \
@@ -361,15 +718,17 @@ static tree_p parser_block(parser_p p,
             if (prev.opcode == NULL) /* Prefix */                       \
             {                                                           \
                 tree_set(&target,                                       \
-                         parser_pfix_new(prev.argument, target));       \
+                         parser_pfix_new(p, prev.position,              \
+                                         prev.argument, target));       \
             }                                                           \
             else                                                        \
             {                                                           \
-                tree_set(&target, (tree_p)                              \
-                         infix_new(name_position(prev.opcode),          \
-                                   prev.opcode,                         \
-                                   prev.argument,                       \
-                                   target));                            \
+                tree_set(&target,                                       \
+                         parser_share_node(p, &infix_class,             \
+                                           prev.position,               \
+                                           prev.argument,               \
+                                           target,                      \
+                                           prev.opcode));               \
                 name_dispose(&prev.opcode);                             \
             }                                                           \
             tree_dispose(&prev.argument);                               \
@@ -383,8 +742,9 @@ static tree_p parser_block(parser_p p,
         assert(syntax_infix_priority(syntax, block_opening) == block_priority);
         assert(syntax_infix_priority(syntax, block_closing) == block_priority);
 
-        // We are creating a block for everything inside
-        block = block_use(block_new(pos, block_opening, block_closing));
+        // We are creating a block for everything inside, closed at the end
+        name_p opening_name = parser_name(opening_pos, block_opening);
+        block = block_use(block_new(pos, opening_name, NULL));
 
         // When inside a () block, we are in 'expression' mode right away
         if (block_priority > statement_priority)
@@ -400,6 +760,9 @@ static tree_p parser_block(parser_p p,
         tree_dispose(&right);
         prefix_priority = infix_priority = default_priority;
         tok = parser_token(p);
+        token_pos = tok == tokNEWLINE || tok == tokINDENT
+            ? pos
+            : scanner->source_position;
 
         // Check token result
         switch(tok)
@@ -407,7 +770,7 @@ static tree_p parser_block(parser_p p,
         case tokEOF:
         case tokERROR:
             done = true;
-            if (block && !name_eq(block_closing, SYNTAX_UNINDENT))
+            if (block && block_closing != p->unindent_name)
                 error(pos,
                       "Unexpected end of text, expected %t to close block",
                       block_closing);
@@ -425,7 +788,7 @@ static tree_p parser_block(parser_p p,
 
         case tokNEWLINE:
             // Consider new-line as an infix operator
-            name_set(&name, name_cnew(pos, "\n"));
+            name_set(&name, p->newline_name);
             goto common_symbols;
 
         case tokNAME:
@@ -433,24 +796,27 @@ static tree_p parser_block(parser_p p,
             name_set(&name, scanner->scanned.name);
 
         common_symbols:
-            if (block && name_compare(name, block_closing) == 0)
+            entry = syntax_lookup(syntax, name);
+            if (block && name == block_closing)
             {
                 done = true;
                 break;
             }
-            else if ((child_syntax = syntax_is_special(syntax, name,
-                                                       &child_syntax_end)))
+            else if (entry && entry->syntax)
             {
                 // Read the input with the special syntax
-                int prio = syntax_infix_priority(syntax, name);
+                int prio = entry->infix;
+                syntax_set(&child_syntax, entry->syntax);
+                name_set(&child_syntax_end, entry->syntax_end);
                 scanner->syntax = child_syntax;
-                tree_set(&right, parser_block(p, name, child_syntax_end, prio));
+                tree_set(&right, parser_block(p, token_pos, name,
+                                              child_syntax_end, prio));
                 scanner->syntax = syntax;
             }
             else if (!result)
             {
-                prefix_priority = syntax_prefix_priority(syntax, name);
-                tree_set(&right, (tree_p) name);
+                prefix_priority = entry ? entry->prefix : default_priority;
+                tree_set(&right, (tree_p) parser_name(token_pos, name));
                 if (prefix_priority == default_priority)
                     prefix_priority = function_priority;
                 if (new_statement && tok == tokNAME)
@@ -463,16 +829,16 @@ static tree_p parser_block(parser_p p,
                 // higher priority than "and", we want to
                 // parse this as "A and (not B)" rather than as
                 // "(A and not) B"
-                prefix_priority = syntax_prefix_priority(syntax, name);
-                tree_set(&right, (tree_p) name);
+                prefix_priority = entry ? entry->prefix : default_priority;
+                tree_set(&right, (tree_p) parser_name(token_pos, name));
                 if (prefix_priority == default_priority)
                     prefix_priority = function_priority;
             }
             else
             {
                 // Complicated case: need to discriminate infix and prefix
-                infix_priority = syntax_infix_priority(syntax, name);
-                prefix_vs_infix = syntax_prefix_priority(syntax, name);
+                infix_priority = entry ? entry->infix : default_priority;
+                prefix_vs_infix = entry ? entry->prefix : default_priority;
                 if (infix_priority != default_priority &&
                     (prefix_vs_infix == default_priority ||
                      !p->had_space_before || p->had_space_after))
@@ -481,11 +847,13 @@ static tree_p parser_block(parser_p p,
                     if (block && block_priority == infix_priority)
                     {
                         // Check that we have consistent separators within block
-                        if (!block->separator)
+                        if (!separator)
                         {
-                            block->separator = name_use(name);
+                            name_set(&separator, name);
+                            block->separator =
+                                name_use(parser_name(token_pos, name));
                         }
-                        else if (name_compare(block->separator, name) != 0)
+                        else if (separator != name)
                         {
                             error(pos, "Inconsistent separator in block: "
                                   "had %t, now %t", block->separator, name);
@@ -502,30 +870,35 @@ static tree_p parser_block(parser_p p,
                     {
                         // We got an infix
                         tree_set(&left, result);
-                        name_set(&infix, name);
+                        name_set(&infix, parser_name(token_pos, name));
+                        infix_pos = token_pos;
                     }
                 }
                 else
                 {
-                    postfix_priority = syntax_postfix_priority(syntax, name);
+                    postfix_priority = entry ? entry->postfix
+                                             : default_priority;
                     if (postfix_priority != default_priority)
                     {
                         // We have a postfix operator
-                        tree_set(&right, (tree_p) name);
+                        tree_set(&right,
+                                 (tree_p) parser_name(token_pos, name));
 
                         // Flush higher priority items on stack
                         // This is the case for X:integer!
                         STACK_FLUSH(result);
 
-                        tree_set(&right, (tree_p)
-                                 postfix_new(pos, result, (name_p) right));
+                        tree_set(&right,
+                                 parser_share_node(p, &postfix_class, pos,
+                                                   result, right, NULL));
                         prefix_priority = postfix_priority;
                         tree_dispose(&result);
                     }
                     else
                     {
                         // No priority: take this as a prefix by default
-                        tree_set(&right, (tree_p) name);
+                        tree_set(&right,
+                                 (tree_p) parser_name(token_pos, name));
                         prefix_priority = prefix_vs_infix;
                         if (prefix_priority == default_priority)
                         {
@@ -539,37 +912,41 @@ static tree_p parser_block(parser_p p,
             break;
         case tokCLOSE:
             // Check for mismatched parenthese here
-            if (name_compare(scanner->scanned.name, block_closing) != 0)
+            if (scanner->scanned.name != block_closing)
                 error(pos, "Mismatched parentheses: got %t, expected %t",
                       scanner->scanned.name, block_closing);
             done = true;
             break;
         case tokUNINDENT:
             // Check for mismatched blocks here
-            if (!name_eq(block_closing, SYNTAX_UNINDENT))
+            if (block_closing != p->unindent_name)
                 error(pos, "Mismatched identation, expected %t", block_closing);
             done = true;
             break;
         case tokINDENT:
-            name_set(&scanner->scanned.name, name_cnew(pos, SYNTAX_INDENT));
+            name_set(&scanner->scanned.name, p->indent_name);
             // Intentionally fall-through
 
         case tokOPEN:
             name_set(&opening, scanner->scanned.name);
-            if (!syntax_is_block(syntax, opening, &closing))
+            entry = syntax_lookup(syntax, opening);
+            if (!entry || !entry->block)
                 assert(!"Internal error: Unknown parenthese type");
+            name_set(&closing, entry->block);
+            prefix_priority = entry->infix;
             if (tok == tokOPEN)
                 old_indent = scanner_open_parenthese(scanner);
-            prefix_priority = syntax_infix_priority(syntax, opening);
 
             // Just like for names, parse the contents of the parentheses
             infix_priority = default_priority;
-            tree_set(&right, parser_block(p, opening,closing, prefix_priority));
+            tree_set(&right, parser_block(p, token_pos, opening, closing,
+                                          prefix_priority));
             if (tok == tokOPEN)
                 scanner_close_parenthese(scanner, old_indent);
             break;
         default:
-            error(pos, "Unknown token for %t, value %u", scanner->source, tok);
+            error(pos, "Unknown token for %t, value %u",
+                  scanner_source(scanner), tok);
             break;
         } // switch(tok)
 
@@ -580,6 +957,7 @@ static tree_p parser_block(parser_p p,
             // First thing we parse
             tree_set(&result, right);
             result_priority = prefix_priority;
+            result_pos = pos;
 
             // We are now in the middle of an expression
             if (result && result_priority >= statement_priority)
@@ -601,12 +979,13 @@ static tree_p parser_block(parser_p p,
             if (prefix_priority != default_priority)
             {
                 // Push "A and" in the above example
-                STACK_PUSH(infix, left, infix_priority);
+                STACK_PUSH(infix, left, infix_priority, infix_pos);
                 left = NULL;
 
                 // Start over with "not"
                 tree_set(&result, right);
                 result_priority = prefix_priority;
+                result_pos = pos;
             }
             else
             {
@@ -621,7 +1000,7 @@ static tree_p parser_block(parser_p p,
                 else
                 {
                     // Something like A+B+C, just got second +
-                    STACK_PUSH(infix, left, infix_priority);
+                    STACK_PUSH(infix, left, infix_priority, infix_pos);
                     tree_set(&result, NULL);
                 }
                 tree_dispose(&left);
@@ -652,9 +1031,10 @@ static tree_p parser_block(parser_p p,
                         result_priority = statement_priority;
 
             // Push a recognized prefix op
-            STACK_PUSH(NULL, result, result_priority);
+            STACK_PUSH(NULL, result, result_priority, result_pos);
             tree_set(&result, right);
             result_priority = prefix_priority;
+            result_pos = pos;
         }
 
         // Retrieve the position for the next round
@@ -667,8 +1047,10 @@ static tree_p parser_block(parser_p p,
         {
             pending_t last = pending_stack_top(stack);
             if (last.opcode && !name_eq(last.opcode, "\n"))
-                tree_set(&result, (tree_p)
-                         postfix_new(pos, last.argument, last.opcode));
+                tree_set(&result,
+                         parser_share_node(p, &postfix_class, pos,
+                                           last.argument,
+                                           (tree_p) last.opcode, NULL));
             else
                 tree_set(&result, last.argument);
             name_dispose(&last.opcode);
@@ -684,10 +1066,15 @@ static tree_p parser_block(parser_p p,
 
     if (block)
     {
+        // The closing name is where we stopped, unless input ended
+        srcpos_t closing_pos = tok == tokNAME || tok == tokSYMBOL ||
+            tok == tokCLOSE ? token_pos : pos;
+        block->closing = name_use(parser_name(closing_pos, block_closing));
         if (result)
             block_append_data(&block, 1, &result);
         tree_set(&result, (tree_p) block);
         block_dispose(&block);
+        tree_set(&result, parser_share_block(p, result));
     }
 
     tree_dispose(&left);
@@ -696,6 +1083,7 @@ static tree_p parser_block(parser_p p,
     name_dispose(&name);
     name_dispose(&opening);
     name_dispose(&closing);
+    name_dispose(&separator);
     pending_stack_dispose(&stack);
     syntax_dispose(&child_syntax);
     name_dispose(&child_syntax_end);
@@ -712,5 +1100,16 @@ tree_p parser_parse(parser_p p)
 //   Parse input from the given parser
 // ----------------------------------------------------------------------------
 {
-    return parser_block(p, NULL, NULL, 0);
+    arena_p saved = tree_set_arena(p->arena);
+    tree_p result = parser_block(p, 0, NULL, NULL, 0);
+    if (p->shared)
+    {
+        // Keep the result alive while the table releases its references
+        tree_use(result);
+        parser_shared_release(p);
+        if (result)
+            tree_unref(result);
+    }
+    tree_set_arena(saved);
+    return result;
 }
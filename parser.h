@@ -64,6 +64,12 @@
 
   Comments and extraneous line separators are preserved in CommentsInfo nodes
   attached to the returned parse trees.
+
+  With parser_set_sharing, identical infix, prefix, postfix and block
+  nodes are built only once, e.g. every X+1 in the input is the same
+  tree, so that identical subtrees can be compared by pointer. Shared
+  subtrees keep the position of their first occurrence, and must not be
+  modified in place, since they may appear in many places in the tree.
 */
 
 #include "error.h"
@@ -87,6 +93,18 @@ typedef struct parser
     scanner_p   scanner;
     text_p      comment;
     token_t     pending;
+    arena_p     arena;
+    const char *data;                   // Input of parser_new_with_data,
+    size_t      data_size;              // NULL when reading a file
+    size_t      data_read;
+    name_p      syntax_name;            // Names the parser looks for,
+    name_p      newline_name;           // interned once so that we can
+    name_p      indent_name;            // compare them by pointer
+    name_p      unindent_name;
+    struct parser_shared *shared;       // Identical subtrees, if sharing
+    size_t      shared_size;            // Always a power of two
+    size_t      shared_count;
+    bool        sharing          : 1;   // Share identical subtrees
     bool        had_space_before : 1;
     bool        had_space_after  : 1;
     bool        beginning_line   : 1;
@@ -94,7 +112,14 @@ typedef struct parser
 
 
 extern parser_p parser_new(const char *filename, positions_p, syntax_p);
+extern parser_p parser_new_with_arena(const char *filename,
+                                      positions_p, syntax_p);
+extern parser_p parser_new_with_data(const char *name,
+                                     size_t size, const char *data,
+                                     positions_p, syntax_p);
 extern void     parser_delete(parser_p p);
+extern bool     parser_set_sharing(parser_p p, bool sharing);
 extern tree_p   parser_parse(parser_p p);
+extern void     parser_classes_register(void);
 
 #endif // PARSER_H
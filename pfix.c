@@ -36,28 +36,6 @@ tree_p pfix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "pfix";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (is dynamic for pfixs)
-        return (tree_p) (sizeof(pfix_t));
-
-    case TREE_ARITY:
-        // Prefix and postfix have two children
-        return (tree_p) 2;
-
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == pfix_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
-    case TREE_CHILDREN:
-        // Pointer to the children is right after the tree 'header
-        return tree + 1;
-
     case TREE_INITIALIZE:
         // Fetch pointer to data and size from varargs list (see pfix_new)
         left = va_arg(va, tree_p);
@@ -84,51 +62,43 @@ tree_p pfix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
-tree_p prefix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
+tree_class_t pfix_class =
 // ----------------------------------------------------------------------------
-//   The prefix handler
+//   Descriptor for pfix, the common base for prefix and postfix
 // ----------------------------------------------------------------------------
 {
-    switch(cmd)
-    {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "prefix";
+    .name       = "pfix",
+    .handler    = pfix_handler,
+    .parent     = &tree_class,
+    .size       = sizeof(pfix_t),
+    .arity      = 2,
+    .children   = offsetof(pfix_t, left),
+};
 
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == prefix_handler)
-            return tree;
-        break;                      // Pass on to base class handler
 
-    default:
-        break;
-    }
-    // Other cases are handled correctly by the tree handler
-    return pfix_handler(cmd, tree, va);
-}
-
-
-tree_p postfix_handler(tree_cmd_t cmd, tree_p tree, va_list va)
+tree_class_t prefix_class =
 // ----------------------------------------------------------------------------
-//   The prefix handler
+//   Descriptor for prefix, e.g. sin X
 // ----------------------------------------------------------------------------
 {
-    switch(cmd)
-    {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "postfix";
+    .name       = "prefix",
+    .handler    = pfix_handler,
+    .parent     = &pfix_class,
+    .size       = sizeof(pfix_t),
+    .arity      = 2,
+    .children   = offsetof(pfix_t, left),
+};
 
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == postfix_handler)
-            return tree;
-        break;                      // Pass on to base class handler
 
-    default:
-        // Other cases are handled correctly by the tree handler
-        break;
-    }
-    return pfix_handler(cmd, tree, va);
-}
+tree_class_t postfix_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for postfix, e.g. 3!
+// ----------------------------------------------------------------------------
+{
+    .name       = "postfix",
+    .handler    = pfix_handler,
+    .parent     = &pfix_class,
+    .size       = sizeof(pfix_t),
+    .arity      = 2,
+    .children   = offsetof(pfix_t, left),
+};
@@ -63,11 +63,9 @@ inline tree_p       postfix_operand(postfix_p postfix);
 
 
 // Private pfix handler, should not be called directly in general
-inline pfix_p       pfix_make(tree_handler_fn h, srcpos_t pos,
+inline pfix_p       pfix_make(tree_class_p class, srcpos_t pos,
                               tree_p left, tree_p right);
 extern tree_p       pfix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
-extern tree_p       prefix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
-extern tree_p       postfix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 #undef inline
 
@@ -79,13 +77,13 @@ extern tree_p       postfix_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 //
 // ============================================================================
 
-inline pfix_p pfix_make(tree_handler_fn handler, srcpos_t pos,
-                          tree_p left, tree_p right)
+inline pfix_p pfix_make(tree_class_p class, srcpos_t pos,
+                        tree_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //   Create a pfix with the given parameters
 // ----------------------------------------------------------------------------
 {
-    return (pfix_p) tree_make(handler, pos, left, right);
+    return (pfix_p) tree_make(class, pos, left, right);
 }
 
 
@@ -96,7 +94,7 @@ inline pfix_p pfix_new(srcpos_t position, tree_p left, tree_p right)
 //    This is used when neither left nor right is a name
 //    In that case, the left applies to the right
 {
-    return pfix_make(prefix_handler, position, left, right);
+    return pfix_make(&prefix_class, position, left, right);
 }
 
 
@@ -123,7 +121,7 @@ inline prefix_p prefix_new(srcpos_t position, name_p left, tree_p right)
 //    Allocate a prefix with the given children
 // ----------------------------------------------------------------------------
 {
-    return (prefix_p) pfix_make(prefix_handler, position, (tree_p) left, right);
+    return (prefix_p) pfix_make(&prefix_class, position, (tree_p) left, right);
 }
 
 
@@ -150,7 +148,7 @@ inline postfix_p postfix_new(srcpos_t position, tree_p left, name_p right)
 //    Allocate a postfix with the given children
 // ----------------------------------------------------------------------------
 {
-    return (postfix_p) pfix_make(postfix_handler, position, left,(tree_p)right);
+    return (postfix_p) pfix_make(&postfix_class, position, left,(tree_p)right);
 }
 
 
@@ -20,6 +20,7 @@
 
 #include "position.h"
 #include "recorder.h"
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,9 +39,10 @@ positions_p positions_new()
 //    Allocating a new set of positions
 // ----------------------------------------------------------------------------
 {
-    positions_p result = malloc(sizeof(position_t));
+    positions_p result = malloc(sizeof(positions_t));
     result->position = 0;
-    result->last = NULL;
+    result->files = NULL;
+    result->file_count = 0;
     return result;
 }
 
@@ -50,14 +52,15 @@ void positions_delete(positions_p p)
 //   Delete positions records
 // ----------------------------------------------------------------------------
 {
-    position_file_p f = p->last;
-    while(f)
+    for (size_t i = 0; i < p->file_count; i++)
     {
-        position_file_p prev = f->previous;
+        position_file_p f = &p->files[i];
         free((void *) f->name);
-        free(f);
-        f = prev;
+        free(f->source);
+        free(f->lines);
     }
+    free(p->files);
+    free(p);
 }
 
 
@@ -79,6 +82,17 @@ srcpos_t position_step(positions_p p)
 }
 
 
+srcpos_t position_skip(positions_p p, size_t count)
+// ----------------------------------------------------------------------------
+//   Advance the current global position by count, return old location
+// ----------------------------------------------------------------------------
+{
+    srcpos_t old = p->position;
+    p->position += count;
+    return old;
+}
+
+
 
 // ============================================================================
 //
@@ -86,74 +100,238 @@ srcpos_t position_step(positions_p p)
 //
 // ============================================================================
 
+static position_file_p position_add_file(positions_p p)
+// ----------------------------------------------------------------------------
+//   Add a file record at the end of the list of files
+// ----------------------------------------------------------------------------
+{
+    size_t count = p->file_count++;
+    if ((count & (count - 1)) == 0)
+        p->files = realloc(p->files,
+                           (count ? 2 * count : 1) * sizeof(position_file_t));
+    return &p->files[count];
+}
+
+
 srcpos_t position_open_source_file(positions_p p, const char *name)
 // ----------------------------------------------------------------------------
 //    Open a new source file
 // ----------------------------------------------------------------------------
 {
-    position_file_p file = malloc(sizeof(position_file_t));
+    // Positions only grow, so appending keeps the files sorted
+    position_file_p file = position_add_file(p);
     file->name = strdup(name);
     file->start = position(p);
-    file->previous = p->last;
-    p->last = file;
+    file->source = NULL;
+    file->size = 0;
+    file->lines = NULL;
+    file->line_count = 0;
     return file->start;
 }
 
 
-bool position_info(positions_p p, srcpos_t pos, position_p result)
+void positions_merge(positions_p p, positions_p other)
 // ----------------------------------------------------------------------------
-// Converting a global position into position information
+//   Move the files of other positions, which must all come after ours
+// ----------------------------------------------------------------------------
+//   This is used for files scanned separately, e.g. by another thread,
+//   in a range of positions reserved with position_skip.
+{
+    for (size_t i = 0; i < other->file_count; i++)
+    {
+        position_file_p from = &other->files[i];
+        assert((!p->file_count ||
+                p->files[p->file_count - 1].start <= from->start) &&
+               "Merged files must come after existing ones");
+        *position_add_file(p) = *from;
+    }
+    if (p->position < other->position)
+        p->position = other->position;
+    free(other->files);
+    other->files = NULL;
+    other->file_count = 0;
+}
+
+
+static bool position_load_file(position_file_p file)
+// ----------------------------------------------------------------------------
+//   Load the contents of a file and find where lines begin, once
 // ----------------------------------------------------------------------------
 {
-    if (!p)
+    if (file->lines)
+        return true;
+
+    FILE *f = fopen(file->name, "rb");
+    if (!f)
         return false;
 
-    position_file_p file = p->last;
-    position_file_p good = NULL;
+    size_t allocated = 0;
+    size_t size = 0;
+    char *source = NULL;
+    for (;;)
+    {
+        if (size == allocated)
+        {
+            allocated = allocated ? 2 * allocated : 4096;
+            source = realloc(source, allocated);
+        }
+        size_t rs = fread(source + size, 1, allocated - size, f);
+        if (!rs)
+            break;
+        size += rs;
+    }
+    fclose(f);
+
+    size_t line_count = 1;
+    for (const char *p = source; (p = memchr(p, '\n', source+size-p)); p++)
+        line_count++;
+    unsigned *lines = malloc(line_count * sizeof(unsigned));
+    size_t line = 0;
+    lines[line++] = 0;
+    for (const char *p = source; (p = memchr(p, '\n', source+size-p)); p++)
+        lines[line++] = p + 1 - source;
+
+    file->source = source;
+    file->size = size;
+    file->lines = lines;
+    file->line_count = line_count;
+    return true;
+}
+
+
+static position_file_p position_file(positions_p p, srcpos_t pos)
+// ----------------------------------------------------------------------------
+//   Binary search for the last file that starts at or before pos
+// ----------------------------------------------------------------------------
+{
+    if (!p || !p->file_count || p->files[0].start > pos)
+        return NULL;
 
-    while (file && file->start <= pos)
+    position_file_p files = p->files;
+    size_t first = 0;
+    size_t last = p->file_count;
+    while (last - first > 1)
     {
-        good = file;
-        file = file->previous;
+        size_t middle = (first + last) / 2;
+        if (files[middle].start <= pos)
+            first = middle;
+        else
+            last = middle;
     }
-    if (!good)
-        return false;
+    return &files[first];
+}
 
-    FILE *f = fopen(good->name, "rb");
-    if (!f)
-        return false;
 
-    unsigned offset = pos - good->start;
+static size_t position_line(position_file_p file, srcpos_t pos,
+                            size_t first, position_p result)
+// ----------------------------------------------------------------------------
+//   Fill line information, searching lines from first, return line index
+// ----------------------------------------------------------------------------
+{
+    unsigned offset = pos - file->start;
     result->position = pos;
-    result->file = good->name;
+    result->file = file->name;
     result->offset = offset;
+    result->source = file->source;
 
-    unsigned line = 1;
-    unsigned line_offset = 0;
-    unsigned current = 0;
-    while (current < offset && !feof(f))
+    // Binary search for the last line starting at or before offset
+    unsigned *lines = file->lines;
+    size_t last = file->line_count;
+    while (last - first > 1)
     {
-        int c = fgetc(f);
-        current++;
-        if (c == '\n')
-        {
-            line_offset = current;
-            line++;
-        }
+        size_t middle = (first + last) / 2;
+        if (lines[middle] <= offset)
+            first = middle;
+        else
+            last = middle;
     }
-    result->line = line;
+
+    unsigned line_offset = lines[first];
+    unsigned line_end = first + 1 < file->line_count
+        ? lines[first + 1] - 1
+        : file->size;
+    result->line = first + 1;
     result->line_offset = line_offset;
     result->column = offset - line_offset;
-    while (!feof(f))
+    result->line_length = line_end - line_offset;
+    return first;
+}
+
+
+bool position_info(positions_p p, srcpos_t pos, position_p result)
+// ----------------------------------------------------------------------------
+// Converting a global position into position information
+// ----------------------------------------------------------------------------
+{
+    position_file_p file = position_file(p, pos);
+    if (!file || !position_load_file(file))
+        return false;
+    position_line(file, pos, 0, result);
+    return true;
+}
+
+
+typedef struct position_order
+// ----------------------------------------------------------------------------
+//   A position and where it was in the input of positions_info
+// ----------------------------------------------------------------------------
+{
+    srcpos_t    position;
+    size_t      index;
+} position_order_t;
+
+
+static int position_order_compare(const void *left, const void *right)
+// ----------------------------------------------------------------------------
+//   Compare positions for sorting
+// ----------------------------------------------------------------------------
+{
+    srcpos_t l = ((const position_order_t *) left)->position;
+    srcpos_t r = ((const position_order_t *) right)->position;
+    return l < r ? -1 : l > r ? 1 : 0;
+}
+
+
+size_t positions_info(positions_p p,
+                      size_t count, const srcpos_t *pos, position_p result)
+// ----------------------------------------------------------------------------
+//   Convert many positions at once, return how many were found
+// ----------------------------------------------------------------------------
+//   Positions are processed in increasing order, so that each line search
+//   starts from the line found for the previous position in the same file.
+//   Positions that are not found have a NULL file in the result.
+{
+    position_order_t *order = malloc(count * sizeof(position_order_t));
+    for (size_t i = 0; i < count; i++)
     {
-        int c = fgetc(f);
-        if (c == '\n')
-            break;
-        current++;
+        order[i].position = pos[i];
+        order[i].index = i;
     }
-    result->line_length = current - line_offset;
-    fclose(f);
-    return true;
+    qsort(order, count, sizeof(position_order_t), position_order_compare);
+
+    size_t          found = 0;
+    position_file_p file  = NULL;
+    size_t          line  = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        position_p      info = &result[order[i].index];
+        position_file_p next = position_file(p, order[i].position);
+        if (next != file)
+        {
+            file = next;
+            line = 0;
+        }
+        if (!file || !position_load_file(file))
+        {
+            memset(info, 0, sizeof(position_t));
+            continue;
+        }
+        line = position_line(file, order[i].position, line, info);
+        found++;
+    }
+
+    free(order);
+    return found;
 }
 
 
@@ -162,12 +340,21 @@ bool position_source(position_p posinfo, char *buffer, size_t size)
 //   Read the source code based on the position information into target buffer
 // ----------------------------------------------------------------------------
 {
+    if (size > posinfo->line_length + 1)
+        size = posinfo->line_length + 1;
+
+    // Use the loaded copy of the file if we have one
+    if (posinfo->source)
+    {
+        memcpy(buffer, posinfo->source + posinfo->line_offset, size-1);
+        buffer[size-1] = 0;
+        return true;
+    }
+
     FILE *f = fopen(posinfo->file, "rb");
     if (!f)
         return false;
     fseek(f, posinfo->line_offset, SEEK_SET);
-    if (size > posinfo->line_length + 1)
-        size = posinfo->line_length + 1;
     size_t rs = fread(buffer, 1, size-1, f);
     if (rs != size-1)
         record(position_warning, "Reading %s offset %zu read %zu of %zu bytes",
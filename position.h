@@ -40,17 +40,21 @@ typedef struct position
     unsigned     column;        // Column in file
     unsigned     line_offset;   // Beginning of line
     unsigned     line_length;   // Length of source code
+    const char * source;        // Source code of the file, if loaded
 } position_t, *position_p;
 
 
 typedef struct position_file
 // ----------------------------------------------------------------------------
-//    List of input files
+//    Input files, in the order they were opened
 // ----------------------------------------------------------------------------
 {
     const char *          name;
     srcpos_t              start;
-    struct position_file *previous;
+    char *                source;       // Contents, loaded on first use
+    size_t                size;         // Size of the contents
+    unsigned *            lines;        // Offset of the start of each line
+    size_t                line_count;   // Number of lines
 } position_file_t, *position_file_p;
 
 
@@ -60,7 +64,8 @@ typedef struct positions
 // ----------------------------------------------------------------------------
 {
     srcpos_t         position;
-    position_file_t *last;
+    position_file_t *files;             // Sorted by start position
+    size_t           file_count;
 } positions_t, *positions_p;
 
 
@@ -71,12 +76,16 @@ void        positions_delete(positions_p p);
 // Getting and stepping the current global position
 srcpos_t position(positions_p p);
 srcpos_t position_step(positions_p p);
+srcpos_t position_skip(positions_p p, size_t count);
 
 // Opening and closing source files
 srcpos_t position_open_source_file(positions_p p, const char *name);
+void     positions_merge(positions_p p, positions_p other);
 
 // Converting a global position into position information
 bool     position_info(positions_p p, srcpos_t pos, position_p result);
+size_t   positions_info(positions_p p,
+                        size_t count, const srcpos_t *pos, position_p result);
 
 // Getting the source code
 bool     position_source(position_p posinfo, char *buffer, size_t size);
@@ -28,6 +28,15 @@
 #include "text.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+// Output buffering parameters
+#define RENDER_SEGMENTS         64      // Segments before we flush
+#define RENDER_BUFFER_MAX       65536   // Buffered bytes before we flush
+#define RENDER_STATIC_MIN       16      // Shorter static text is copied
 
 
 
@@ -37,6 +46,72 @@
 //
 // ============================================================================
 
+typedef enum render_op
+// ----------------------------------------------------------------------------
+//   Operations in a compiled format
+// ----------------------------------------------------------------------------
+{
+    RENDER_NONE,                                // Nothing, or invalid directive
+    RENDER_TEXT,                                // Literal text, e.g. "("
+    RENDER_FORMAT,                              // Another format
+    RENDER_SELF,                                // Self, using the tree handler
+    RENDER_INDENT,                              // Increase indentation
+    RENDER_UNINDENT,                            // Decrease indentation
+    RENDER_INDENTS,                             // Emit current indentation
+    RENDER_SEPARATOR,                           // Separator needed
+    RENDER_NEWLINE,                             // Newline needed
+    RENDER_CHILD,                               // Child by index, e.g. left
+    RENDER_CHILDREN,                            // Children of a block
+    RENDER_SPACE                                // Space unless we just had one
+} render_op_t;
+
+
+typedef struct render_directive
+// ----------------------------------------------------------------------------
+//   A directive in a format, resolved when the style sheet is loaded
+// ----------------------------------------------------------------------------
+{
+    render_op_t         op;                     // What to do
+    int                 format;                 // Format to render, or -1
+    unsigned            child;                  // Child index for RENDER_CHILD
+    size_t              length;                 // Length of literal text
+    const char *        data;                   // Literal text
+    text_p              source;                 // Directive as written
+} render_directive_t;
+
+
+typedef struct render_format
+// ----------------------------------------------------------------------------
+//   A compiled format, i.e. a sequence of directives
+// ----------------------------------------------------------------------------
+{
+    text_p              name;                   // Name in the style sheet
+    size_t              first;                  // First directive
+    size_t              count;                  // Number of directives
+} render_format_t;
+
+
+typedef struct render_class
+// ----------------------------------------------------------------------------
+//   Cache of the format to use for a given tree class
+// ----------------------------------------------------------------------------
+{
+    tree_class_p        class;                  // Class, NULL if entry is free
+    int                 format;                 // Format to use, or -1
+} render_class_t;
+
+
+typedef struct render_segment
+// ----------------------------------------------------------------------------
+//   A segment of output, either in the output buffer or static text
+// ----------------------------------------------------------------------------
+{
+    const char *        data;                   // Static text, or NULL
+    size_t              offset;                 // Offset in output buffer
+    size_t              length;                 // Length of the segment
+} render_segment_t;
+
+
 typedef struct renderer
 // ----------------------------------------------------------------------------
 //    Structure holding rendering information
@@ -45,13 +120,29 @@ typedef struct renderer
     // Configuration
     tree_io_fn          output;                 // Output function
     void *              stream;                 // Output stream
+    int                 fd;                     // File descriptor, or -1
     syntax_p            syntax;                 // Syntax (priorities, etc)
     array_p             formats;                // Format for keywords
-    text_p              cr;                     // A text containing '\n'
-    text_p              space;                  // A text containing ' '
-    text_p              indent;                 // A text containing 'indent'
-    text_p              begin;                  // A text containing 'begin'
-    text_p              end;                    // A text containing 'end'
+
+    // Style sheet compiled by renderer_style
+    render_format_t *   compiled;               // One per entry in formats
+    render_directive_t *directives;             // Directives for all formats
+    int                 chars[256];             // Format for characters, or -1
+    render_class_t *    classes;                // Format for tree classes
+    size_t              classes_size;           // Always a power of two
+    size_t              classes_count;
+    render_directive_t  cr;                     // Rendering '\n'
+    render_directive_t  space;                  // Rendering ' '
+    render_directive_t  indent;                 // Rendering one indentation
+    render_directive_t  begin;                  // Rendering 'begin'
+    render_directive_t  end;                    // Rendering 'end'
+
+    // Output not yet sent to the output function or file descriptor
+    char *              buffer;                 // Copied output
+    size_t              buffered;               // Bytes used in buffer
+    size_t              buffer_size;            // Bytes allocated for buffer
+    render_segment_t    segments[RENDER_SEGMENTS];
+    unsigned            segment_count;
 
     // Dynamic state
     tree_p              self;                   // 'self' keyword
@@ -80,15 +171,10 @@ renderer_p renderer_new(const char *style)
 {
     renderer_p result = malloc(sizeof(renderer_t));
     memset(result, 0, sizeof(renderer_t));
+    memset(result->chars, -1, sizeof(result->chars));
+    result->fd = -1;
     if (style)
-    {
-        text_set(&result->cr, text_cnew(0, "\n"));
-        text_set(&result->space, text_cnew(0, " "));
-        text_set(&result->indent, text_cnew(0, "indent"));
-        text_set(&result->begin, text_cnew(0, "begin"));
-        text_set(&result->end, text_cnew(0, "end"));
         renderer_style(result, style);
-    }
     return result;
 }
 
@@ -98,14 +184,14 @@ void renderer_delete(renderer_p renderer)
 //   Delete a renderer
 // ----------------------------------------------------------------------------
 {
+    renderer_flush(renderer);
     syntax_dispose(&renderer->syntax);
     array_dispose(&renderer->formats);
     tree_dispose(&renderer->self);
-    text_dispose(&renderer->cr);
-    text_dispose(&renderer->indent);
-    text_dispose(&renderer->space);
-    text_dispose(&renderer->begin);
-    text_dispose(&renderer->end);
+    free(renderer->buffer);
+    free(renderer->compiled);
+    free(renderer->directives);
+    free(renderer->classes);
     free(renderer);
 }
 
@@ -133,6 +219,7 @@ tree_io_fn renderer_output_function(renderer_p renderer, tree_io_fn function)
 //   Set the output function for the renderer, return previous one
 // ----------------------------------------------------------------------------
 {
+    renderer_flush(renderer);
     tree_io_fn result = renderer->output;
     renderer->output = function;
     return result;
@@ -144,12 +231,161 @@ void *renderer_output_stream(renderer_p renderer, void *stream)
 //    Set the output stream for the renderer, return previous one
 // ----------------------------------------------------------------------------
 {
+    renderer_flush(renderer);
     void *result = renderer->stream;
     renderer->stream = stream;
     return result;
 }
 
 
+int renderer_output_fd(renderer_p renderer, int fd)
+// ----------------------------------------------------------------------------
+//   Set a file descriptor to write to instead of the output function
+// ----------------------------------------------------------------------------
+//   Passing -1 selects the output function again. Returns previous one.
+{
+    renderer_flush(renderer);
+    int result = renderer->fd;
+    renderer->fd = fd;
+    return result;
+}
+
+
+
+// ============================================================================
+//
+//    Output buffering
+//
+// ============================================================================
+//   Output is accumulated as a list of segments, which refer either to
+//   text copied in the output buffer, or to static text that remains
+//   valid until the next flush, like indentation or style sheet text.
+//   Flushing sends all segments at once with writev if we write to a
+//   file descriptor, or calls the output function for each segment.
+
+static void render_write(renderer_p r, struct iovec *iov, unsigned count)
+// ----------------------------------------------------------------------------
+//   Write all the segments to the file descriptor
+// ----------------------------------------------------------------------------
+{
+    while (count)
+    {
+        ssize_t written = writev(r->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error(tree_position(r->self),
+                  "Error writing output: %s", strerror(errno));
+            return;
+        }
+
+        // Skip what was written, which may end in the middle of a segment
+        while (count && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count)
+        {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+
+void renderer_flush(renderer_p r)
+// ----------------------------------------------------------------------------
+//   Send buffered output to the output function or file descriptor
+// ----------------------------------------------------------------------------
+{
+    unsigned count = r->segment_count;
+    if (!count)
+        return;
+
+    struct iovec iov[RENDER_SEGMENTS];
+    for (unsigned s = 0; s < count; s++)
+    {
+        render_segment_t *segment = &r->segments[s];
+        iov[s].iov_base = segment->data
+            ? (char *) segment->data
+            : r->buffer + segment->offset;
+        iov[s].iov_len = segment->length;
+    }
+
+    // Reset first, in case the output function renders something
+    r->segment_count = 0;
+    r->buffered = 0;
+
+    if (r->fd >= 0)
+        render_write(r, iov, count);
+    else if (r->output)
+        for (unsigned s = 0; s < count; s++)
+            r->output(r->stream, iov[s].iov_len, iov[s].iov_base);
+}
+
+
+static void render_output(renderer_p r,
+                          size_t length, const char *data, bool is_static)
+// ----------------------------------------------------------------------------
+//   Add output, referring to static text or copying it to the buffer
+// ----------------------------------------------------------------------------
+{
+    if (!length)
+        return;
+
+    render_segment_t *last = r->segment_count
+        ? &r->segments[r->segment_count - 1]
+        : NULL;
+
+    if (is_static && length >= RENDER_STATIC_MIN)
+    {
+        if (r->segment_count == RENDER_SEGMENTS)
+            renderer_flush(r);
+        render_segment_t *segment = &r->segments[r->segment_count++];
+        segment->data = data;
+        segment->offset = 0;
+        segment->length = length;
+        return;
+    }
+
+    // Flush if the buffer is full or if we cannot add a segment
+    bool extend = last && !last->data;
+    if (r->buffered + length > RENDER_BUFFER_MAX ||
+        (!extend && r->segment_count == RENDER_SEGMENTS))
+    {
+        renderer_flush(r);
+        extend = false;
+    }
+
+    // Grow the buffer geometrically
+    if (r->buffered + length > r->buffer_size)
+    {
+        size_t size = r->buffer_size ? r->buffer_size : 256;
+        while (size < r->buffered + length)
+            size *= 2;
+        r->buffer = realloc(r->buffer, size);
+        r->buffer_size = size;
+    }
+
+    memcpy(r->buffer + r->buffered, data, length);
+    if (extend)
+    {
+        last->length += length;
+    }
+    else
+    {
+        render_segment_t *segment = &r->segments[r->segment_count++];
+        segment->data = NULL;
+        segment->offset = r->buffered;
+        segment->length = length;
+    }
+    r->buffered += length;
+}
+
+
 static inline bool eq(text_p text, const char *str)
 // ----------------------------------------------------------------------------
 //    Compare the name value with a C string
@@ -159,11 +395,246 @@ static inline bool eq(text_p text, const char *str)
 }
 
 
+// ============================================================================
+//
+//    Compiling the style sheet
+//
+// ============================================================================
+//   Each format in the style sheet is compiled into a sequence of
+//   directives where keywords, literal text and references to other
+//   formats are already resolved. Rendering a tree or a character then
+//   only requires finding its format in a table.
+
+static int renderer_find_format(renderer_p r, size_t length, const char *data)
+// ----------------------------------------------------------------------------
+//   Find the index of the given format, or -1 if not in the style sheet
+// ----------------------------------------------------------------------------
+{
+    if (!r->formats)
+        return -1;
+    text_p key = text_use(text_new(0, length, data));
+    int index = array_search(r->formats, (tree_p) key,
+                             (compare_fn) text_compare, 2);
+    text_dispose(&key);
+    return index;
+}
+
+
+static void renderer_compile_directive(renderer_p r, render_directive_t *d,
+                                       size_t length, const char *data)
+// ----------------------------------------------------------------------------
+//   Compile a single directive
+// ----------------------------------------------------------------------------
+{
+    static const struct
+    {
+        const char *    name;
+        render_op_t     op;
+        unsigned        child;
+    } keywords[] =
+    {
+        { "self",       RENDER_SELF,            0 },
+        { "indent",     RENDER_INDENT,          0 },
+        { "unindent",   RENDER_UNINDENT,        0 },
+        { "indents",    RENDER_INDENTS,         0 },
+        { "separator",  RENDER_SEPARATOR,       0 },
+        { "cr",         RENDER_NEWLINE,         0 },
+        { "newline",    RENDER_NEWLINE,         0 },
+        // Convenient for infix, prefix and postfix
+        { "left",       RENDER_CHILD,           0 },
+        { "right",      RENDER_CHILD,           1 },
+        { "opcode",     RENDER_CHILD,           2 },
+        // Convenient for blocks
+        { "opening",    RENDER_CHILD,           0 },
+        { "closing",    RENDER_CHILD,           1 },
+        { "child",      RENDER_CHILDREN,        0 },
+        { "children",   RENDER_CHILDREN,        0 },
+        { "space",      RENDER_SPACE,           0 },
+    };
+
+    d->op = RENDER_NONE;
+    d->format = -1;
+
+    // Check if directive has text form, e.g "ABC" or 'ABC', render as is
+    if (length >= 2 &&
+        (data[0] == '"' || data[0] == '\'') && data[length-1] == data[0])
+    {
+        d->op = RENDER_TEXT;
+        d->length = length - 2;
+        d->data = data + 1;
+        return;
+    }
+
+    for (unsigned k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++)
+    {
+        if (strlen(keywords[k].name) == length &&
+            memcmp(keywords[k].name, data, length) == 0)
+        {
+            d->op = keywords[k].op;
+            d->child = keywords[k].child;
+            break;
+        }
+    }
+
+    // Formats are used for directives that are not keywords, and when
+    // there is no child to render for left, right, child, etc.
+    if (d->op == RENDER_NONE || d->op == RENDER_CHILD ||
+        d->op == RENDER_CHILDREN)
+    {
+        d->format = renderer_find_format(r, length, data);
+        if (d->op == RENDER_NONE && d->format >= 0)
+            d->op = RENDER_FORMAT;
+    }
+}
+
+
+static void renderer_compile_format(renderer_p r, render_directive_t *d,
+                                    const char *name)
+// ----------------------------------------------------------------------------
+//   Compile a reference to a format with the given name, if it exists
+// ----------------------------------------------------------------------------
+{
+    memset(d, 0, sizeof(render_directive_t));
+    d->format = renderer_find_format(r, strlen(name), name);
+    if (d->format >= 0)
+        d->op = RENDER_FORMAT;
+}
+
+
+static void renderer_compile(renderer_p r)
+// ----------------------------------------------------------------------------
+//   Compile the formats in the style sheet
+// ----------------------------------------------------------------------------
+{
+    array_p formats = r->formats;
+    size_t  count   = array_length(formats) / 2;
+    size_t  total   = 0;
+    for (size_t f = 0; f < count; f++)
+        total += array_length((array_p) array_child(formats, 2*f+1));
+
+    free(r->compiled);
+    free(r->directives);
+    r->compiled = calloc(count, sizeof(render_format_t));
+    r->directives = calloc(total, sizeof(render_directive_t));
+
+    render_directive_t *d = r->directives;
+    for (size_t f = 0; f < count; f++)
+    {
+        render_format_t *format = &r->compiled[f];
+        array_p          seq    = (array_p) array_child(formats, 2*f+1);
+        size_t           len    = array_length(seq);
+        text_p          *data   = (text_p *) array_data(seq);
+
+        format->name = (text_p) array_child(formats, 2*f);
+        format->first = d - r->directives;
+        format->count = len;
+        for (size_t i = 0; i < len; i++, d++)
+        {
+            d->source = data[i];
+            renderer_compile_directive(r, d,
+                                       text_length(data[i]),
+                                       text_data(data[i]));
+        }
+    }
+
+    // Formats for individual characters
+    memset(r->chars, -1, sizeof(r->chars));
+    for (size_t f = 0; f < count; f++)
+    {
+        tree_box_t box;
+        text_p name = (text_p) tree_unbox((tree_p) r->compiled[f].name, &box);
+        if (text_length(name) == 1)
+            r->chars[(uint8_t) text_data(name)[0]] = f;
+    }
+
+    // Formats used by the renderer itself
+    renderer_compile_format(r, &r->cr, "\n");
+    renderer_compile_format(r, &r->space, " ");
+    renderer_compile_format(r, &r->begin, "begin");
+    renderer_compile_format(r, &r->end, "end");
+
+    // Not 'indent', which is the keyword that increases indentation
+    renderer_compile_format(r, &r->indent, "indents");
+
+    // Tree classes are looked up on first use
+    free(r->classes);
+    r->classes = NULL;
+    r->classes_size = 0;
+    r->classes_count = 0;
+}
+
+
+static int renderer_class_format(renderer_p r, tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Return the format for a given tree class, or -1 if there is none
+// ----------------------------------------------------------------------------
+{
+    if (!r->formats)
+        return -1;
+
+    size_t mask = r->classes_size - 1;
+    size_t index = ((uintptr_t) class >> 4) & mask;
+    if (r->classes)
+    {
+        for (;;)
+        {
+            render_class_t *entry = &r->classes[index];
+            if (entry->class == class)
+                return entry->format;
+            if (!entry->class)
+                break;
+            index = (index + 1) & mask;
+        }
+    }
+
+    // Not seen yet: grow the table if needed, and record the class
+    if (2 * (r->classes_count + 1) > r->classes_size)
+    {
+        render_class_t *old = r->classes;
+        size_t old_size = r->classes_size;
+        r->classes_size = old_size ? 2 * old_size : 32;
+        r->classes = calloc(r->classes_size, sizeof(render_class_t));
+        mask = r->classes_size - 1;
+        for (size_t i = 0; i < old_size; i++)
+        {
+            if (old[i].class)
+            {
+                index = ((uintptr_t) old[i].class >> 4) & mask;
+                while (r->classes[index].class)
+                    index = (index + 1) & mask;
+                r->classes[index] = old[i];
+            }
+        }
+        free(old);
+        index = ((uintptr_t) class >> 4) & mask;
+        while (r->classes[index].class)
+            index = (index + 1) & mask;
+    }
+
+    const char *name = class->name;
+    int format = renderer_find_format(r, strlen(name), name);
+    r->classes[index].class = class;
+    r->classes[index].format = format;
+    r->classes_count++;
+    return format;
+}
+
+
+
+// ============================================================================
+//
+//    Loading the style sheet
+//
+// ============================================================================
+
 void renderer_style(renderer_p renderer, const char  *style)
 // ----------------------------------------------------------------------------
 //    Load a style from the given style file
 // ----------------------------------------------------------------------------
 {
+    // Output may refer to text in the current style
+    renderer_flush(renderer);
+
     positions_p  positions       = error_positions();
     scanner_p    scanner         = scanner_new(positions, NULL);
     FILE        *file            = scanner_open(scanner, style);
@@ -190,7 +661,7 @@ void renderer_style(renderer_p renderer, const char  *style)
         case tokCHARACTER:
         case tokSYMBOL:
         case tokNAME:
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
 
             if (eq(source, "="))
             {
@@ -258,7 +729,8 @@ void renderer_style(renderer_p renderer, const char  *style)
 
         default:
             // Any other stuff (indents, etc) is skipped
-            error(position(positions), "Unexpected token %t", scanner->source);
+            error(position(positions), "Unexpected token %t",
+                  scanner_source(scanner));
             break;
         } // switch
 
@@ -274,9 +746,10 @@ void renderer_style(renderer_p renderer, const char  *style)
         text_dispose(&source);
     } // while
 
-    // Sort the formats for faster search
+    // Sort the formats for faster search, and compile them
     array_sort(formats, (compare_fn) text_compare, 2);
     array_set(&renderer->formats, formats);
+    renderer_compile(renderer);
 
     // Cleanup
     text_dispose(&entry);
@@ -314,7 +787,11 @@ void renderer_reset(renderer_p renderer)
 //
 // ============================================================================
 
-static bool   render_format(renderer_p renderer, text_p format);
+static bool   render_format(renderer_p renderer, int format);
+static bool   render_directive(renderer_p renderer,
+                               const render_directive_t *directive);
+static void   render_chars(renderer_p renderer,
+                           size_t length, const char *data, bool is_static);
 static void   render_separators(renderer_p renderer, char next);
 static void   render_indents(renderer_p renderer);
 static bool   render_child(renderer_p renderer, unsigned index);
@@ -326,9 +803,10 @@ void render_file(renderer_p r, tree_p tree)
 // ----------------------------------------------------------------------------
 {
     renderer_reset(r);
-    render_format(r, r->begin);
+    render_directive(r, &r->begin);
     render(r, tree);
-    render_format(r, r->end);
+    render_directive(r, &r->end);
+    renderer_flush(r);
 }
 
 
@@ -337,14 +815,12 @@ void render(renderer_p r, tree_p tree)
 //    Render the tree using the tree handler
 // ----------------------------------------------------------------------------
 {
-    const char *type = tree_typename(tree);
-    text_p format = text_cnew(tree_position(tree), type);
+    int format = renderer_class_format(r, tree_class_of(tree));
     tree_p save_self = r->self;
     r->self = tree;
     if (!render_format(r, format))
         tree_io(TREE_RENDER, tree, r);
     r->self = save_self;
-    text_dispose(&format);
 }
 
 
@@ -390,160 +866,131 @@ static bool render_children(renderer_p r)
 }
 
 
-static bool render_format(renderer_p r, text_p format)
+static bool render_format(renderer_p r, int format)
 // ----------------------------------------------------------------------------
-//   Render a given format if found
+//   Render a compiled format if there is one
 // ----------------------------------------------------------------------------
 {
-    // During emergency rendering, we may not have 'cr', 'space', etc
-    if (!format)
+    if (format < 0)
         return false;
 
-    // Find if format has text form, e.g "ABC" or 'ABC'
-    size_t length = text_length(format);
-    if (length >= 2)
+    // Render all directives in turn
+    render_format_t    *compiled = &r->compiled[format];
+    render_directive_t *d        = r->directives + compiled->first;
+    bool                err      = false;
+    for (size_t i = 0; i < compiled->count; i++, d++)
     {
-        char *data = text_data(format);
-        if ((data[0] == '"' || data[0] == '\'') && data[length-1] == data[0])
+        if (!render_directive(r, d))
         {
-            // Render text as is, no quote
-            render_text(r, length - 2, data + 1);
-            return true;
+            if (err == false)
+            {
+                err = true;
+                error(text_position(compiled->name),
+                      "While rendering %t", compiled->name);
+                error(text_position(d->source),
+                      "Invalid format directive %t", d->source);
+            }
         }
     }
+    return true;
+}
 
-#define KEYWORD(x)   if (eq(format, x))
 
-    KEYWORD("self")
+static bool render_directive(renderer_p r, const render_directive_t *d)
+// ----------------------------------------------------------------------------
+//   Render a single directive, return false if it is invalid
+// ----------------------------------------------------------------------------
+{
+    switch(d->op)
     {
+    case RENDER_NONE:
+        return false;
+    case RENDER_TEXT:
+        // Style sheet text remains valid while the style is in use
+        render_chars(r, d->length, d->data, true);
+        return true;
+    case RENDER_FORMAT:
+        return render_format(r, d->format);
+    case RENDER_SELF:
         tree_io(TREE_RENDER, r->self, r);
         return true;
-    }
-    KEYWORD("indent")
-    {
+    case RENDER_INDENT:
         r->indents += 1;
         return true;
-    }
-    KEYWORD("unindent")
-    {
+    case RENDER_UNINDENT:
         r->indents -= 1;
         return true;
-    }
-    KEYWORD("indents")
-    {
+    case RENDER_INDENTS:
         render_indents(r);
         return true;
-    }
-    KEYWORD("separator")
-    {
+    case RENDER_SEPARATOR:
         r->need_separator = true;
         return true;
-    }
-    KEYWORD("cr")
-    {
+    case RENDER_NEWLINE:
         r->need_newline = true;
         return true;
-    }
-    KEYWORD("newline")
-    {
-        r->need_newline = true;
-        return true;
-    }
-    // Convenient for infix, prefix and postfix
-    KEYWORD("left")
-    {
-        if (render_child(r, 0))
-            return true;
-    }
-    KEYWORD("right")
-    {
-        if (render_child(r, 1))
-            return true;
-    }
-    KEYWORD("opcode")
-    {
-        if (render_child(r, 2))
-            return true;
-    }
-    // Convenient for blocks
-    KEYWORD("opening")
-    {
-        if (render_child(r, 0))
+    case RENDER_CHILD:
+        if (render_child(r, d->child))
             return true;
-    }
-    KEYWORD("closing")
-    {
-        if (render_child(r, 1))
-            return true;
-    }
-    KEYWORD("child")
-    {
-        if (render_children(r))
-            return true;
-    }
-    KEYWORD("children")
-    {
+        break;
+    case RENDER_CHILDREN:
         if (render_children(r))
             return true;
-    }
-    KEYWORD("space")
-    {
+        break;
+    case RENDER_SPACE:
         if (!r->had_space)
             render_text(r, 1, " ");
         return true;
     }
 
-    // Find if format was declared in style sheet
-    if (r->formats)
-    {
-        int index = array_search(r->formats,
-                                 (tree_p)format,
-                                 (compare_fn) text_compare,
-                                 2);
-        if (index >= 0)
-        {
-            // It was found: render all elements in array in turn
-            array_p seq  = (array_p) array_child(r->formats, 2*index+1);
-            size_t  len  = array_length(seq);
-            text_p *data = (text_p *) array_data(seq);
-            bool    err  = false;
-            for (size_t i = 0; i < len; i++)
-            {
-                if (!render_format(r, *data++))
-                {
-                    if (err == false)
-                    {
-                        err = true;
-                        error(text_position(format),
-                              "While rendering %t", format);
-                        error(text_position(data[-1]),
-                              "Invalid format directive %t", data[-1]);
-                    }
-                }
-            }
-            return true;
-        }
-    }
+    // No child to render: use a format with the same name if there is one
+    return render_format(r, d->format);
+}
 
-    // Nothing found
-    return false;
+
+static inline bool render_plain(renderer_p r, char c)
+// ----------------------------------------------------------------------------
+//   Check if a character can be sent to the output as is
+// ----------------------------------------------------------------------------
+{
+    return c != '\n' && c != r->quote && r->chars[(uint8_t) c] < 0;
 }
 
 
-void render_text(renderer_p r, size_t length, const char *data)
+static void render_chars(renderer_p r,
+                         size_t length, const char *data, bool is_static)
 // ----------------------------------------------------------------------------
-//   Send the given text to the output
+//   Send the given text to the output, referring to it if static
 // ----------------------------------------------------------------------------
 {
-    srcpos_t pos = tree_position(r->self);
-    for (size_t i = 0; i < length; i++)
+    size_t i = 0;
+    while (i < length)
     {
+        // Send runs of characters that need no special treatment at once
+        if (!r->need_newline && !r->need_separator && !r->had_newline)
+        {
+            size_t run = i;
+            while (run < length && render_plain(r, data[run]))
+                run++;
+            if (run > i)
+            {
+                render_output(r, run - i, data + i, is_static);
+                r->had_space = isspace(data[run-1]);
+                r->had_punctuation = ispunct(data[run-1]);
+                i = run;
+                continue;
+            }
+        }
+
         char c = data[i];
         if (r->need_newline || r->need_separator || r->had_newline)
         {
             render_separators(r, c);
             if (r->had_newline && i == 0 && c == '\n')
+            {
+                i++;
                 continue;
+            }
         }
 
         if (c == '\n')
@@ -554,7 +1001,7 @@ void render_text(renderer_p r, size_t length, const char *data)
         else
         {
             bool quoted = c == r->quote;
-            text_p format = text_new(pos, 1, &c);
+            int format = r->chars[(uint8_t) c];
             if (render_format(r, format))
             {
                 if (quoted)
@@ -562,18 +1009,27 @@ void render_text(renderer_p r, size_t length, const char *data)
             }
             else
             {
-                r->output(r->stream, 1, &c);
+                render_output(r, 1, &c, false);
                 if (quoted)
-                    r->output(r->stream, 1, &c); // As in """Hello"""
+                    render_output(r, 1, &c, false); // As in """Hello"""
             }
-            text_dispose(&format);
         }
         r->had_space = isspace(c);
         r->had_punctuation = ispunct(c);
+        i++;
     }
 }
 
 
+void render_text(renderer_p r, size_t length, const char *data)
+// ----------------------------------------------------------------------------
+//   Send the given text to the output
+// ----------------------------------------------------------------------------
+{
+    render_chars(r, length, data, false);
+}
+
+
 void render_open_quote(renderer_p r, char quote)
 // ----------------------------------------------------------------------------
 //   Write out the open quote
@@ -612,8 +1068,8 @@ void render_separators(renderer_p r, char next)
     {
         r->had_newline = true;
         r->need_newline = false;
-        if (!render_format(r, r->cr))
-            r->output(r->stream, 1, "\n");
+        if (!render_directive(r, &r->cr))
+            render_output(r, 1, "\n", false);
     }
 
     if (next != '\n')
@@ -632,8 +1088,8 @@ void render_separators(renderer_p r, char next)
             {
                 if (r->had_punctuation == ispunct(next))
                 {
-                    if (!render_format(r, r->space))
-                        r->output(r->stream, 1, " ");
+                    if (!render_directive(r, &r->space))
+                        render_output(r, 1, " ", false);
                 }
             }
         }
@@ -646,7 +1102,22 @@ void render_indents(renderer_p r)
 //   Render indentation level
 // ----------------------------------------------------------------------------
 {
-    for (unsigned i = 0; i < r->indents; i++)
-        if (!render_format(r, r->indent))
-            render_text(r, 4, "    ");
+    static const char spaces[] = "                                "
+                                 "                                ";
+
+    if (r->indent.op != RENDER_NONE)
+    {
+        for (unsigned i = 0; i < r->indents; i++)
+            render_directive(r, &r->indent);
+        return;
+    }
+
+    // Default is four spaces per level, taken from a static string
+    size_t length = 4 * r->indents;
+    while (length)
+    {
+        size_t chunk = length < sizeof(spaces) - 1 ? length : sizeof(spaces)-1;
+        render_chars(r, chunk, spaces, true);
+        length -= chunk;
+    }
 }
@@ -32,6 +32,8 @@ extern void             renderer_delete(renderer_p renderer);
 extern syntax_p         renderer_syntax(renderer_p, syntax_p);
 extern tree_io_fn       renderer_output_function(renderer_p, tree_io_fn);
 extern void *           renderer_output_stream(renderer_p, void *);
+extern int              renderer_output_fd(renderer_p, int fd);
+extern void             renderer_flush(renderer_p);
 extern void             renderer_style(renderer_p, const char *style);
 extern void             renderer_reset(renderer_p renderer);
 
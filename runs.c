@@ -0,0 +1,23 @@
+// ****************************************************************************
+//  runs.c                                          XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Find the length of runs of characters of the same class
+//
+//     The functions are inline in runs.h, this only emits their code.
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#define RUNS_C
+#include "runs.h"
@@ -0,0 +1,81 @@
+#ifndef RUNS_H
+#define RUNS_H
+// ****************************************************************************
+//  runs.h                                          XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Find the length of runs of characters of the same class
+//
+//     The scanner uses these functions to skip over blanks, names or
+//     digits in its input buffer without going through scanner_getchar
+//     for each character. Runs in source code are short, a few bytes on
+//     average, so a simple loop is faster than vector instructions here.
+//
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include <stddef.h>
+
+#ifdef RUNS_C
+#define inline extern inline
+#endif
+
+// Return the number of characters of a given class at the start of input
+typedef size_t (*runs_fn)(const char *first, const char *last);
+
+inline size_t runs_blanks(const char *first, const char *last);
+inline size_t runs_names(const char *first, const char *last);
+inline size_t runs_digits(const char *first, const char *last);
+
+#undef inline
+
+
+inline size_t runs_blanks(const char *first, const char *last)
+// ----------------------------------------------------------------------------
+//   Spaces and tabs
+// ----------------------------------------------------------------------------
+{
+    const char *p = first;
+    while (p < last && (*p == ' ' || *p == '\t'))
+        p++;
+    return p - first;
+}
+
+
+inline size_t runs_names(const char *first, const char *last)
+// ----------------------------------------------------------------------------
+//   ASCII letters, digits and underscore
+// ----------------------------------------------------------------------------
+{
+    const char *p = first;
+    while (p < last)
+    {
+        unsigned char c = *p;
+        if ((unsigned char) ((c | 0x20) - 'a') >= 26 &&
+            (unsigned char) (c - '0') >= 10 &&
+            c != '_')
+            break;
+        p++;
+    }
+    return p - first;
+}
+
+
+inline size_t runs_digits(const char *first, const char *last)
+// ----------------------------------------------------------------------------
+//   Decimal digits
+// ----------------------------------------------------------------------------
+{
+    const char *p = first;
+    while (p < last && (unsigned char) (*p - '0') < 10)
+        p++;
+    return p - first;
+}
+
+#endif // RUNS_H
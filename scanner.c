@@ -25,12 +25,15 @@
 #include "error.h"
 #include "name.h"
 #include "recorder.h"
+#include "runs.h"
 #include "utf8.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 RECORDER(SCANNER, 64, "Recording tokens that were scanned");
@@ -43,6 +46,10 @@ RECORDER(SCANNER, 64, "Recording tokens that were scanned");
 //
 // ============================================================================
 
+// How new scanners read their input
+static scanner_input_t scanner_default_mode = SCANNER_BUFFERED;
+
+
 scanner_p scanner_new(positions_p positions, syntax_p syntax)
 // ----------------------------------------------------------------------------
 //    Create a new scanner
@@ -52,8 +59,22 @@ scanner_p scanner_new(positions_p positions, syntax_p syntax)
     s->positions = positions;
     s->reader = NULL;
     s->stream = NULL;
+    s->input = NULL;
+    s->input_next = NULL;
+    s->input_end = NULL;
+    s->input_size = 0;
+    s->input_mode = scanner_default_mode;
+    s->input_mapped = false;
+    s->input_position = position(positions);
+    s->source_position = s->input_position;
     s->syntax = syntax_use(syntax);
     s->source = NULL;
+    s->spelling = s->spelling_short;
+    s->spelling_length = 0;
+    s->spelling_size = sizeof(s->spelling_short);
+    s->replay = NULL;
+    s->replay_length = 0;
+    s->replay_size = 0;
     s->scanned.text = NULL;
     s->indents = indents_new(position(positions), 0, NULL);
     s->block_close = NULL;
@@ -80,6 +101,11 @@ void scanner_delete(scanner_p s)
     indents_dispose(&s->indents);
     name_dispose(&s->block_close);
     syntax_dispose(&s->syntax);
+    if (!s->input_mapped)
+        free(s->input);
+    if (s->spelling != s->spelling_short)
+        free(s->spelling);
+    free(s->replay);
     free(s);
 }
 
@@ -94,14 +120,64 @@ static unsigned scanner_file_read(void *stream, unsigned size, void *data)
 }
 
 
+scanner_input_t scanner_input_default(scanner_input_t mode)
+// ----------------------------------------------------------------------------
+//   Select how new scanners read their input, return old mode
+// ----------------------------------------------------------------------------
+//   Parsers open their file as soon as they are created, this selects
+//   the mode they use. It should be set before starting threads.
+{
+    scanner_input_t old = scanner_default_mode;
+    scanner_default_mode = mode;
+    return old;
+}
+
+
+scanner_input_t scanner_input_mode(scanner_p s, scanner_input_t mode)
+// ----------------------------------------------------------------------------
+//   Select how the scanner reads the next input it opens, return old mode
+// ----------------------------------------------------------------------------
+{
+    scanner_input_t old = s->input_mode;
+    s->input_mode = mode;
+    return old;
+}
+
+
 FILE *scanner_open(scanner_p s, const char *file)
 // ----------------------------------------------------------------------------
 //    Open the given file in the scanner
 // ----------------------------------------------------------------------------
+//    In SCANNER_MMAP mode, we map regular files in memory, and fall back
+//    to buffered reads for anything that can't be mapped, e.g. pipes.
+//    The mapping covers the whole file, so the reader is never called.
 {
     FILE *f = fopen(file, "r");
     if (f)
+    {
+        struct stat st;
+        if (s->input_mode == SCANNER_MMAP &&
+            fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                             fileno(f), 0);
+            if (map != MAP_FAILED)
+            {
+                if (!s->input_mapped)
+                    free(s->input);
+                s->input = map;
+                s->input_next = map;
+                s->input_end = s->input + st.st_size;
+                s->input_size = st.st_size;
+                s->input_mapped = true;
+                scanner_open_stream(s, file, scanner_file_read, f);
+                RECORD(SCANNER, "Mapped file '%s' = %p size %zu",
+                       file, map, s->input_size);
+                return f;
+            }
+        }
         scanner_open_stream(s, file, scanner_file_read, f);
+    }
     RECORD(SCANNER, "Open file '%s' = %p", file, f);
     return f;
 }
@@ -128,7 +204,26 @@ void scanner_open_stream(scanner_p s, const char *name,
     assert(s->reader == NULL && "Cannot open a scanner that is already open");
     s->reader = reader;
     s->stream = stream;
-    position_open_source_file(s->positions, name);
+    if (!s->input_mapped)
+    {
+        if (s->input_mode == SCANNER_STREAM)
+        {
+            free(s->input);
+            s->input = NULL;
+            s->input_size = 0;
+        }
+        else if (!s->input)
+        {
+            s->input = malloc(SCANNER_BUFFER_SIZE);
+            s->input_size = SCANNER_BUFFER_SIZE;
+        }
+        s->input_next = s->input_end = s->input;
+    }
+    s->input_position = position_open_source_file(s->positions, name);
+    s->source_position = s->input_position;
+    s->spelling_length = 0;
+    s->replay_length = 0;
+    text_dispose(&s->source);
 }
 
 
@@ -140,6 +235,18 @@ void scanner_close_stream(scanner_p s, void *stream)
     assert(stream == s->stream && "Only the current input can be closed");
     s->stream = NULL;
     s->reader = NULL;
+    if (s->input_mapped)
+    {
+        munmap(s->input, s->input_size);
+        s->input = NULL;
+        s->input_size = 0;
+        s->input_mapped = false;
+    }
+    s->input_next = s->input_end = s->input;
+    s->input_position = s->source_position = position(s->positions);
+    s->spelling_length = 0;
+    s->replay_length = 0;
+    text_dispose(&s->source);
 }
 
 
@@ -150,31 +257,83 @@ void scanner_close_stream(scanner_p s, void *stream)
 //
 // ============================================================================
 
-static int scanner_getchar(scanner_p s)
+static int scanner_refill(scanner_p s)
 // ----------------------------------------------------------------------------
-//   Read next character from scanner
+//   Refill the input buffer when we reached its end, return next char
 // ----------------------------------------------------------------------------
+//   The bytes of the current token are kept at the beginning of the buffer,
+//   since scanner_source may still need them. The buffer grows if a single
+//   token does not fit in it. The end of a mapped file is the end of input.
+//   Unbuffered streams first return the bytes that scanner_rewind put back.
 {
-    char c = s->pending_char[0];
-    if (c)
+    unsigned char c;
+    if (s->replay_length)
+        return (unsigned char) s->replay[--s->replay_length];
+    if (!s->reader)
+        return EOF;
+    if (s->input_mapped)
     {
-        s->pending_char[0] = s->pending_char[1];
-        s->pending_char[1] = 0;
+        s->reader = NULL;
+        return EOF;
+    }
+    if (!s->input)
+    {
+        // Unbuffered stream
+        unsigned size = s->reader(s->stream, 1, &c);
+        if (size != 1)
+        {
+            s->reader = NULL;
+            return EOF;
+        }
         return c;
     }
-    if (!s->reader)
-        return EOF;
-    unsigned size = s->reader(s->stream, 1, &c);
-    if (size != 1)
+
+    size_t used = s->input_end - s->input;
+    size_t first = s->source_position - s->input_position;
+    if (first > used)
+        first = used;
+    size_t kept = used - first;
+    memmove(s->input, s->input + first, kept);
+    s->input_position += first;
+    if (kept == s->input_size)
+    {
+        s->input_size *= 2;
+        s->input = realloc(s->input, s->input_size);
+    }
+
+    s->input_next = s->input + kept;
+    s->input_end = s->input_next;
+    unsigned size = s->reader(s->stream, s->input_size - kept, s->input_next);
+    if (size == 0)
     {
         s->reader = NULL;
         return EOF;
     }
+    s->input_end += size;
+    c = *s->input_next++;
     return c;
 }
 
 
-static inline void scanner_ungetchar(scanner_p s, char c)
+static inline int scanner_getchar(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Read next character from scanner, as an unsigned char or EOF
+// ----------------------------------------------------------------------------
+{
+    int c = s->pending_char[0];
+    if (c)
+    {
+        s->pending_char[0] = s->pending_char[1];
+        s->pending_char[1] = 0;
+        return c;
+    }
+    if (s->input_next < s->input_end)
+        return (unsigned char) *s->input_next++;
+    return scanner_refill(s);
+}
+
+
+static inline void scanner_ungetchar(scanner_p s, int c)
 // ----------------------------------------------------------------------------
 //   Unget last character from input stream
 // ----------------------------------------------------------------------------
@@ -196,13 +355,93 @@ static inline unsigned scanner_position(scanner_p s)
 }
 
 
+static inline const char *scanner_source_data(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return the first byte of the current token
+// ----------------------------------------------------------------------------
+{
+    if (s->input)
+        return s->input + (s->source_position - s->input_position);
+    return s->spelling;
+}
+
+
+static inline size_t scanner_source_length(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return the number of bytes consumed in the current token
+// ----------------------------------------------------------------------------
+//   At end of input, the text scanner consumes a fake closing quote,
+//   so we do not go past the end of the input buffer
+{
+    if (s->input)
+    {
+        size_t length = position(s->positions) - s->source_position;
+        size_t available = s->input_end - scanner_source_data(s);
+        return length < available ? length : available;
+    }
+    return s->spelling_length;
+}
+
+
+static void scanner_source_start(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Start recording the source of a new token at the current position
+// ----------------------------------------------------------------------------
+{
+    s->source_position = position(s->positions);
+    s->spelling_length = 0;
+    text_dispose(&s->source);
+}
+
+
+text_p scanner_source(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return the source text for the current token
+// ----------------------------------------------------------------------------
+//   When reading from a buffer or a mapped file, the source is a slice of
+//   the input. When reading from an unbuffered stream, scanner_consume
+//   copies it in the scanner spelling. In both cases, we only create
+//   a text for callers that need one.
+{
+    size_t length = scanner_source_length(s);
+    if (!s->source || text_length(s->source) != length)
+        text_set(&s->source, text_new(s->source_position, length,
+                                      scanner_source_data(s)));
+    return s->source;
+}
+
+
+static void scanner_spell(scanner_p s, char c)
+// ----------------------------------------------------------------------------
+//   Record one byte of the current token when reading an unbuffered stream
+// ----------------------------------------------------------------------------
+//   Short tokens fit in the scanner itself, longer ones use the heap
+{
+    if (s->spelling_length == s->spelling_size)
+    {
+        size_t size = 2 * s->spelling_size;
+        if (s->spelling == s->spelling_short)
+        {
+            s->spelling = malloc(size);
+            memcpy(s->spelling, s->spelling_short, s->spelling_length);
+        }
+        else
+        {
+            s->spelling = realloc(s->spelling, size);
+        }
+        s->spelling_size = size;
+    }
+    s->spelling[s->spelling_length++] = c;
+}
+
+
 static inline void scanner_consume(scanner_p s, char c)
 // ----------------------------------------------------------------------------
 //   Update position and token input after consuming one character
 // ----------------------------------------------------------------------------
 {
-    if (c)
-        text_append_data(&s->source, 1, &c);
+    if (c && !s->input)
+        scanner_spell(s, c);
     position_step(s->positions);
 }
 
@@ -217,14 +456,145 @@ static inline int scanner_nextchar(scanner_p s, char c)
 }
 
 
-static name_p scanner_normalize(text_p input)
+static void scanner_replay(scanner_p s, int c)
+// ----------------------------------------------------------------------------
+//   Put back a byte to read again from an unbuffered stream
+// ----------------------------------------------------------------------------
+{
+    if (c == EOF || c == 0)
+        return;
+    if (s->replay_length == s->replay_size)
+    {
+        s->replay_size = s->replay_size ? 2 * s->replay_size : 16;
+        s->replay = realloc(s->replay, s->replay_size);
+    }
+    s->replay[s->replay_length++] = c;
+}
+
+
+static void scanner_rewind(scanner_p s, size_t length, int c)
+// ----------------------------------------------------------------------------
+//   Shorten the current token to length, and read what follows again
+// ----------------------------------------------------------------------------
+//   The bytes consumed after length, the lookahead c and pending characters
+//   are read again. A buffer or a mapped file still holds them after the
+//   token. An unbuffered stream puts them back in the replay stack.
+{
+    size_t consumed = position(s->positions) - s->source_position;
+    assert(length <= consumed && "Cannot rewind past the end of a token");
+    s->positions->position = s->source_position + length;
+
+    if (s->input)
+    {
+        s->input_next = (char *) scanner_source_data(s) + length;
+    }
+    else
+    {
+        scanner_replay(s, s->pending_char[1]);
+        scanner_replay(s, s->pending_char[0]);
+        scanner_replay(s, c);
+        while (consumed > length)
+            scanner_replay(s, s->spelling[--consumed]);
+        s->spelling_length = length;
+    }
+    s->pending_char[0] = 0;
+    s->pending_char[1] = 0;
+}
+
+
+static inline size_t scanner_available(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Number of bytes we can look at directly in the input buffer
+// ----------------------------------------------------------------------------
+//   Runs can only be skipped in the buffer when no character is pending
+{
+    if (!s->input || s->pending_char[0])
+        return 0;
+    return s->input_end - s->input_next;
+}
+
+
+static inline void scanner_skip_bytes(scanner_p s, size_t count)
+// ----------------------------------------------------------------------------
+//   Consume count bytes directly from the input buffer
+// ----------------------------------------------------------------------------
+{
+    s->input_next += count;
+    position_skip(s->positions, count);
+}
+
+
+static inline void scanner_run(scanner_p s, runs_fn run)
+// ----------------------------------------------------------------------------
+//   Consume a run of characters of the same class from the input buffer
+// ----------------------------------------------------------------------------
+{
+    if (scanner_available(s))
+        scanner_skip_bytes(s, run(s->input_next, s->input_end));
+}
+
+
+static inline void scanner_indent_run(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Consume a run of indentation characters, counting columns
+// ----------------------------------------------------------------------------
+//   Stop at the first character that differs from the indentation character,
+//   so that the caller reports mixed tabs and spaces as it did before.
+{
+    size_t available = scanner_available(s);
+    if (available && s->indent_char)
+    {
+        size_t count = 0;
+        while (count < available && s->input_next[count] == s->indent_char)
+            count++;
+        s->column += count;
+        scanner_skip_bytes(s, count);
+    }
+}
+
+
+static inline unsigned long long scanner_digits_run(scanner_p s,
+                                                    unsigned base,
+                                                    unsigned long long value)
+// ----------------------------------------------------------------------------
+//   Consume a run of decimal digits, accumulating their value
+// ----------------------------------------------------------------------------
+{
+    if (scanner_available(s))
+    {
+        const char *digits = s->input_next;
+        size_t count = runs_digits(digits, s->input_end);
+        for (size_t i = 0; i < count; i++)
+            value = base * value + (digits[i] - '0');
+        scanner_skip_bytes(s, count);
+    }
+    return value;
+}
+
+
+static inline void scanner_text_run(scanner_p s, char eos)
+// ----------------------------------------------------------------------------
+//   Consume text characters up to the next end-of-text quote
+// ----------------------------------------------------------------------------
+{
+    size_t available = scanner_available(s);
+    if (available)
+    {
+        const char *end = memchr(s->input_next, eos, available);
+        scanner_skip_bytes(s, end ? (size_t) (end - s->input_next)
+                                  : available);
+    }
+}
+
+
+static name_p scanner_normalize(scanner_p s)
 // ----------------------------------------------------------------------------
 //   Create an output name that is the normalized variant of the input
 // ----------------------------------------------------------------------------
 //   For normalization, we convert everything to lowercase and skip '_' chars
 {
-    const char *src = text_data(input);
-    unsigned size = text_length(input);
+    const char *src = scanner_source_data(s);
+    unsigned size = scanner_source_length(s);
     assert(name_is_valid(size, src) && "Normalizing invalid name");
 
     // Check for the relatively frequent case where input is already normalized
@@ -240,16 +610,14 @@ static name_p scanner_normalize(text_p input)
         normalized_size += relevant;
     }
     if (normalized)
-    {
-        // Force-cast text to name (assume otherwise identical representation)
-        name_p result = (name_p) input;
-        ((tree_p) result)->handler = name_handler;
-        return result;
-    }
-
-    // It's not normalized. We need a new name to copy data into
-    name_p result = name_new(text_position(input), normalized_size, src);
-    char *dst = (char *) name_data(result);
+        return name_intern(size, src);
+
+    // It's not normalized. Build the normalized spelling, then intern it
+    char buffer[256];
+    char *normal = normalized_size <= sizeof(buffer)
+        ? buffer
+        : malloc(normalized_size);
+    char *dst = normal;
     for (unsigned i = 0; i < size; i++)
     {
         char c = src[i];
@@ -257,6 +625,9 @@ static name_p scanner_normalize(text_p input)
             continue;
         *dst++ = tolower(c);
     }
+    name_p result = name_intern(normalized_size, normal);
+    if (normal != buffer)
+        free(normal);
     return result;
 }
 
@@ -266,9 +637,11 @@ static character_p scanner_character(text_p text)
 //    Check if a character is valid and return it
 // ----------------------------------------------------------------------------
 {
+    tree_box_t   box;
     srcpos_t     pos    = text_position(text);
-    char        *data   = text_data(text);
-    size_t       len    = text_length(text);
+    text_p       source = (text_p) tree_unbox((tree_p) text, &box);
+    char        *data   = text_data(source);
+    size_t       len    = text_length(source);
     unsigned     code   = utf8_code(data, len);
     character_p  result = character_new(pos, code);
 
@@ -286,8 +659,8 @@ token_t scanner_read(scanner_p s)
 {
     srcpos_t pos = scanner_position(s);
 
-    // Create new source text and clear scanned tree if it was set earlier
-    text_set(&s->source, text_new(pos, 0, NULL));
+    // Start new source text and clear scanned tree if it was set earlier
+    scanner_source_start(s);
     tree_dispose(&s->scanned.tree);
 
     // Check if we have something to read
@@ -336,6 +709,10 @@ token_t scanner_read(scanner_p s)
 
         // Keep looking for more spaces
         scanner_consume(s, c == '\n' ? c : 0);
+        if (s->checking_indent)
+            scanner_indent_run(s);
+        else
+            scanner_run(s, runs_blanks);
         c = scanner_getchar(s);
     } // End of space processing (indentation check and space skipping)
 
@@ -401,7 +778,7 @@ token_t scanner_read(scanner_p s)
     }
 
     // Clear spelling from whitespaces
-    text_range(&s->source, 0, 0);
+    scanner_source_start(s);
 
     // Update position to match first non-space
     pos = scanner_position(s);
@@ -427,9 +804,9 @@ token_t scanner_read(scanner_p s)
         unsigned           blob_digbits   = 4;
         unsigned           blob_maxbits   = 8;
 
-        // Initialize digit values the first time
-        static uint8_t base_value[0x100] = { 0 };
-        static uint8_t base64_value[0x100] = { 0 };
+        // Initialize digit values the first time, in each thread
+        static __thread uint8_t base_value[0x100] = { 0 };
+        static __thread uint8_t base64_value[0x100] = { 0 };
         if (base_value[0] == 0)
         {
             // For bases 2-36
@@ -486,7 +863,10 @@ token_t scanner_read(scanner_p s)
                     }
 
                 }
-                c = scanner_nextchar(s, c);
+                scanner_consume(s, c);
+                if (!blob && base >= 10)
+                    natural_value = scanner_digits_run(s, base, natural_value);
+                c = scanner_getchar(s);
                 if (c == '_')       // Skip a single underscore
                 {
                     c = scanner_nextchar(s, c);
@@ -590,7 +970,8 @@ token_t scanner_read(scanner_p s)
         // Check for fractional part for real numbers
         else if (c == '.')
         {
-            int mantissa_digit = scanner_nextchar(s, c);
+            // Only consume the '.' once we know it belongs to the number
+            int mantissa_digit = scanner_getchar(s);
             if (digit_value[mantissa_digit] >= base)
             {
                 // This is something else following an integer: 1..3, 1.(3)
@@ -607,6 +988,7 @@ token_t scanner_read(scanner_p s)
             {
                 double comma_position = 1.0;
                 floating_point = true;
+                scanner_consume(s, c);
                 c = mantissa_digit;
                 while (digit_value[c] < base)
                 {
@@ -708,12 +1090,16 @@ token_t scanner_read(scanner_p s)
     else if (utf8_isalpha(c))
     {
         while (isalnum(c) || c == '_' || utf8_is_first(c) || utf8_is_next(c))
-            c = scanner_nextchar(s, c);
+        {
+            scanner_consume(s, c);
+            scanner_run(s, runs_names);
+            c = scanner_getchar(s);
+        }
         scanner_ungetchar(s, c);
         s->had_space_after = isspace(c);
 
         // Check if this is a block marker
-        name_set(&s->scanned.name, scanner_normalize(s->source));
+        name_set(&s->scanned.name, scanner_normalize(s));
         if (s->syntax)
         {
             if (syntax_is_block(s->syntax, s->scanned.name, &s->block_close))
@@ -722,8 +1108,7 @@ token_t scanner_read(scanner_p s)
                        pos, s->scanned.name);
                 return tokOPEN;
             }
-            else if (s->block_close &&
-                     name_compare(s->scanned.name, s->block_close) == 0)
+            else if (s->scanned.name == s->block_close)
             {
                 name_dispose(&s->block_close);
                 RECORD(SCANNER, "At pos %u return CLOSE %p",
@@ -739,8 +1124,12 @@ token_t scanner_read(scanner_p s)
     // Look for texts
     else if (c == '"' || c == '\'')
     {
+        // Create the text at the first closing quote, so that texts without
+        // doubled quotes are copied only once, at the right size. Short
+        // texts are immediates, which doubled quotes turn into texts
         char eos = c;
-        text_p text = text_use(text_new(pos, 0, NULL));
+        text_p text = NULL;
+        size_t run = 1;
         c = scanner_nextchar(s, c);
         for(;;)
         {
@@ -753,6 +1142,14 @@ token_t scanner_read(scanner_p s)
             }
             if (c == eos)
             {
+                // Copy the text since the opening or last doubled quote
+                size_t end = scanner_source_length(s);
+                const char *data = scanner_source_data(s) + run;
+                if (!text)
+                    text = text_use(text_new_short(pos, end - run, data));
+                else if (end > run)
+                    text_append_data(&text, end - run, data);
+                run = end + 1;
                 c = scanner_nextchar(s, c);
                 if (c != eos)
                 {
@@ -775,9 +1172,9 @@ token_t scanner_read(scanner_p s)
 
                 // Doubling the quoting character puts it in the text
             }
-            char ch = (char) c;
-            text_append_data(&text, 1, &ch);
-            c = scanner_nextchar(s, c);
+            scanner_consume(s, c);
+            scanner_text_run(s, eos);
+            c = scanner_getchar(s);
         }
     } // End of text handling
 
@@ -785,25 +1182,42 @@ token_t scanner_read(scanner_p s)
     token_t tok = tokSYMBOL;
     if (s->syntax)
     {
-        // Normal scanning mode: check if operators exist in syntax
-        while (ispunct(c) && c != '\'' && c != '"' && c != EOF &&
-               syntax_is_operator(s->syntax, (name_p) s->source))
+        // Normal scanning mode: follow the trie for the longest operator
+        const syntax_trie_t *node = NULL;
+        size_t accepted = 0;
+        while (ispunct(c) && c != '\'' && c != '"' && c != EOF)
         {
+            const syntax_trie_t *next = syntax_trie_next(s->syntax, node, c);
+            if (node && !next)
+                break;
             c = scanner_nextchar(s, c);
-            name_p name = (name_p) s->source;
-            if (syntax_is_block(s->syntax, name, &s->block_close))
+            node = next;
+            if (!node)
+                break;
+            if (node->name)
+                accepted = position(s->positions) - s->source_position;
+            if (node->block)
             {
+                name_set(&s->block_close, node->block);
                 tok = tokOPEN;
                 break;
             }
-            else if (s->block_close &&
-                     name_compare(name, s->block_close) == 0)
+            else if (s->block_close && node->name == s->block_close)
             {
                 name_dispose(&s->block_close);
                 tok = tokCLOSE;
                 break;
             }
         }
+
+        // If the path went past the longest operator, e.g. "-" in "--x"
+        // with only "-" and "-->" known, go back to that operator
+        if (accepted &&
+            accepted < position(s->positions) - s->source_position)
+        {
+            scanner_rewind(s, accepted, c);
+            c = scanner_getchar(s);
+        }
     }
     else
     {
@@ -814,7 +1228,7 @@ token_t scanner_read(scanner_p s)
 
     scanner_ungetchar(s, c);
     s->had_space_after = isspace(c);
-    name_set(&s->scanned.name, scanner_normalize(s->source));
+    name_set(&s->scanned.name, scanner_normalize(s));
     RECORD(SCANNER, "At pos %u return %s %p",
            pos,
            tok == tokOPEN ? "OPEN" : tok == tokCLOSE ? "CLOSE" : "SYMBOL",
@@ -829,6 +1243,7 @@ text_p scanner_skip(scanner_p s, name_p closing)
 // ----------------------------------------------------------------------------
 {
     const char *eoc      = name_data(closing);
+    const char *last     = eoc + name_length(closing);
     const char *match    = eoc;
     unsigned    position = scanner_position(s);
     text_p      comment  = text_new(position, 0, NULL);
@@ -836,10 +1251,10 @@ text_p scanner_skip(scanner_p s, name_p closing)
     bool        skip     = false;
 
     // Clear source and scanned value if any
-    text_set(&s->source, text_new(position, 0, NULL));
+    scanner_source_start(s);
     text_dispose(&s->scanned.text);
 
-    while (*match && c != EOF)
+    while (match < last && c != EOF)
     {
         c = scanner_nextchar(s, c);
         skip = false;
@@ -923,4 +1338,4 @@ void scanner_close_parenthese(scanner_p s, unsigned old_indent)
 
 
 // Generate the default handler for indents
-blob_type_handler(indents);
+blob_type_class(indents);
@@ -163,6 +163,23 @@ typedef union scanned
 blob_type(unsigned, indents);
 
 
+typedef enum scanner_input
+// ----------------------------------------------------------------------------
+//   How the scanner reads its input
+// ----------------------------------------------------------------------------
+{
+    SCANNER_STREAM,             // Call the reader for each byte
+    SCANNER_BUFFERED,           // Call the reader for blocks of input
+    SCANNER_MMAP                // Map files in memory, buffered for streams
+} scanner_input_t;
+
+// Size of the input buffer in SCANNER_BUFFERED mode
+#define SCANNER_BUFFER_SIZE     (64 * 1024)
+
+// Size of token spellings kept in the scanner itself in SCANNER_STREAM mode
+#define SCANNER_SPELLING_SIZE   32
+
+
 typedef struct scanner
 // ----------------------------------------------------------------------------
 //    Internal representation of the XL scanner state
@@ -172,18 +189,33 @@ typedef struct scanner
     syntax_p    syntax;                 // Source code syntax
     tree_io_fn  reader;                 // Reading function
     void *      stream;                 // Stream we read from
-    text_p      source;                 // Source form of the parsed token
+    char *      input;                  // Input buffer or mapped file
+    char *      input_next;             // Next byte to read in input
+    char *      input_end;              // End of valid input
+    size_t      input_size;             // Size of input buffer or mapping
+    scanner_input_t input_mode;         // How we read input
+    bool        input_mapped     : 1;   // Input is a memory-mapped file
+    srcpos_t    input_position;         // Source position of input[0]
+    srcpos_t    source_position;        // Source position of current token
+    text_p      source;                 // Source form, see scanner_source
+    char *      spelling;               // Token bytes in SCANNER_STREAM mode
+    size_t      spelling_length;        // Number of bytes in spelling
+    size_t      spelling_size;          // Allocated size for spelling
+    char *      replay;                 // Bytes to read again, last first
+    size_t      replay_length;          // Number of bytes to read again
+    size_t      replay_size;            // Allocated size for replay
     scanned_t   scanned;                // Scanned result
     indents_p   indents;                // Stack of indents
     name_p      block_close;            // Matching block close
     unsigned    indent;                 // Current level of indentation
     unsigned    column;                 // Current column during indentation
-    char        pending_char[2];        // Read-ahead pending chars
+    int         pending_char[2];        // Read-ahead pending chars or EOF
     char        indent_char;            // To detect if mixing space/tabs
     bool        checking_indent  : 1;   // At beginning of line
     bool        setting_indent   : 1;   // Parenthesis sets indent
     bool        had_space_before : 1;   // Had space before token
     bool        had_space_after  : 1;   // Had space after token
+    char        spelling_short[SCANNER_SPELLING_SIZE]; // Short spellings
 } scanner_t, *scanner_p;
 
 
@@ -194,9 +226,12 @@ extern void      scanner_close(scanner_p scan, FILE *f);
 extern void      scanner_open_stream(scanner_p scan, const char *name,
                                      tree_io_fn reader, void *stream);
 extern void      scanner_close_stream(scanner_p scan, void *stream);
+extern scanner_input_t scanner_input_mode(scanner_p scan, scanner_input_t);
+extern scanner_input_t scanner_input_default(scanner_input_t);
 
 extern token_t   scanner_read(scanner_p scan);
 extern text_p    scanner_skip(scanner_p scan, name_p closing);
+extern text_p    scanner_source(scanner_p scan);
 
 extern unsigned  scanner_open_parenthese(scanner_p s);
 extern void      scanner_close_parenthese(scanner_p s, unsigned oldIndent);
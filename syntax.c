@@ -37,7 +37,8 @@ syntax_p syntax_new(const char *file)
 {
     // Zero-initialize the memory
     syntax_p result = (syntax_p) tree_malloc(sizeof(syntax_t));
-    result->tree.handler = syntax_handler;
+    tree_class_register(&syntax_class);     // Like tree_make, for casts
+    tree_set_class(&result->tree, &syntax_class);
 
     result->known = array_use(array_new(0, 0, NULL));
 
@@ -61,6 +62,11 @@ syntax_p syntax_new(const char *file)
 }
 
 
+static void syntax_table_build(syntax_p syntax);
+static void syntax_table_free(syntax_p syntax);
+static void syntax_trie_build(syntax_p syntax);
+
+
 tree_p syntax_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 // ----------------------------------------------------------------------------
 //   Delete the given syntax configuration
@@ -71,27 +77,26 @@ tree_p syntax_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch (cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "syntax";
-
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (may be dynamic for subtypes)
-        return (tree_p) sizeof(syntax_t);
-
-    case TREE_ARITY:
-        // All tree-type fields in the syntax
-        return (tree_p) 9;
-
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == syntax_handler)
-            return tree;
-        break;                      // Pass on to base class handler
+    case TREE_DELETE:
+        syntax_table_free(s);
+        free(s->trie);
+        break;
 
-    case TREE_CHILDREN:
-        // Return the pointer to children for that tree type
-        return (tree_p) &s->filename;
+    case TREE_COPY:
+    case TREE_CLONE:
+        // The copy must not share the table or trie with the original
+        s = (syntax_p) tree_handler(cmd, tree, va);
+        s->table = NULL;
+        s->table_size = 0;
+        s->trie = NULL;
+        syntax_table_build(s);
+        syntax_trie_build(s);
+        return (tree_p) s;
+
+    case TREE_FREEZE:
+    case TREE_THAW:
+        // Priorities and lookup tables are not children, cannot freeze them
+        return NULL;
 
     case TREE_RENDER:
         renderer = va_arg(va, renderer_p);
@@ -120,6 +125,22 @@ tree_p syntax_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
+tree_class_t syntax_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for syntax, all tree-type fields in the syntax are children
+// ----------------------------------------------------------------------------
+//   The lookup tables are not trees, TREE_DELETE must free them.
+{
+    .name          = "syntax",
+    .handler       = syntax_handler,
+    .parent        = &tree_class,
+    .size          = sizeof(syntax_t),
+    .arity         = 9,
+    .children      = offsetof(syntax_t, filename),
+    .custom_delete = true,
+};
+
+
 
 // ============================================================================
 //
@@ -141,7 +162,7 @@ static inline void set(name_p *text, const char *str)
 //   Replace the text
 // ----------------------------------------------------------------------------
 {
-    name_set(text, name_cnew(0, str));
+    name_set(text, name_cintern(str));
 }
 
 
@@ -185,7 +206,12 @@ static inline void sort(array_p array, size_t stride)
 // ----------------------------------------------------------------------------
 //   Sort priority array
 // ----------------------------------------------------------------------------
+//   An array shared with another syntax was not changed by this read, since
+//   appending to it makes a private copy. It is sorted already, and sorting
+//   it again would write memory that other threads may be reading.
 {
+    if (tree_refcount((tree_p) array) > 1)
+        return;
     array_sort(array, (compare_fn) name_compare, stride);
 }
 
@@ -233,17 +259,16 @@ void syntax_read_internal(syntax_p syntax, scanner_p scanner, bool indented)
 
         case tokCHARACTER:
         case tokSYMBOL:
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
             name_set(&scanner->scanned.name,
-                     name_new(text_position(source),
-                              text_length(source) - 2 * offset,
-                              text_data(source) + offset));
+                     name_intern(text_length(source) - 2 * offset,
+                                 text_data(source) + offset));
             name_set(&known_token, scanner->scanned.name);
             /* Fall through */
 
         case tokNAME:
             name_set(&name, scanner->scanned.name);
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
 
             if (eq(source, "NEWLINE"))
                 set(&name, "\n");
@@ -370,6 +395,9 @@ void syntax_read_internal(syntax_p syntax, scanner_p scanner, bool indented)
 
     sort(syntax->syntaxes, 3);
 
+    syntax_table_build(syntax);
+    syntax_trie_build(syntax);
+
     name_dispose(&entry);
 }
 
@@ -403,64 +431,271 @@ void syntax_read_file(syntax_p syntax, const char *filename)
 
 // ============================================================================
 //
-//   Checking syntax elements
+//   Hash table with all the roles of a token
 //
 // ============================================================================
+//   The arrays in the syntax remain the reference, and hold the names.
+//   The table is rebuilt from them each time we read syntax, and lets the
+//   parser find everything it needs to know about a token with one probe.
+//   It is keyed on interned names, so that a probe only hashes a pointer
+//   instead of the spelling. Each entry holds a reference on its name.
 
-static inline int search(array_p array, name_p key, size_t stride)
+static inline size_t syntax_table_hash(name_p name)
 // ----------------------------------------------------------------------------
-//   Binary search on array
+//   Hash an interned name by its address
 // ----------------------------------------------------------------------------
 {
-    return array_search(array, (tree_p) key, (compare_fn) name_compare, stride);
+    uintptr_t key = (uintptr_t) name >> 4;
+    return key ^ (key >> 16);
 }
 
 
-int syntax_infix_priority(syntax_p s, name_p name)
+static size_t syntax_table_find(syntax_p s, name_p name)
 // ----------------------------------------------------------------------------
-//    Return the priority for the given infix, or default_priority
+//   Return the index of the entry for the interned name, or of a free entry
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->infixes, name, 2);
-    if (index >= 0)
+    size_t mask = s->table_size - 1;
+    size_t index = syntax_table_hash(name) & mask;
+    while (s->table[index].name && s->table[index].name != name)
+        index = (index + 1) & mask;
+    return index;
+}
+
+
+static syntax_entry_t *syntax_table_insert(syntax_p s, name_p name)
+// ----------------------------------------------------------------------------
+//   Return the entry for the given name, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    name_p interned = name_intern(name_length(name), name_data(name));
+    syntax_entry_t *entry = &s->table[syntax_table_find(s, interned)];
+    if (!entry->name)
     {
-        natural_p n = (natural_p) array_child(s->infixes, 2*index+1);
-        return natural_value(n);
+        entry->name = name_use(interned);
+        entry->infix = s->default_priority;
+        entry->prefix = s->default_priority;
+        entry->postfix = s->default_priority;
     }
-    return s->default_priority;
+    return entry;
+}
+
 
+static void syntax_table_free(syntax_p s)
+// ----------------------------------------------------------------------------
+//   Release the names in the table and the table itself
+// ----------------------------------------------------------------------------
+{
+    for (size_t i = 0; i < s->table_size; i++)
+        if (s->table[i].name)
+            name_dispose(&s->table[i].name);
+    free(s->table);
+    s->table = NULL;
+    s->table_size = 0;
 }
 
 
-int syntax_prefix_priority(syntax_p s, name_p name)
+static void syntax_table_build(syntax_p s)
 // ----------------------------------------------------------------------------
-//    Return the priority for the given infix, or default_priority
+//   Build the hash table from the sorted arrays
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->prefixes, name, 2);
-    if (index >= 0)
+    array_p priorities[] = { s->infixes, s->prefixes, s->postfixes };
+    array_p delimiters[] = { s->blocks, s->comments, s->texts };
+    size_t  count = array_length(s->syntaxes) / 3;
+    for (unsigned a = 0; a < 3; a++)
+        count += array_length(priorities[a]) / 2
+            +    array_length(delimiters[a]) / 2;
+
+    // Keep the load factor below one half
+    size_t size = 16;
+    while (size < 2 * count)
+        size *= 2;
+    syntax_table_free(s);
+    s->table = calloc(size, sizeof(syntax_entry_t));
+    s->table_size = size;
+
+    for (unsigned a = 0; a < 3; a++)
     {
-        natural_p n = (natural_p) array_child(s->prefixes, 2*index+1);
-        return natural_value(n);
+        array_p array = priorities[a];
+        size_t length = array_length(array);
+        for (size_t i = 0; i < length; i += 2)
+        {
+            name_p name = name_ptr(array_child(array, i));
+            int prio = natural_value(natural_ptr(array_child(array, i+1)));
+            syntax_entry_t *entry = syntax_table_insert(s, name);
+            if (a == 0)
+                entry->infix = prio;
+            else if (a == 1)
+                entry->prefix = prio;
+            else
+                entry->postfix = prio;
+        }
     }
-    return s->default_priority;
 
+    for (unsigned a = 0; a < 3; a++)
+    {
+        array_p array = delimiters[a];
+        size_t length = array_length(array);
+        for (size_t i = 0; i < length; i += 2)
+        {
+            name_p name = name_ptr(array_child(array, i));
+            name_p closing = name_ptr(array_child(array, i+1));
+            syntax_entry_t *entry = syntax_table_insert(s, name);
+            if (a == 0)
+                entry->block = closing;
+            else if (a == 1)
+                entry->comment = closing;
+            else
+                entry->text = closing;
+        }
+    }
+
+    // Ignore child syntaxes whose file could not be read
+    array_p array = s->syntaxes;
+    size_t length = array_length(array);
+    for (size_t i = 0; i < length; i += 3)
+    {
+        syntax_p child = syntax_ptr(array_child(array, i+2));
+        if (!array_length(child->infixes))
+            continue;
+        name_p name = name_ptr(array_child(array, i));
+        syntax_entry_t *entry = syntax_table_insert(s, name);
+        entry->syntax_end = name_ptr(array_child(array, i+1));
+        entry->syntax = child;
+    }
 }
 
 
-int syntax_postfix_priority(syntax_p s, name_p name)
+const syntax_entry_t *syntax_lookup(syntax_p s, name_p name)
 // ----------------------------------------------------------------------------
-//    Return the priority for the given infix, or default_priority
+//   Return the entry for the given name, or NULL if the syntax ignores it
+// ----------------------------------------------------------------------------
+//   The scanner and the parser pass interned names. Other names, including
+//   immediates, are looked up through the intern table first.
+{
+    if (!s->table || !name)
+        return NULL;
+    if (tree_is_immediate((tree_p) name) ||
+        !(((tree_p) name)->flags & TREE_INTERNED))
+    {
+        tree_box_t box;
+        name_p boxed = (name_p) tree_unbox((tree_p) name, &box);
+        name_p interned = name_use(name_intern(name_length(boxed),
+                                               name_data(boxed)));
+        const syntax_entry_t *entry = syntax_lookup(s, interned);
+        name_dispose(&interned);
+        return entry;
+    }
+    syntax_entry_t *entry = &s->table[syntax_table_find(s, name)];
+    return entry->name ? entry : NULL;
+}
+
+
+
+// ============================================================================
+//
+//   Trie of known operators
+//
+// ============================================================================
+//   The scanner follows the trie one character at a time to find the
+//   longest operator at the current position. Only operators made of
+//   characters in the trie range are inserted, since others cannot be
+//   scanned as symbols anyway.
+
+static void syntax_trie_insert(syntax_p s, name_p name)
+// ----------------------------------------------------------------------------
+//   Insert a known operator in the trie
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->postfixes, name, 2);
-    if (index >= 0)
+    size_t      length = name_length(name);
+    const char *data   = name_data(name);
+    for (size_t i = 0; i < length; i++)
+        if (data[i] < SYNTAX_TRIE_FIRST || data[i] > SYNTAX_TRIE_LAST)
+            return;
+
+    size_t node = 0;
+    for (size_t i = 0; i < length; i++)
     {
-        natural_p n = (natural_p) array_child(s->postfixes, 2*index+1);
-        return natural_value(n);
+        unsigned c = data[i] - SYNTAX_TRIE_FIRST;
+        size_t next = s->trie[node].next[c];
+        if (!next)
+        {
+            // Double the allocation each time the size is a power of two
+            next = s->trie_size++;
+            assert(next <= UINT16_MAX && "Too many operators in syntax");
+            if ((next & (next - 1)) == 0)
+                s->trie = realloc(s->trie, 2 * next * sizeof(syntax_trie_t));
+            memset(&s->trie[next], 0, sizeof(syntax_trie_t));
+            s->trie[node].next[c] = next;
+        }
+        node = next;
     }
-    return s->default_priority;
 
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    s->trie[node].name = name;
+    s->trie[node].block = entry ? entry->block : NULL;
+}
+
+
+static void syntax_trie_build(syntax_p s)
+// ----------------------------------------------------------------------------
+//   Build the trie from the known operators
+// ----------------------------------------------------------------------------
+{
+    free(s->trie);
+    s->trie = calloc(1, sizeof(syntax_trie_t));
+    s->trie_size = 1;
+
+    size_t length = array_length(s->known);
+    for (size_t i = 0; i < length; i++)
+        syntax_trie_insert(s, name_ptr(array_child(s->known, i)));
+}
+
+
+
+// ============================================================================
+//
+//   Checking syntax elements
+//
+// ============================================================================
+
+static inline int search(array_p array, name_p key, size_t stride)
+// ----------------------------------------------------------------------------
+//   Binary search on array
+// ----------------------------------------------------------------------------
+{
+    return array_search(array, (tree_p) key, (compare_fn) name_compare, stride);
+}
+
+
+int syntax_infix_priority(syntax_p s, name_p name)
+// ----------------------------------------------------------------------------
+//    Return the priority for the given infix, or default_priority
+// ----------------------------------------------------------------------------
+{
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    return entry ? entry->infix : s->default_priority;
+}
+
+
+int syntax_prefix_priority(syntax_p s, name_p name)
+// ----------------------------------------------------------------------------
+//    Return the priority for the given prefix, or default_priority
+// ----------------------------------------------------------------------------
+{
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    return entry ? entry->prefix : s->default_priority;
+}
+
+
+int syntax_postfix_priority(syntax_p s, name_p name)
+// ----------------------------------------------------------------------------
+//    Return the priority for the given postfix, or default_priority
+// ----------------------------------------------------------------------------
+{
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    return entry ? entry->postfix : s->default_priority;
 }
 
 
@@ -500,10 +735,10 @@ bool syntax_is_block(syntax_p s, name_p name, name_p *closing)
 //    Check if the given name opens a block
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->blocks, name, 2);
-    if (index >= 0)
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    if (entry && entry->block)
     {
-        name_set(closing, (name_p) array_child(s->blocks, 2*index+1));
+        name_set(closing, entry->block);
         return true;
     }
     return false;
@@ -512,13 +747,13 @@ bool syntax_is_block(syntax_p s, name_p name, name_p *closing)
 
 bool syntax_is_text(syntax_p s, name_p name, name_p *closing)
 // ----------------------------------------------------------------------------
-//    Check if the given name opens a block
+//    Check if the given name opens a text
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->texts, name, 2);
-    if (index >= 0)
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    if (entry && entry->text)
     {
-        name_set(closing, (name_p) array_child(s->texts, 2*index+1));
+        name_set(closing, entry->text);
         return true;
     }
     return false;
@@ -527,13 +762,13 @@ bool syntax_is_text(syntax_p s, name_p name, name_p *closing)
 
 bool syntax_is_comment(syntax_p s, name_p name, name_p *closing)
 // ----------------------------------------------------------------------------
-//    Check if the given name opens a block
+//    Check if the given name opens a comment
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->comments, name, 2);
-    if (index >= 0)
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    if (entry && entry->comment)
     {
-        name_set(closing, name_ptr(array_child(s->comments, 2*index+1)));
+        name_set(closing, entry->comment);
         return true;
     }
     return false;
@@ -545,11 +780,98 @@ syntax_p syntax_is_special(syntax_p s, name_p name, name_p *closing)
 //    Check if the given name opens a child syntax
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->comments, name, 3);
-    if (index >= 0)
+    const syntax_entry_t *entry = syntax_lookup(s, name);
+    if (entry && entry->syntax)
     {
-        name_set(closing, name_ptr(array_child(s->comments, 3*index+1)));
-        return syntax_ptr(array_child(s->comments, 3*index+2));
+        name_set(closing, entry->syntax_end);
+        return entry->syntax;
     }
     return NULL;
 }
+
+
+
+// ============================================================================
+//
+//   Identity of a syntax
+//
+// ============================================================================
+
+static uint64_t syntax_hash_data(uint64_t hash, size_t size, const void *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of some data, continuing from the given hash
+// ----------------------------------------------------------------------------
+{
+    const unsigned char *bytes = data;
+    while (size--)
+        hash = (hash ^ *bytes++) * 1099511628211ull;
+    return hash;
+}
+
+
+static uint64_t syntax_hash_contents(uint64_t hash, syntax_p s);
+
+static uint64_t syntax_hash_array(uint64_t hash, array_p array)
+// ----------------------------------------------------------------------------
+//   Hash the names, priorities and child syntaxes in an array
+// ----------------------------------------------------------------------------
+{
+    size_t length = array ? array_length(array) : 0;
+    hash = syntax_hash_data(hash, sizeof(length), &length);
+    for (size_t i = 0; i < length; i++)
+    {
+        tree_p    item = array_child(array, i);
+        name_p    name = name_cast(item);
+        natural_p prio = natural_cast(item);
+        syntax_p  child = syntax_cast(item);
+        if (name)
+        {
+            size_t size = name_length(name);
+            hash = syntax_hash_data(hash, sizeof(size), &size);
+            hash = syntax_hash_data(hash, size, name_data(name));
+        }
+        else if (prio)
+        {
+            unsigned long long value = natural_value(prio);
+            hash = syntax_hash_data(hash, sizeof(value), &value);
+        }
+        else if (child)
+        {
+            hash = syntax_hash_contents(hash, child);
+        }
+    }
+    return hash;
+}
+
+
+static uint64_t syntax_hash_contents(uint64_t hash, syntax_p s)
+// ----------------------------------------------------------------------------
+//   Hash everything in the syntax that changes how source is parsed
+// ----------------------------------------------------------------------------
+{
+    int priorities[] =
+    {
+        s->default_priority, s->statement_priority, s->function_priority
+    };
+    hash = syntax_hash_data(hash, sizeof(priorities), priorities);
+    hash = syntax_hash_array(hash, s->known);
+    hash = syntax_hash_array(hash, s->infixes);
+    hash = syntax_hash_array(hash, s->prefixes);
+    hash = syntax_hash_array(hash, s->postfixes);
+    hash = syntax_hash_array(hash, s->comments);
+    hash = syntax_hash_array(hash, s->texts);
+    hash = syntax_hash_array(hash, s->blocks);
+    hash = syntax_hash_array(hash, s->syntaxes);
+    return hash;
+}
+
+
+uint64_t syntax_hash(syntax_p s)
+// ----------------------------------------------------------------------------
+//   Hash the contents of the syntax, which changes when syntax is read
+// ----------------------------------------------------------------------------
+//   Two syntaxes with the same hash parse the same source the same way,
+//   whether they were read from the same files or not.
+{
+    return syntax_hash_contents(14695981039346656037ull, s);
+}
@@ -25,6 +25,8 @@
 #include "blob.h"
 #include "array.h"
 
+#include <stdint.h>
+
 
 #ifdef SYNTAX_C
 #define inline extern inline
@@ -34,6 +36,39 @@ tree_type(syntax);
 
 #undef inline
 
+typedef struct syntax_entry
+// ----------------------------------------------------------------------------
+//   Everything the syntax says about a given token
+// ----------------------------------------------------------------------------
+//   Priorities that are not set in the syntax file are default_priority.
+//   Closing delimiters are NULL if the token does not open anything.
+{
+    name_p              name;           // Interned name, NULL if entry is free
+    int                 infix;          // Infix priority
+    int                 prefix;         // Prefix priority
+    int                 postfix;        // Postfix priority
+    name_p              block;          // Closing for a block
+    name_p              comment;        // Closing for a comment
+    name_p              text;           // Closing for a text
+    name_p              syntax_end;     // Closing for a child syntax
+    syntax_p            syntax;         // Child syntax
+} syntax_entry_t;
+
+// Range of characters that can appear in operators in the trie
+#define SYNTAX_TRIE_FIRST       '!'
+#define SYNTAX_TRIE_LAST        '~'
+#define SYNTAX_TRIE_WIDTH       (SYNTAX_TRIE_LAST - SYNTAX_TRIE_FIRST + 1)
+
+typedef struct syntax_trie
+// ----------------------------------------------------------------------------
+//   A node in the trie of known operators, the root is the first node
+// ----------------------------------------------------------------------------
+{
+    name_p              name;           // Operator ending here, or NULL
+    name_p              block;          // Closing if operator opens a block
+    uint16_t            next[SYNTAX_TRIE_WIDTH]; // Index of next node, or 0
+} syntax_trie_t;
+
 typedef struct syntax
 // ----------------------------------------------------------------------------
 //   Internal description of the syntax configuration in xl.syntax
@@ -64,6 +99,14 @@ typedef struct syntax
     int                 default_priority;
     int                 statement_priority;
     int                 function_priority;
+
+    // Hash table built from the arrays above, with one entry per token
+    syntax_entry_t *    table;
+    size_t              table_size;     // Always a power of two
+
+    // Trie of known operators, to scan symbols with the longest match
+    syntax_trie_t *     trie;
+    size_t              trie_size;
 } syntax_t;
 
 // Forward declaration
@@ -74,9 +117,11 @@ typedef struct scanner *scanner_p;
 extern syntax_p syntax_new(const char *file);
 extern void     syntax_read_file(syntax_p syntax, const char *file);
 extern void     syntax_read(syntax_p syntax, scanner_p scanner);
+extern uint64_t syntax_hash(syntax_p syntax);
 extern tree_p   syntax_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 // Checking syntax elements
+extern const syntax_entry_t *syntax_lookup(syntax_p, name_p name);
 extern int      syntax_infix_priority(syntax_p, name_p name);
 extern int      syntax_prefix_priority(syntax_p, name_p name);
 extern int      syntax_postfix_priority(syntax_p, name_p name);
@@ -85,9 +130,39 @@ extern bool     syntax_is_block(syntax_p, name_p name, name_p *closing);
 extern bool     syntax_is_text(syntax_p, name_p name, name_p *closing);
 extern bool     syntax_is_comment(syntax_p, name_p name, name_p *closing);
 extern syntax_p syntax_is_special(syntax_p, name_p name, name_p *closing);
+inline const syntax_trie_t *syntax_trie_next(syntax_p,
+                                             const syntax_trie_t *node, int c);
 
 // Internal representation of block indent and unindent
 #define SYNTAX_INDENT    "\t"
 #define SYNTAX_UNINDENT  "\b"
 
+
+
+// ============================================================================
+//
+//   Inline implementations
+//
+// ============================================================================
+
+#ifdef SYNTAX_C
+#define inline extern inline
+#endif // SYNTAX_C
+
+inline const syntax_trie_t *syntax_trie_next(syntax_p s,
+                                             const syntax_trie_t *node, int c)
+// ----------------------------------------------------------------------------
+//   Follow character c from the given node, or from the root if NULL
+// ----------------------------------------------------------------------------
+{
+    if (!s->trie || c < SYNTAX_TRIE_FIRST || c > SYNTAX_TRIE_LAST)
+        return NULL;
+    if (!node)
+        node = s->trie;
+    unsigned next = node->next[c - SYNTAX_TRIE_FIRST];
+    return next ? s->trie + next : NULL;
+}
+
+#undef inline
+
 #endif // SYNTAX_H
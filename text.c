@@ -40,16 +40,6 @@ tree_p text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     switch(cmd)
     {
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "text";
-
-    case TREE_CAST:
-        // Check if we cast to blob type, if so, success
-        if (tree_cast_handler(va) == text_handler)
-            return tree;
-        break;                      // Pass on to base class handler
-
     case TREE_RENDER:
         // Dump the text as a string of characters, doubling quotes
         renderer = va_arg(va, renderer_p);
@@ -70,6 +60,20 @@ tree_p text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
+tree_class_t text_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for texts, with characters following the text_t header
+// ----------------------------------------------------------------------------
+{
+    .name       = "text",
+    .handler    = text_handler,
+    .parent     = &blob_class,
+    .size       = sizeof(text_t),
+    .length     = offsetof(blob_t, length),
+    .item_size  = 1,
+};
+
+
 text_p text_printf(srcpos_t pos, const char *format, ...)
 // ----------------------------------------------------------------------------
 //    Format input with printf-like style and %t extension for trees
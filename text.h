@@ -43,9 +43,10 @@ blob_type(char, text);
 extern text_p      text_printf(srcpos_t pos, const char *format, ...);
 extern text_p      text_vprintf(srcpos_t pos, const char *format, va_list va);
 inline bool        text_eq(text_p, const char *value);
+inline text_p      text_new_short(srcpos_t pos, size_t sz, const char *data);
 
 // Private text handler, should not be called directly in general
-inline text_p text_make(tree_handler_fn h, srcpos_t pos, size_t, const char *);
+inline text_p text_make(tree_class_p, srcpos_t pos, size_t, const char *);
 extern tree_p text_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 // Helper macro to initialize with a C constant
@@ -65,9 +66,29 @@ inline bool text_eq(text_p text, const char *str)
 //   Check if the text matches some string constant
 // ----------------------------------------------------------------------------
 {
+    if (tree_is_immediate((tree_p) text))
+    {
+        tree_box_t box;
+        return text_eq((text_p) tree_unbox((tree_p) text, &box), str);
+    }
     size_t len = text_length(text);
     const char *data = text_data(text);
     return memcmp(str, data, len) == 0 && str[len] == 0;
 }
 
+
+inline text_p text_new_short(srcpos_t pos, size_t sz, const char *data)
+// ----------------------------------------------------------------------------
+//   Return an immediate text if the data is short enough, else a new text
+// ----------------------------------------------------------------------------
+{
+    tree_p tree = tree_immediate_text(TREE_IMMEDIATE_TEXT, pos, sz, data);
+    if (tree)
+    {
+        tree_class_register(&text_class);
+        return (text_p) tree;
+    }
+    return text_new(pos, sz, data);
+}
+
 #endif // TEXT_H
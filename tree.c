@@ -21,11 +21,15 @@
 #define TREE_C
 #include "tree.h"
 
+#include "arena.h"
 #include "error.h"
+#include "name.h"
+#include "number.h"
 #include "recorder.h"
 #include "renderer.h"
 #include "text.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,24 +37,127 @@
 
 RECORDER(ALLOC, 128, "Tree allocations");
 
+// Arena where new trees are allocated by this thread, NULL for the heap
+static __thread arena_p current_arena = NULL;
+
+// Registered classes, that can be found by name when thawing trees
+static tree_class_p tree_classes = NULL;
+static pthread_mutex_t tree_classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifndef NDEBUG
 
 typedef struct tree_debug
 // ----------------------------------------------------------------------------
 //   Header containing debug information for tree debugging
 // ----------------------------------------------------------------------------
+//   The chain comes first, since the allocator may overwrite it once freed,
+//   whereas the source, i.e. where the tree was freed, is used after that.
 {
+    struct tree_debug * previous;       // Chain of trees for memchecks
+    struct tree_debug * next;
+    struct tree_debug_segment *segment; // Segment holding the chain
     const char *        source;         // Allocation position in source
     unsigned            alloc;          // Order of allocation
-    struct tree_debug * previous;       // Global chain of trees for memchecks
-    struct tree_debug * next;
 } tree_debug_t, *tree_debug_p;
 
-// Global list of trees for memory allocation debugging
-static tree_debug_p trees = NULL, trees_end = NULL;
+
+typedef struct tree_debug_segment
+// ----------------------------------------------------------------------------
+//   The list of trees allocated by a thread
+// ----------------------------------------------------------------------------
+//   Each thread links the trees it allocates in its own segment, so that
+//   threads do not contend for a global list. The lock is only contended
+//   when a thread frees a tree allocated by another one, or for memchecks.
+//   Segments of threads that exited are adopted by new threads.
+{
+    tree_debug_p        first, last;    // Trees in the segment
+    pthread_mutex_t     lock;           // Protects the list of trees
+    bool                active;         // A live thread owns the segment
+    struct tree_debug_segment *next;    // Next segment
+} tree_debug_segment_t, *tree_debug_segment_p;
+
+// Segments of all threads, and segment of the current thread
+static tree_debug_segment_p tree_segments = NULL;
+static pthread_mutex_t tree_segments_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread tree_debug_segment_p tree_segment = NULL;
+static pthread_key_t tree_segment_key;
+static pthread_once_t tree_segment_once = PTHREAD_ONCE_INIT;
 static unsigned allocs = 0;
 
 
+static void tree_segment_exit(void *data)
+// ----------------------------------------------------------------------------
+//   When a thread exits, let another thread adopt its segment
+// ----------------------------------------------------------------------------
+{
+    tree_debug_segment_p segment = data;
+    pthread_mutex_lock(&tree_segments_lock);
+    segment->active = false;
+    pthread_mutex_unlock(&tree_segments_lock);
+}
+
+
+static void tree_segment_key_create(void)
+// ----------------------------------------------------------------------------
+//   Create the key used to be notified when threads exit
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&tree_segment_key, tree_segment_exit);
+}
+
+
+static tree_debug_segment_p tree_segment_get(void)
+// ----------------------------------------------------------------------------
+//   Return the segment of the current thread, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    tree_debug_segment_p segment = tree_segment;
+    if (segment)
+        return segment;
+
+    pthread_once(&tree_segment_once, tree_segment_key_create);
+    pthread_mutex_lock(&tree_segments_lock);
+    for (segment = tree_segments; segment; segment = segment->next)
+        if (!segment->active)
+            break;
+    if (!segment)
+    {
+        segment = malloc(sizeof(tree_debug_segment_t));
+        segment->first = segment->last = NULL;
+        pthread_mutex_init(&segment->lock, NULL);
+        segment->next = tree_segments;
+        tree_segments = segment;
+    }
+    segment->active = true;
+    pthread_mutex_unlock(&tree_segments_lock);
+
+    pthread_setspecific(tree_segment_key, segment);
+    tree_segment = segment;
+    return segment;
+}
+
+
+static void tree_debug_unlink(tree_debug_p debug)
+// ----------------------------------------------------------------------------
+//   Remove a tree being freed from the list of its segment
+// ----------------------------------------------------------------------------
+{
+    tree_debug_segment_p segment = debug->segment;
+    pthread_mutex_lock(&segment->lock);
+    tree_debug_p previous = debug->previous;
+    tree_debug_p next = debug->next;
+    if (previous)
+        previous->next = next;
+    else
+        segment->first = next;
+    if (next)
+        next->previous = previous;
+    else
+        segment->last = previous;
+    pthread_mutex_unlock(&segment->lock);
+}
+
+
 unsigned tree_debug_index = ~0U;
 
 void tree_debug(tree_debug_p debug, tree_p tree)
@@ -64,26 +171,242 @@ void tree_debug(tree_debug_p debug, tree_p tree)
 #endif
 
 
+arena_p tree_set_arena(arena_p new_arena)
+// ----------------------------------------------------------------------------
+//   Select the arena for new trees, return the previous one
+// ----------------------------------------------------------------------------
+{
+    arena_p old = current_arena;
+    current_arena = new_arena;
+    return old;
+}
+
+
+// ============================================================================
+//
+//    Size-class pools recycling the memory of small trees
+//
+// ============================================================================
+//   Small allocations are rounded up to a multiple of TREE_POOL_GRAIN,
+//   and freed blocks are kept in a free list for their size class.
+//   Each block in a pool comes from its own malloc, so that the heap
+//   remains a valid fallback for any block, e.g. when a list is full.
+//   Pools are per thread, so a block freed by another thread than the
+//   one that allocated it simply goes to the pools of the freeing thread.
+
+#define TREE_POOL_GRAIN         16
+#define TREE_POOL_CLASSES       16
+#define TREE_POOL_MAX_SIZE      (TREE_POOL_GRAIN * TREE_POOL_CLASSES)
+#define TREE_POOL_MAX_FREE      4096
+#define TREE_POOL_CLASS(sz)     (((sz) + TREE_POOL_GRAIN-1) / TREE_POOL_GRAIN)
+
+typedef struct tree_pool_item
+// ----------------------------------------------------------------------------
+//   A free block in a size class
+// ----------------------------------------------------------------------------
+{
+    struct tree_pool_item *next;
+} tree_pool_item_t, *tree_pool_item_p;
+
+
+typedef struct tree_pool
+// ----------------------------------------------------------------------------
+//   A free list for a given size class
+// ----------------------------------------------------------------------------
+{
+    tree_pool_item_p    free;           // Free blocks in this class
+    unsigned            count;          // Number of free blocks
+    unsigned            hits;           // Allocations served from free list
+    unsigned            misses;         // Allocations that went to malloc
+} tree_pool_t;
+
+// Index 0 is unused, sizes 1 to TREE_POOL_GRAIN have class 1
+static __thread tree_pool_t tree_pools[TREE_POOL_CLASSES + 1];
+
+
+void tree_pool_statistics(void)
+// ----------------------------------------------------------------------------
+//   Record the pool hit / miss counters for each size class
+// ----------------------------------------------------------------------------
+{
+    for (unsigned c = 1; c <= TREE_POOL_CLASSES; c++)
+    {
+        tree_pool_t *pool = &tree_pools[c];
+        if (pool->hits || pool->misses)
+            RECORD(ALLOC, "Pool size %u: %u hits, %u misses, %u free",
+                   c * TREE_POOL_GRAIN, pool->hits, pool->misses, pool->count);
+    }
+}
+
+
+void tree_pool_release(void)
+// ----------------------------------------------------------------------------
+//   Return the free blocks in the pools of this thread to the heap
+// ----------------------------------------------------------------------------
+//   Threads call this before they exit, not to leak their free blocks.
+{
+    for (unsigned c = 1; c <= TREE_POOL_CLASSES; c++)
+    {
+        tree_pool_t *pool = &tree_pools[c];
+        while (pool->free)
+        {
+            tree_pool_item_p item = pool->free;
+            pool->free = item->next;
+            free(item);
+        }
+        pool->count = 0;
+    }
+}
+
+
+static size_t tree_memory_capacity(size_t size)
+// ----------------------------------------------------------------------------
+//   Return the capacity reserved for a given size outside of arenas
+// ----------------------------------------------------------------------------
+//   Up to TREE_POOL_MAX_SIZE, this is the size class of the pools.
+//   Above, there are four capacities per power of two, so that a tree
+//   growing by small steps is only copied a logarithmic number of times.
+{
+    if (size <= TREE_POOL_MAX_SIZE)
+        return TREE_POOL_CLASS(size) * TREE_POOL_GRAIN;
+    unsigned bits = 8 * sizeof(unsigned long long) - 1
+        - __builtin_clzll((unsigned long long) size - 1);
+    size_t step = (size_t) 1 << (bits - 2);
+    return (size + step - 1) & ~(step - 1);
+}
+
+
+static void *tree_memory_alloc(size_t size, unsigned *flags)
+// ----------------------------------------------------------------------------
+//   Allocate from current arena if there is one, otherwise from pools / heap
+// ----------------------------------------------------------------------------
+//   The flags are set to TREE_ARENA if the memory comes from an arena.
+{
+    if (current_arena)
+    {
+        void *result = arena_alloc(current_arena, size);
+        *flags = result ? TREE_ARENA : 0;
+        if (result)
+            return result;
+    }
+    *flags = 0;
+    if (size <= TREE_POOL_MAX_SIZE)
+    {
+        size_t class = TREE_POOL_CLASS(size);
+        tree_pool_t *pool = &tree_pools[class];
+        tree_pool_item_p item = pool->free;
+        if (item)
+        {
+            pool->free = item->next;
+            pool->count--;
+            pool->hits++;
+            return item;
+        }
+        pool->misses++;
+        return malloc(class * TREE_POOL_GRAIN);
+    }
+    return malloc(tree_memory_capacity(size));
+}
+
+
+static void tree_memory_free(void *ptr, size_t size, unsigned flags)
+// ----------------------------------------------------------------------------
+//   Free memory, either in the arena that owns it, in a pool or on the heap
+// ----------------------------------------------------------------------------
+{
+    if (flags & TREE_ARENA)
+    {
+        arena_free(arena_owner(ptr), ptr);
+        return;
+    }
+    if (size <= TREE_POOL_MAX_SIZE)
+    {
+        tree_pool_t *pool = &tree_pools[TREE_POOL_CLASS(size)];
+        if (pool->count < TREE_POOL_MAX_FREE)
+        {
+            tree_pool_item_p item = ptr;
+            item->next = pool->free;
+            pool->free = item;
+            pool->count++;
+            return;
+        }
+    }
+    free(ptr);
+}
+
+
+static void *tree_memory_realloc(void *old, size_t old_size, size_t size,
+                                 unsigned *flags)
+// ----------------------------------------------------------------------------
+//   Reallocate memory, possibly moving it out of its arena or size class
+// ----------------------------------------------------------------------------
+//   The old size may be smaller than the actual allocation, e.g. if
+//   the length of a blob was reduced before truncating it. That is
+//   safe, since the capacity of the block can only be underestimated.
+//   Blocks grow geometrically, so that appending to a blob or array is
+//   amortized O(1), and only shrink if most of their space is wasted.
+//   The flags of the old memory are updated for the new memory.
+{
+    unsigned old_flags = *flags;
+    if (old_flags & TREE_ARENA)
+    {
+        arena_p owner = arena_owner(old);
+        old_size = arena_size(old);
+        if (size <= old_size)
+            return old;
+        if (arena_resize(owner, old, tree_memory_capacity(size)) ||
+            arena_resize(owner, old, size))
+            return old;
+    }
+    else
+    {
+        size_t capacity = tree_memory_capacity(old_size);
+        if (size <= capacity &&
+            (capacity <= TREE_POOL_MAX_SIZE || size >= capacity / 4))
+            return old;
+        if (old_size > TREE_POOL_MAX_SIZE && size > TREE_POOL_MAX_SIZE)
+            return realloc(old, tree_memory_capacity(size));
+    }
+
+    void *result = tree_memory_alloc(tree_memory_capacity(size), flags);
+    if (result)
+    {
+        memcpy(result, old, old_size < size ? old_size : size);
+        tree_memory_free(old, old_size, old_flags);
+    }
+    else
+    {
+        *flags = old_flags;
+    }
+    return result;
+}
+
+
 tree_p tree_malloc_(const char *source, size_t size)
 // ----------------------------------------------------------------------------
 //   Allocate a tree, clear refcount and insert in global list
 // ----------------------------------------------------------------------------
 {
+    unsigned flags;
 #ifdef NDEBUG
-    tree_p result = malloc(size);
+    tree_p result = tree_memory_alloc(size, &flags);
 #else
-    tree_debug_p debug = malloc(sizeof(tree_debug_t) + size);
+    tree_debug_p debug = tree_memory_alloc(sizeof(tree_debug_t) + size, &flags);
     tree_p result = (tree_p) (debug + 1);
 
+    tree_debug_segment_p segment = tree_segment_get();
     debug->source = source;
-    debug->alloc = allocs++;
+    debug->alloc = __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    debug->segment = segment;
     debug->next = NULL;
-    debug->previous = trees_end;
-    if (trees_end)
-        trees_end->next = debug;
+    pthread_mutex_lock(&segment->lock);
+    debug->previous = segment->last;
+    if (segment->last)
+        segment->last->next = debug;
     else
-        trees = debug;
-    trees_end = debug;
+        segment->first = debug;
+    segment->last = debug;
+    pthread_mutex_unlock(&segment->lock);
 
     if (debug->alloc == tree_debug_index)
         tree_debug(debug, result);
@@ -91,6 +414,7 @@ tree_p tree_malloc_(const char *source, size_t size)
 
     RECORD(ALLOC, "%s: malloc(%zu)=%p", source, size, result);
     memset(result, 0, size);
+    result->flags = flags;
 
     return result;
 }
@@ -105,28 +429,37 @@ tree_p tree_realloc_(const char *source, tree_p old, size_t new_size)
         return tree_malloc(new_size);
 
     assert(old->refcount <= 1 && "Do not create dangling pointers to tree");
+    size_t old_size = tree_size(old);
+    unsigned flags = old->flags;
 
 #ifdef NDEBUG
-    tree_p result = realloc(old, new_size);
+    tree_p result = tree_memory_realloc(old, old_size, new_size, &flags);
 #else
+    // The segment is locked while the tree moves, since neighbours point to it
     tree_debug_p old_dbg = (tree_debug_p) old - 1;
+    tree_debug_segment_p segment = old_dbg->segment;
+    pthread_mutex_lock(&segment->lock);
     tree_debug_p previous = old_dbg->previous;
     tree_debug_p next = old_dbg->next;
-    tree_debug_p debug = realloc(old_dbg, sizeof(tree_debug_t) + new_size);
+    tree_debug_p debug = tree_memory_realloc(old_dbg,
+                                             sizeof(tree_debug_t) + old_size,
+                                             sizeof(tree_debug_t) + new_size,
+                                             &flags);
     tree_p result = (tree_p) (debug + 1);
 
-    debug->alloc = allocs++;
     if (debug != old_dbg)
     {
         if (next)
             next->previous = debug;
         else
-            trees_end = debug;
+            segment->last = debug;
         if (previous)
             previous->next = debug;
         else
-            trees = debug;
+            segment->first = debug;
     }
+    pthread_mutex_unlock(&segment->lock);
+    debug->alloc = __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
     debug->source = source;
 
     if (debug->alloc == tree_debug_index)
@@ -134,6 +467,7 @@ tree_p tree_realloc_(const char *source, tree_p old, size_t new_size)
 #endif // NDEBUG
 
     RECORD(ALLOC, "%s: realloc(%p,%zu)=%p", source, old, new_size, result);
+    result->flags = flags;
 
     return result;
 }
@@ -148,11 +482,34 @@ tree_p tree_double_free(tree_cmd_t cmd, tree_p tree, va_list va)
     tree_debug_p debug = (tree_debug_p) tree - 1;
     fprintf(stderr, "*** Freed tree %p alloc #%u received command %s ***\n",
             tree, debug->alloc, tree_cmd_name(cmd));
-    fprintf(stderr, "%s: Tree was probably freed here\n",
-            (char *) tree->position);
+    fprintf(stderr, "%s: Tree was probably freed here\n", debug->source);
     abort();
 }
+
+
+static tree_class_t tree_freed_class =
+// ----------------------------------------------------------------------------
+//   Class installed on freed trees to detect double free
+// ----------------------------------------------------------------------------
+{
+    .name       = "freed",
+    .handler    = tree_double_free,
+    .size       = sizeof(tree_t),
+};
+#endif // NDEBUG
+
+
+#if TREE_COMPACT
+// Registered classes by index, for the class_id of trees
+// Index 0 is reserved for freed trees, see tree_free_
+tree_class_p tree_class_table[TREE_CLASS_MAX] =
+{
+#ifndef NDEBUG
+    &tree_freed_class,
 #endif // NDEBUG
+};
+static unsigned tree_class_count = 1;
+#endif // TREE_COMPACT
 
 
 void tree_free_(const char *source, tree_p tree)
@@ -162,28 +519,109 @@ void tree_free_(const char *source, tree_p tree)
 {
     assert(tree->refcount == 0 && "Only non-referenced trees can be freed");
     RECORD(ALLOC, "%s: free(%p) refcount %u", source, tree, tree->refcount);
+    size_t size = tree_size(tree);
 #ifndef NDEBUG
     tree_debug_p debug = (tree_debug_p) tree - 1;
-    tree_debug_p previous = debug->previous;
-    tree_debug_p next = debug->next;
     if (debug->alloc == tree_debug_index)
         tree_debug(debug, tree);
 
-    if (previous)
-        previous->next = next;
-    else
-        trees = next;
-    if (next)
-        next->previous = previous;
-    else
-        trees_end = previous;
-    tree->handler = tree_double_free;
-    tree->position = (srcpos_t) source;
-    free(debug);
+    tree_debug_unlink(debug);
+    tree_set_class(tree, &tree_freed_class);
+    debug->source = source;
+    tree_memory_free(debug, sizeof(tree_debug_t) + size, tree->flags);
+#else
+    tree_memory_free(tree, size, tree->flags);
+#endif // NDEBUG
+
+}
+
+
+static inline tree_p tree_arena_item(void *ptr)
+// ----------------------------------------------------------------------------
+//   Return the tree in an allocation returned by arena_next
+// ----------------------------------------------------------------------------
+{
+#ifdef NDEBUG
+    return ptr;
 #else
-    free(tree);
+    return (tree_p) ((tree_debug_p) ptr + 1);
 #endif // NDEBUG
+}
+
 
+static inline bool tree_in_arena(tree_p tree, arena_p arena)
+// ----------------------------------------------------------------------------
+//   Check if a tree was allocated in the given arena
+// ----------------------------------------------------------------------------
+{
+    return tree && !tree_is_immediate(tree) &&
+        (tree->flags & TREE_ARENA) && arena_owner(tree) == arena;
+}
+
+
+static bool tree_arena_count(arena_p arena, int delta)
+// ----------------------------------------------------------------------------
+//   Add delta to the refcount of trees for each reference in the arena
+// ----------------------------------------------------------------------------
+//   Return false if some tree in the arena must receive TREE_DELETE
+{
+    bool ok = true;
+    for (void *ptr = arena_next(arena, NULL); ptr; ptr = arena_next(arena, ptr))
+    {
+        tree_p tree = tree_arena_item(ptr);
+        if (tree_class_of(tree)->custom_delete)
+            ok = false;
+        tree_children_loop(tree,
+                           if (tree_in_arena(*child, arena))
+                               (*child)->refcount += delta);
+    }
+    return ok;
+}
+
+
+bool tree_arena_delete(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Delete a tree with its whole arena if the arena was closed
+// ----------------------------------------------------------------------------
+//   Once the owner closed an arena, e.g. the parser, the trees in it are
+//   usually only referenced from the root of the parse tree, so deleting
+//   the root deletes them all. Instead of sending TREE_DELETE to each of
+//   them, references within the arena are removed in one pass over the
+//   arena. If no tree remains referenced, a second pass releases the
+//   trees referenced outside of the arena, e.g. allocated before it, and
+//   the chunks are dropped at once. Otherwise, some trees escaped and are
+//   deleted one by one, like the remaining trees in that arena.
+{
+    arena_p arena = arena_owner(tree);
+    if (!arena->closed || arena->escaped)
+        return false;
+
+    bool ok = tree_arena_count(arena, -1);
+    for (void *ptr = arena_next(arena, NULL);
+         ok && ptr;
+         ptr = arena_next(arena, ptr))
+        ok = tree_arena_item(ptr)->refcount == 0;
+    if (!ok)
+    {
+        tree_arena_count(arena, 1);
+        arena->escaped = true;
+        RECORD(ALLOC, "Trees escaped from arena %p", arena);
+        return false;
+    }
+
+    for (void *ptr = arena_next(arena, NULL); ptr; ptr = arena_next(arena, ptr))
+    {
+        tree_p item = tree_arena_item(ptr);
+        tree_children_loop(item,
+                           if (!tree_in_arena(*child, arena))
+                               tree_dispose(child));
+#ifndef NDEBUG
+        tree_debug_unlink(ptr);
+#endif // NDEBUG
+    }
+    RECORD(ALLOC, "Dropped arena %p with tree %p", arena, tree);
+    arena_drop(arena);
+    return true;
 }
 
 
@@ -194,45 +632,73 @@ unsigned tree_memcheck(unsigned expected_tree_count)
 //   This can be called at any point doing memory allocations, after
 //   all trees have been tree_use'd or disposed of.
 //   It will signal any leftover (leaked) tree.
+//   The trees of all threads are checked, each segment being locked
+//   while it is walked, so other threads should not be building trees.
 {
     unsigned index = 0;
+    tree_pool_statistics();
 #ifndef NDEBUG
-    bool bad = false;
-    for (tree_debug_p debug = trees; debug; debug = debug->next)
+    bool bad = false, corrupt = false;
+    unsigned allocated = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    tree_segment_get();         // Printing below allocates in our segment
+    pthread_mutex_lock(&tree_segments_lock);
+    for (tree_debug_segment_p segment = tree_segments;
+         segment && !corrupt;
+         segment = segment->next)
     {
-        index++;
-        tree_p tree = (tree_p) (debug + 1);
-        if ((int) tree->refcount <= 0)
+        pthread_mutex_lock(&segment->lock);
+        for (tree_debug_p debug = segment->first; debug; debug = debug->next)
         {
-            fprintf(stderr,
-                    "%s: Tree #%u (%p) has refcount %d\n",
-                    debug->source, debug->alloc, tree, (int) tree->refcount);
-            bad = true;
-        }
-        if (index > allocs)
-        {
-            fprintf(stderr,
-                    "*** More trees (%u) than what we allocated (%u)\n"
-                    "*** Maybe a corruption of the list of trees\n",
-                    index, allocs);
-            bad = true;
-            break;
+            index++;
+            tree_p tree = (tree_p) (debug + 1);
+            if ((int) tree->refcount <= 0)
+            {
+                fprintf(stderr,
+                        "%s: Tree #%u (%p) has refcount %d\n",
+                        debug->source, debug->alloc, tree,
+                        (int) tree->refcount);
+                bad = true;
+            }
+            if (index > allocated)
+            {
+                fprintf(stderr,
+                        "*** More trees (%u) than what we allocated (%u)\n"
+                        "*** Maybe a corruption of the list of trees\n",
+                        index, allocated);
+                bad = corrupt = true;
+                break;
+            }
         }
+        pthread_mutex_unlock(&segment->lock);
     }
 
     if (index > expected_tree_count)
     {
         fprintf(stderr, "Too many trees left, found %u, expected %u\n",
                 index, expected_tree_count);
-        for (tree_debug_p debug = trees; debug; debug = debug->next)
+        for (tree_debug_segment_p segment = tree_segments;
+             segment;
+             segment = segment->next)
         {
-            tree_p tree = (tree_p) (debug + 1);
-            fprintf(stderr, "Leaked tree index %u addr %p refcount %d\n",
-                    debug->alloc, tree, (int) tree->refcount);
-            tree_print(stderr, tree);
-            fprintf(stderr, "\n");
+            pthread_mutex_lock(&segment->lock);
+            for (tree_debug_p debug = segment->first;
+                 debug;
+                 debug = debug->next)
+            {
+                tree_p tree = (tree_p) (debug + 1);
+                fprintf(stderr, "Leaked tree index %u addr %p refcount %d\n",
+                        debug->alloc, tree, (int) tree->refcount);
+
+                // Printing may allocate and free trees in this segment
+                pthread_mutex_unlock(&segment->lock);
+                tree_print(stderr, tree);
+                fprintf(stderr, "\n");
+                pthread_mutex_lock(&segment->lock);
+            }
+            pthread_mutex_unlock(&segment->lock);
         }
     }
+    pthread_mutex_unlock(&tree_segments_lock);
 
     if (bad)
         recorder_dump();
@@ -241,36 +707,142 @@ unsigned tree_memcheck(unsigned expected_tree_count)
 }
 
 
-tree_p tree_make(tree_handler_fn handler, srcpos_t position, ...)
+tree_p tree_make(tree_class_p class, srcpos_t position, ...)
 // ----------------------------------------------------------------------------
-//   Create a new tree with the given handler, position and pass extra args
+//   Create a new tree with the given class, position and pass extra args
 // ----------------------------------------------------------------------------
 {
     va_list va;
 
     // Pass the va to TREE_INITIALIZE for dynamic types, e.g. text
     va_start(va, position);
-    tree_p tree = (tree_p) handler(TREE_INITIALIZE, NULL, va);
+    tree_p tree = (tree_p) class->handler(TREE_INITIALIZE, NULL, va);
     va_end(va);
 
-    tree->handler = handler;
+    tree_class_register(class);
+
+    tree_set_class(tree, class);
     tree->refcount = 0;
-    tree->position = position;
+    tree_set_position(tree, position);
 
     return tree;
 }
 
 
+static void tree_class_register_locked(tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Compute the depth and display of a class and its ancestors
+// ----------------------------------------------------------------------------
+//   Classes deeper than TREE_CLASS_DISPLAY only record their first
+//   ancestors in the display, and casts to them use tree_cast_slow.
+//   The first entry of the display is written last, since other threads
+//   test it without holding the lock to know if the class is registered.
+{
+    if (class->display[0])
+        return;
+    class->next = tree_classes;
+    tree_classes = class;
+
+#if TREE_COMPACT
+    if (tree_class_count >= TREE_CLASS_MAX)
+    {
+        fprintf(stderr, "*** Too many tree classes, cannot register %s ***\n",
+                class->name);
+        abort();
+    }
+    class->id = tree_class_count++;
+    tree_class_table[class->id] = class;
+#endif // TREE_COMPACT
+
+    tree_class_p parent = class->parent;
+    if (!parent)
+    {
+        tree_store_relaxed(class->depth, 0);
+        tree_store(class->display[0], class);
+        return;
+    }
+
+    tree_class_register_locked(parent);
+
+    unsigned depth = parent->depth + 1;
+    for (unsigned d = 1; d < depth && d < TREE_CLASS_DISPLAY; d++)
+        class->display[d] = parent->display[d];
+    if (depth < TREE_CLASS_DISPLAY)
+    {
+        tree_store_relaxed(class->depth, depth);
+        class->display[depth] = class;
+    }
+    else
+    {
+        // Too deep: keep depth 0 so that fast casts to this class fail
+        tree_store_relaxed(class->depth, 0);
+    }
+    tree_store(class->display[0], parent->display[0]);
+}
+
+
+void tree_class_register(tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Register a class, which threads may do concurrently from tree_make
+// ----------------------------------------------------------------------------
+{
+    if (tree_load(class->display[0]))
+        return;
+    pthread_mutex_lock(&tree_classes_lock);
+    tree_class_register_locked(class);
+    pthread_mutex_unlock(&tree_classes_lock);
+}
+
+
+tree_class_p tree_class_find(size_t size, const char *name)
+// ----------------------------------------------------------------------------
+//   Find a registered class by name, e.g. to thaw trees or load images
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&tree_classes_lock);
+    tree_class_p class;
+    for (class = tree_classes; class; class = class->next)
+        if (strlen(class->name) == size && memcmp(class->name, name, size) == 0)
+            break;
+    pthread_mutex_unlock(&tree_classes_lock);
+    return class;
+}
+
+
+tree_p tree_cast_slow(tree_p tree, tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Cast when the display does not give a direct answer
+// ----------------------------------------------------------------------------
+{
+    tree_class_p type = tree_class_of(tree);
+    tree_class_register(type);
+    tree_class_register(class);
+
+    unsigned depth = class->depth;
+    if (depth || class == &tree_class)
+        return type->display[depth] == class ? tree : NULL;
+
+    // Class is too deep for the display, walk the parent chain
+    for (tree_class_p base = type; base; base = base->parent)
+        if (base == class)
+            return tree;
+    return NULL;
+}
+
+
 tree_p tree_io(tree_cmd_t cmd, tree_p tree, ...)
 // ----------------------------------------------------------------------------
 //   Perform some tree I/O operation, passed over using varargs
 // ----------------------------------------------------------------------------
+//   Handlers get immediates expanded in a box for the duration of the call
 {
-    va_list va;
+    va_list    va;
+    tree_box_t box;
+    tree_p     self = tree_unbox(tree, &box);
     va_start(va, tree);                    // Should really be (io, stream)
-    tree_p result = (tree_p) tree->handler(cmd, tree, va);
+    tree_p result = (tree_p) tree_class_of(self)->handler(cmd, self, va);
     va_end(va);
-    return result;
+    return result == self ? tree : result;
 }
 
 
@@ -295,15 +867,17 @@ static unsigned tree_text_output(void *stream, unsigned size, void *data)
 }
 
 
-static void render_to(tree_p tree, tree_io_fn out, void *stream)
+static void render_to(tree_p tree, tree_io_fn out, void *stream, int fd)
 // ----------------------------------------------------------------------------
-//   Use the error render to render to a specific I/O function
+//   Use the error render to render to a specific I/O function or file
 // ----------------------------------------------------------------------------
 {
     renderer_p  renderer    = error_renderer();
     tree_io_fn  save_out    = renderer_output_function(renderer, out);
     void       *save_stream = renderer_output_stream(renderer, stream);
+    int         save_fd     = renderer_output_fd(renderer, fd);
     render(renderer, tree);
+    renderer_output_fd(renderer, save_fd);
     renderer_output_function(renderer, save_out);
     renderer_output_stream(renderer, save_stream);
 }
@@ -316,8 +890,8 @@ text_p tree_text(tree_p tree)
 {
     if (!tree)
         return text_cnew(0, "<null>");
-    text_p result = text_cnew(tree->position, "");
-    render_to(tree, tree_text_output, &result);
+    text_p result = text_cnew(tree_position(tree), "");
+    render_to(tree, tree_text_output, &result, -1);
     return result;
 }
 
@@ -337,47 +911,814 @@ void tree_print(FILE *stream, tree_p tree)
 //    Print the tree to the given file output (typically stdout)
 // ----------------------------------------------------------------------------
 {
-    render_to(tree, tree_print_output, stream);
+    // Write to the file descriptor, after anything buffered in the stream
+    fflush(stream);
+    render_to(tree, tree_print_output, stream, fileno(stream));
 }
 
 
-tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
+
+// ============================================================================
+//
+//    Serialization (freeze and thaw)
+//
+// ============================================================================
+//   A frozen tree starts with a header made of the TREE_SERIAL_MAGIC bytes,
+//   the format version and the size of the data that follows, as varints.
+//   In the data, integers are varints, 7 bits per byte, low bits first,
+//   and signed ones are zigzag-encoded. Reals are their bytes in memory.
+//
+//   A reference to a tree is 0 for NULL, 1 for a new tree that follows,
+//   and N+2 for the Nth tree already written, so that shared subtrees
+//   are written only once. A new tree is its class, the difference
+//   between its position and the previous one, then the data written
+//   by the TREE_FREEZE command of its handler.
+//   Classes and strings are 0 followed by the name or the bytes the first
+//   time they are seen, and N+1 for the Nth one already seen after that.
+//
+//   The default handler does not write or read children recursively,
+//   but pushes them on a stack that the loop in tree_freeze_child or
+//   tree_thaw_child processes after the tree, so that trees are written
+//   in depth-first order without using the C stack for long lists.
+
+#define TREE_SERIAL_MAGIC       "XLFZ"
+#define TREE_SERIAL_VERSION     2
+
+RECORDER(serial_warning, 16, "Freezing and thawing trees");
+
+
+typedef struct tree_serial_entry
 // ----------------------------------------------------------------------------
-//   The default type handler for base trees
+//   A tree or string already written, in the hash tables used by freeze
 // ----------------------------------------------------------------------------
 {
-    tree_p          copy;
-    size_t          size;
-    renderer_p      renderer;
-    char            buffer[32];
-
-    switch(cmd)
-    {
-    case TREE_EVALUATE:
-        // Default evaluation for trees is to return the tree itself
-        return tree;
+    uintptr_t           key;            // Tree or string offset, 0 if free
+    size_t              size;           // Size of a string
+    size_t              index;          // Index in order of appearance
+} tree_serial_entry_t;
 
-    case TREE_TYPENAME:
-        // Return a default tree type name
-        return (tree_p) "tree";
+// Hash function for the entries in a table
+typedef size_t (*tree_serial_hash_fn)(tree_serial_p, tree_serial_entry_t *);
 
-    case TREE_SIZE:
-        // Return the size of the tree in bytes (may be dynamic for subtypes)
-        return (tree_p) sizeof(tree_t);
 
-    case TREE_ARITY:
-        // Return the arity of the tree (number of children, 0 for leaves)
-        return (tree_p) 0;
+typedef struct tree_serial_string
+// ----------------------------------------------------------------------------
+//   A string already read, pointing into the input buffer
+// ----------------------------------------------------------------------------
+{
+    size_t              offset;
+    size_t              size;
+} tree_serial_string_t;
 
-    case TREE_CHILDREN:
-        // Return the pointer to children for that tree type
-        return NULL;            // None if arity 0
 
-    case TREE_CAST:
-        // Return the tree if we cast to tree
-        if (tree_cast_handler(va) == tree_handler)
-            return tree;
-        return NULL;            // Casting to some other type we did not reach
+typedef struct tree_serial_item
+// ----------------------------------------------------------------------------
+//   A child left for later, or a thawed tree that is complete once popped
+// ----------------------------------------------------------------------------
+//   A tree that is being thawed is not in the table of trees until all
+//   its children are read, so that invalid input cannot create cycles.
+{
+    tree_p *            child;          // Child to write or read, or NULL
+    tree_p              tree;           // Otherwise, tree that is complete
+    size_t              index;          // and its index in the table
+} tree_serial_item_t;
+
+
+typedef struct tree_serial
+// ----------------------------------------------------------------------------
+//   State shared by all trees frozen or thawed together
+// ----------------------------------------------------------------------------
+{
+    char *              buffer;         // Data written or read
+    size_t              size;           // Bytes written or available
+    size_t              offset;         // Bytes allocated or read
+    srcpos_t            position;       // Position of the previous tree
+
+    // Classes, in order of appearance
+    tree_class_p *      classes;
+    size_t              class_count;
+
+    // Trees, in order of appearance, and hash table to find them (freeze)
+    tree_p *            trees;
+    tree_serial_entry_t *tree_table;
+    size_t              tree_count;
+    size_t              tree_table_size;
+
+    // Strings, in order of appearance, and hash table to find them (freeze)
+    tree_serial_string_t *strings;
+    tree_serial_entry_t *string_table;
+    size_t              string_count;
+    size_t              string_table_size;
+
+    // Children that the default handler leaves for later, see above
+    tree_serial_item_t *stack;
+    size_t              stack_count;
+    size_t              stack_size;
+} tree_serial_t;
+
+
+static size_t tree_serial_hash(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash for the strings table
+// ----------------------------------------------------------------------------
+{
+    size_t hash = 2166136261u;
+    while (size--)
+        hash = (hash ^ (unsigned char) *data++) * 16777619u;
+    return hash;
+}
+
+
+static void tree_serial_grow(tree_serial_entry_t **table, size_t *size,
+                             size_t count, tree_serial_hash_fn hash,
+                             tree_serial_p serial)
+// ----------------------------------------------------------------------------
+//   Make sure a hash table is at most half full, rehashing it if needed
+// ----------------------------------------------------------------------------
+{
+    if (2 * (count + 1) <= *size)
+        return;
+
+    tree_serial_entry_t *old = *table;
+    size_t old_size = *size;
+    size_t new_size = old_size ? 2 * old_size : 64;
+    size_t mask = new_size - 1;
+    tree_serial_entry_t *entries = calloc(new_size, sizeof(*entries));
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (!old[i].key)
+            continue;
+        size_t index = hash(serial, &old[i]) & mask;
+        while (entries[index].key)
+            index = (index + 1) & mask;
+        entries[index] = old[i];
+    }
+    free(old);
+    *table = entries;
+    *size = new_size;
+}
+
+
+static size_t tree_serial_tree_hash(tree_serial_p serial,
+                                    tree_serial_entry_t *entry)
+// ----------------------------------------------------------------------------
+//   Hash a tree pointer
+// ----------------------------------------------------------------------------
+{
+    (void) serial;
+    return (entry->key >> 4) ^ (entry->key >> 12);
+}
+
+
+static size_t tree_serial_string_hash(tree_serial_p serial,
+                                      tree_serial_entry_t *entry)
+// ----------------------------------------------------------------------------
+//   Hash a string already written, the key is its offset in the buffer
+// ----------------------------------------------------------------------------
+{
+    return tree_serial_hash(entry->size, serial->buffer + entry->key);
+}
+
+
+static void tree_serial_delete(tree_serial_p serial)
+// ----------------------------------------------------------------------------
+//   Release the memory used while freezing or thawing
+// ----------------------------------------------------------------------------
+{
+    free(serial->buffer);
+    free(serial->classes);
+    free(serial->trees);
+    free(serial->tree_table);
+    free(serial->strings);
+    free(serial->string_table);
+    free(serial->stack);
+}
+
+
+static tree_serial_item_t *tree_serial_push(tree_serial_p serial,
+                                            tree_p *child)
+// ----------------------------------------------------------------------------
+//   Push a child to be written or read after the current tree
+// ----------------------------------------------------------------------------
+{
+    if (serial->stack_count == serial->stack_size)
+    {
+        serial->stack_size = serial->stack_size ? 2*serial->stack_size : 64;
+        serial->stack = realloc(serial->stack,
+                                serial->stack_size *
+                                sizeof(tree_serial_item_t));
+    }
+    tree_serial_item_t *item = &serial->stack[serial->stack_count++];
+    item->child = child;
+    item->tree = NULL;
+    item->index = 0;
+    return item;
+}
+
+
+static bool tree_serial_write(tree_serial_p serial, size_t size,
+                              const void *data)
+// ----------------------------------------------------------------------------
+//   Append data to the output buffer
+// ----------------------------------------------------------------------------
+{
+    if (serial->size + size > serial->offset)
+    {
+        size_t allocated = serial->offset ? serial->offset : 4096;
+        while (allocated < serial->size + size)
+            allocated *= 2;
+        char *buffer = realloc(serial->buffer, allocated);
+        if (!buffer)
+            return false;
+        serial->buffer = buffer;
+        serial->offset = allocated;
+    }
+    memcpy(serial->buffer + serial->size, data, size);
+    serial->size += size;
+    return true;
+}
+
+
+static const char *tree_serial_read(tree_serial_p serial, size_t size)
+// ----------------------------------------------------------------------------
+//   Return a pointer to the next bytes of input, or NULL if past the end
+// ----------------------------------------------------------------------------
+{
+    if (size > serial->size - serial->offset)
+    {
+        record(serial_warning, "Reading %zu bytes at offset %zu past end %zu",
+               size, serial->offset, serial->size);
+        return NULL;
+    }
+    const char *result = serial->buffer + serial->offset;
+    serial->offset += size;
+    return result;
+}
+
+
+static size_t tree_varint_encode(uintmax_t value, unsigned char *buffer)
+// ----------------------------------------------------------------------------
+//   Encode a varint into the buffer, return the number of bytes
+// ----------------------------------------------------------------------------
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        buffer[size++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = (unsigned char) value;
+    return size;
+}
+
+
+bool tree_freeze_unsigned(tree_serial_p serial, uintmax_t value)
+// ----------------------------------------------------------------------------
+//   Write an unsigned value as a varint
+// ----------------------------------------------------------------------------
+{
+    unsigned char buffer[(sizeof(uintmax_t) * 8 + 6) / 7];
+    size_t size = tree_varint_encode(value, buffer);
+    return tree_serial_write(serial, size, buffer);
+}
+
+
+bool tree_thaw_unsigned(tree_serial_p serial, uintmax_t *value)
+// ----------------------------------------------------------------------------
+//   Read an unsigned varint
+// ----------------------------------------------------------------------------
+{
+    uintmax_t result = 0;
+    for (unsigned shift = 0; shift < sizeof(uintmax_t) * 8; shift += 7)
+    {
+        const unsigned char *byte =
+            (const unsigned char *) tree_serial_read(serial, 1);
+        if (!byte)
+            return false;
+        result |= (uintmax_t) (*byte & 0x7F) << shift;
+        if (!(*byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    record(serial_warning, "Varint too long at offset %zu", serial->offset);
+    return false;
+}
+
+
+bool tree_freeze_signed(tree_serial_p serial, intmax_t value)
+// ----------------------------------------------------------------------------
+//   Write a signed value as a zigzag-encoded varint
+// ----------------------------------------------------------------------------
+//   0, -1, 1, -2, 2... are written as 0, 1, 2, 3, 4..., so that small
+//   negative values take as few bytes as small positive ones.
+{
+    uintmax_t bits = (uintmax_t) value << 1;
+    return tree_freeze_unsigned(serial, value < 0 ? ~bits : bits);
+}
+
+
+bool tree_thaw_signed(tree_serial_p serial, intmax_t *value)
+// ----------------------------------------------------------------------------
+//   Read a signed value written by tree_freeze_signed
+// ----------------------------------------------------------------------------
+{
+    uintmax_t bits;
+    if (!tree_thaw_unsigned(serial, &bits))
+        return false;
+    *value = (intmax_t) (bits & 1 ? ~(bits >> 1) : bits >> 1);
+    return true;
+}
+
+
+bool tree_freeze_bytes(tree_serial_p serial, size_t size, const void *value)
+// ----------------------------------------------------------------------------
+//   Write the bytes of a value as they are in memory
+// ----------------------------------------------------------------------------
+//   This is for reals, where the exponent is in the high bits, so that
+//   a varint would take more bytes than the value itself.
+{
+    return tree_serial_write(serial, size, value);
+}
+
+
+bool tree_thaw_bytes(tree_serial_p serial, size_t size, void *value)
+// ----------------------------------------------------------------------------
+//   Read a value written by tree_freeze_bytes
+// ----------------------------------------------------------------------------
+{
+    const char *data = tree_serial_read(serial, size);
+    if (!data)
+        return false;
+    memcpy(value, data, size);
+    return true;
+}
+
+
+bool tree_freeze_value(tree_serial_p serial, size_t size, const void *value)
+// ----------------------------------------------------------------------------
+//   Write the bits of a value, as a varint when it fits in one
+// ----------------------------------------------------------------------------
+{
+    switch(size)
+    {
+    case 1:     return tree_freeze_unsigned(serial, *(uint8_t *) value);
+    case 2:     return tree_freeze_unsigned(serial, *(uint16_t *) value);
+    case 4:     return tree_freeze_unsigned(serial, *(uint32_t *) value);
+    case 8:     return tree_freeze_unsigned(serial, *(uint64_t *) value);
+    default:    return tree_serial_write(serial, size, value);
+    }
+}
+
+
+bool tree_thaw_value(tree_serial_p serial, size_t size, void *value)
+// ----------------------------------------------------------------------------
+//   Read a value written by tree_freeze_value
+// ----------------------------------------------------------------------------
+{
+    uintmax_t bits;
+    const char *data;
+
+    switch(size)
+    {
+    case 1: case 2: case 4: case 8:
+        if (!tree_thaw_unsigned(serial, &bits))
+            return false;
+        if (size < sizeof(bits) && bits >> (8 * size))
+        {
+            record(serial_warning, "Value %ju does not fit in %zu bytes",
+                   bits, size);
+            return false;
+        }
+        if (size == 1)
+            *(uint8_t *) value = bits;
+        else if (size == 2)
+            *(uint16_t *) value = bits;
+        else if (size == 4)
+            *(uint32_t *) value = bits;
+        else
+            *(uint64_t *) value = bits;
+        return true;
+
+    default:
+        data = tree_serial_read(serial, size);
+        if (!data)
+            return false;
+        memcpy(value, data, size);
+        return true;
+    }
+}
+
+
+bool tree_freeze_string(tree_serial_p serial, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Write a string, or its index if the same bytes were already written
+// ----------------------------------------------------------------------------
+{
+    tree_serial_grow(&serial->string_table, &serial->string_table_size,
+                     serial->string_count, tree_serial_string_hash, serial);
+
+    size_t mask = serial->string_table_size - 1;
+    size_t index = tree_serial_hash(size, data) & mask;
+    tree_serial_entry_t *entry;
+    while ((entry = &serial->string_table[index])->key)
+    {
+        if (entry->size == size &&
+            memcmp(serial->buffer + entry->key, data, size) == 0)
+            return tree_freeze_unsigned(serial, entry->index + 1);
+        index = (index + 1) & mask;
+    }
+
+    if (!tree_freeze_unsigned(serial, 0) ||
+        !tree_freeze_unsigned(serial, size))
+        return false;
+
+    // The key is the offset in the buffer, which moves as it grows.
+    // It is never 0, since the marker and the size come before.
+    entry->key = serial->size;
+    entry->size = size;
+    entry->index = serial->string_count++;
+    return tree_serial_write(serial, size, data);
+}
+
+
+const char *tree_thaw_string(tree_serial_p serial, size_t *size)
+// ----------------------------------------------------------------------------
+//   Read a string, return a pointer to its bytes in the input buffer
+// ----------------------------------------------------------------------------
+{
+    uintmax_t index, length;
+    if (!tree_thaw_unsigned(serial, &index))
+        return NULL;
+    if (index)
+    {
+        if (index > serial->string_count)
+        {
+            record(serial_warning, "Invalid string index %ju, only %zu strings",
+                   index, serial->string_count);
+            return NULL;
+        }
+        tree_serial_string_t *string = &serial->strings[index - 1];
+        *size = string->size;
+        return serial->buffer + string->offset;
+    }
+
+    if (!tree_thaw_unsigned(serial, &length))
+        return NULL;
+    size_t offset = serial->offset;
+    const char *data = tree_serial_read(serial, length);
+    if (!data)
+        return NULL;
+
+    size_t count = serial->string_count++;
+    if ((count & (count - 1)) == 0)
+        serial->strings = realloc(serial->strings,
+                                  (count ? 2 * count : 1) *
+                                  sizeof(tree_serial_string_t));
+    serial->strings[count].offset = offset;
+    serial->strings[count].size = length;
+    *size = length;
+    return data;
+}
+
+
+static bool tree_freeze_class(tree_serial_p serial, tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Write the index of a class, or its name the first time we see it
+// ----------------------------------------------------------------------------
+{
+    for (size_t i = 0; i < serial->class_count; i++)
+        if (serial->classes[i] == class)
+            return tree_freeze_unsigned(serial, i + 1);
+
+    size_t count = serial->class_count++;
+    if ((count & (count - 1)) == 0)
+        serial->classes = realloc(serial->classes,
+                                  (count ? 2 * count : 1) *
+                                  sizeof(tree_class_p));
+    serial->classes[count] = class;
+    return tree_freeze_unsigned(serial, 0)
+        && tree_freeze_string(serial, strlen(class->name), class->name);
+}
+
+
+static tree_class_p tree_thaw_class(tree_serial_p serial)
+// ----------------------------------------------------------------------------
+//   Read a class index or a class name
+// ----------------------------------------------------------------------------
+{
+    uintmax_t index;
+    if (!tree_thaw_unsigned(serial, &index))
+        return NULL;
+    if (index)
+    {
+        if (index > serial->class_count)
+        {
+            record(serial_warning, "Invalid class index %ju, only %zu classes",
+                   index, serial->class_count);
+            return NULL;
+        }
+        return serial->classes[index - 1];
+    }
+
+    size_t size;
+    const char *data = tree_thaw_string(serial, &size);
+    if (!data)
+        return NULL;
+    tree_class_p class = tree_class_find(size, data);
+    if (!class)
+    {
+        record(serial_warning, "Unknown class %.*s", (int) size, data);
+        return NULL;
+    }
+
+    size_t count = serial->class_count++;
+    if ((count & (count - 1)) == 0)
+        serial->classes = realloc(serial->classes,
+                                  (count ? 2 * count : 1) *
+                                  sizeof(tree_class_p));
+    serial->classes[count] = class;
+    return class;
+}
+
+
+static bool tree_freeze_one(tree_serial_p serial, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Write a reference to a tree, and the tree itself if not written yet
+// ----------------------------------------------------------------------------
+{
+    if (!tree)
+        return tree_freeze_unsigned(serial, 0);
+
+    tree_serial_grow(&serial->tree_table, &serial->tree_table_size,
+                     serial->tree_count, tree_serial_tree_hash, serial);
+    tree_serial_entry_t probe = { .key = (uintptr_t) tree };
+    size_t mask = serial->tree_table_size - 1;
+    size_t index = tree_serial_tree_hash(serial, &probe) & mask;
+    tree_serial_entry_t *entry;
+    while ((entry = &serial->tree_table[index])->key)
+    {
+        if (entry->key == probe.key)
+            return tree_freeze_unsigned(serial, entry->index + 2);
+        index = (index + 1) & mask;
+    }
+    probe.index = serial->tree_count++;
+    *entry = probe;
+
+    // Positions are mostly increasing, so write the signed delta
+    srcpos_t position = tree_position(tree);
+    intmax_t delta = (intmax_t) position - (intmax_t) serial->position;
+    serial->position = position;
+    if (!tree_freeze_unsigned(serial, 1) ||
+        !tree_freeze_class(serial, tree_class_of(tree)) ||
+        !tree_freeze_signed(serial, delta) ||
+        tree_io(TREE_FREEZE, tree, serial) != tree)
+    {
+        record(serial_warning, "Could not freeze %s %p",
+               tree_typename(tree), tree);
+        return false;
+    }
+    return true;
+}
+
+
+bool tree_freeze_child(tree_serial_p serial, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Write a tree, then the children that handlers pushed for later
+// ----------------------------------------------------------------------------
+{
+    size_t base = serial->stack_count;
+    bool   ok   = tree_freeze_one(serial, tree);
+    while (ok && serial->stack_count > base)
+    {
+        tree_serial_item_t *item = &serial->stack[--serial->stack_count];
+        ok = tree_freeze_one(serial, *item->child);
+    }
+    serial->stack_count = base;
+    return ok;
+}
+
+
+static tree_p tree_thaw_class_tree(tree_class_p class, ...)
+// ----------------------------------------------------------------------------
+//   Pass the TREE_THAW arguments to the handler of the class
+// ----------------------------------------------------------------------------
+{
+    va_list va;
+    va_start(va, class);
+    tree_p tree = class->handler(TREE_THAW, NULL, va);
+    va_end(va);
+    return tree;
+}
+
+
+static bool tree_thaw_one(tree_serial_p serial, tree_p *child)
+// ----------------------------------------------------------------------------
+//   Read a reference to a tree, and store it with a reference in *child
+// ----------------------------------------------------------------------------
+{
+    uintmax_t index;
+    if (!tree_thaw_unsigned(serial, &index))
+        return false;
+    if (index != 1)
+    {
+        // A tree that is still being read cannot be referenced
+        if (index > serial->tree_count + 1 ||
+            (index && !serial->trees[index - 2]))
+        {
+            record(serial_warning, "Invalid tree index %ju, only %zu trees",
+                   index, serial->tree_count);
+            return false;
+        }
+        *child = index ? tree_use(serial->trees[index - 2]) : NULL;
+        return true;
+    }
+
+    size_t count = serial->tree_count++;
+    if ((count & (count - 1)) == 0)
+        serial->trees = realloc(serial->trees,
+                                (count ? 2 * count : 1) * sizeof(tree_p));
+    serial->trees[count] = NULL;
+
+    intmax_t delta;
+    tree_class_p class = tree_thaw_class(serial);
+    if (!class || !tree_thaw_signed(serial, &delta))
+        return false;
+    serial->position += delta;
+    tree_class_register(class);
+
+    // The handler pushes children above the item that completes the tree
+    size_t complete = serial->stack_count;
+    tree_serial_push(serial, NULL)->index = count;
+    tree_p tree = tree_thaw_class_tree(class, serial, class, serial->position);
+    if (!tree)
+    {
+        record(serial_warning, "Could not thaw %s", class->name);
+        return false;
+    }
+    serial->stack[complete].tree = tree;
+    *child = tree_use(tree);
+    return true;
+}
+
+
+bool tree_thaw_child(tree_serial_p serial, tree_p *child)
+// ----------------------------------------------------------------------------
+//   Read a tree, then the children that handlers pushed for later
+// ----------------------------------------------------------------------------
+//   If this fails, *child may hold a partially thawed tree to dispose of.
+{
+    size_t base = serial->stack_count;
+    bool   ok   = tree_thaw_one(serial, child);
+    while (ok && serial->stack_count > base)
+    {
+        tree_serial_item_t *item = &serial->stack[--serial->stack_count];
+        if (item->child)
+            ok = tree_thaw_one(serial, item->child);
+        else
+            serial->trees[item->index] = item->tree;
+    }
+    serial->stack_count = base;
+    return ok;
+}
+
+
+bool tree_freeze(tree_p tree, tree_io_fn output, void *stream)
+// ----------------------------------------------------------------------------
+//   Freeze (serialize) the tree and return true if successful
+// ----------------------------------------------------------------------------
+{
+    return tree_freeze_relative(tree, 0, output, stream);
+}
+
+
+bool tree_freeze_relative(tree_p tree, srcpos_t base,
+                          tree_io_fn output, void *stream)
+// ----------------------------------------------------------------------------
+//   Freeze the tree with positions relative to base, e.g. start of a file
+// ----------------------------------------------------------------------------
+{
+    tree_serial_t serial = { 0 };
+    serial.position = base;
+    bool ok = tree_freeze_child(&serial, tree);
+    if (ok)
+    {
+        unsigned char header[32];
+        size_t size = sizeof(TREE_SERIAL_MAGIC) - 1;
+        memcpy(header, TREE_SERIAL_MAGIC, size);
+        size += tree_varint_encode(TREE_SERIAL_VERSION, header + size);
+        size += tree_varint_encode(serial.size, header + size);
+        ok = output(stream, size, header) == size
+            && output(stream, serial.size, serial.buffer) == serial.size;
+    }
+    tree_serial_delete(&serial);
+    return ok;
+}
+
+
+static bool tree_thaw_header(tree_io_fn input, void *stream, uintmax_t *value)
+// ----------------------------------------------------------------------------
+//   Read a varint in the header one byte at a time, not to read too far
+// ----------------------------------------------------------------------------
+{
+    uintmax_t result = 0;
+    unsigned char byte = 0x80;
+    for (unsigned shift = 0; byte & 0x80; shift += 7)
+    {
+        if (shift >= sizeof(uintmax_t) * 8 || input(stream, 1, &byte) != 1)
+            return false;
+        result |= (uintmax_t) (byte & 0x7F) << shift;
+    }
+    *value = result;
+    return true;
+}
+
+
+tree_p tree_thaw(tree_io_fn input, void *stream)
+// ----------------------------------------------------------------------------
+//   Thaw (deserialize) the tree from the given input, NULL on error
+// ----------------------------------------------------------------------------
+//   Classes are found by name among registered classes, i.e. the classes
+//   of trees that were already created or given to tree_class_register.
+//   The input is read exactly up to the end of the frozen tree.
+{
+    return tree_thaw_relative(0, input, stream);
+}
+
+
+tree_p tree_thaw_relative(srcpos_t base, tree_io_fn input, void *stream)
+// ----------------------------------------------------------------------------
+//   Thaw a tree frozen with tree_freeze_relative, adding base to positions
+// ----------------------------------------------------------------------------
+{
+    char magic[sizeof(TREE_SERIAL_MAGIC) - 1];
+    uintmax_t version, size;
+    if (input(stream, sizeof(magic), magic) != sizeof(magic) ||
+        memcmp(magic, TREE_SERIAL_MAGIC, sizeof(magic)) != 0 ||
+        !tree_thaw_header(input, stream, &version) ||
+        !tree_thaw_header(input, stream, &size))
+    {
+        record(serial_warning, "Invalid header for frozen tree");
+        return NULL;
+    }
+    if (version != TREE_SERIAL_VERSION)
+    {
+        record(serial_warning, "Frozen tree has version %ju, expected %u",
+               version, TREE_SERIAL_VERSION);
+        return NULL;
+    }
+
+    tree_serial_t serial = { 0 };
+    serial.position = base;
+    serial.buffer = malloc(size);
+    while (serial.buffer && serial.size < size)
+    {
+        unsigned rs = input(stream, size - serial.size,
+                            serial.buffer + serial.size);
+        if (!rs)
+            break;
+        serial.size += rs;
+    }
+
+    tree_p tree = NULL;
+    if (serial.size == size && tree_thaw_child(&serial, &tree))
+    {
+        if (tree)
+            tree_unref(tree);
+    }
+    else
+    {
+        record(serial_warning, "Could not thaw %zu bytes of %ju",
+               serial.size, size);
+        tree_dispose(&tree);
+    }
+    tree_serial_delete(&serial);
+    return tree;
+}
+
+
+tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
+// ----------------------------------------------------------------------------
+//   The default type handler for base trees
+// ----------------------------------------------------------------------------
+{
+    tree_p          copy;
+    size_t          size;
+    renderer_p      renderer;
+    char            buffer[64];
+    tree_serial_p   serial;
+    tree_class_p    class;
+    uintmax_t       length;
+    size_t          arity;
+    tree_p *        children;
+    const char *    data;
+
+    switch(cmd)
+    {
+    case TREE_EVALUATE:
+        // Default evaluation for trees is to return the tree itself
+        return tree;
 
     case TREE_INITIALIZE:
         // Default initialization for trees
@@ -399,8 +1740,7 @@ tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         copy = (tree_p) tree_malloc(size);
         if (copy)
         {
-            memcpy(copy, tree, size);
-            copy->refcount = 0;
+            tree_copy_memory(copy, tree, size);
             if (cmd == TREE_COPY)
                 tree_children_loop(copy, tree_ref(*child));
             else
@@ -409,20 +1749,71 @@ tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         return copy;
 
     case TREE_RENDER:
-        // Default rendering simply shows the tree address and handler address
+        // Default rendering simply shows the tree type name and address
         renderer = va_arg(va, renderer_p);
         size = snprintf(buffer, sizeof(buffer),
-                        "<%s:%p:%p>",
-                        tree_typename(tree), tree,tree->handler);
+                        "<%s:%p>", tree_typename(tree), tree);
         render_text(renderer, size, buffer);
         return tree;
 
     case TREE_FREEZE:
-        assert(!"Not yet implemented");
+        // Default is to write the variable-sized part and the children.
+        // Types with other data, e.g. numbers, must write it themselves
+        serial = va_arg(va, tree_serial_p);
+        class = tree_class_of(tree);
+        length = tree_variable_length(tree);
+        if (class->item_size && !class->item_arity)
+        {
+            // Variable-sized data, e.g. for a blob, goes in the strings
+            if (!tree_freeze_string(serial, length * class->item_size,
+                                    (char *) tree + class->size))
+                return NULL;
+        }
+        else if (class->length && !tree_freeze_unsigned(serial, length))
+        {
+            return NULL;
+        }
+        // Children are pushed in reverse order to be written in order
+        arity = tree_arity(tree);
+        children = tree_children(tree);
+        while (arity--)
+            tree_serial_push(serial, &children[arity]);
         return tree;
+
     case TREE_THAW:
-        assert(!"Not yet implemented");
-        return tree;
+        // Read what the default TREE_FREEZE wrote, see above
+        serial = va_arg(va, tree_serial_p);
+        class = va_arg(va, tree_class_p);
+        length = 0;
+        data = NULL;
+        if (class->item_size && !class->item_arity)
+        {
+            data = tree_thaw_string(serial, &size);
+            if (!data || size % class->item_size)
+                return NULL;
+            length = size / class->item_size;
+        }
+        else if (class->length)
+        {
+            // Each item takes at least one byte of input
+            if (!tree_thaw_unsigned(serial, &length) ||
+                length > serial->size - serial->offset)
+                return NULL;
+        }
+
+        size = class->size + length * class->item_size;
+        copy = (tree_p) tree_malloc(size);
+        tree_set_class(copy, class);
+        tree_set_position(copy, va_arg(va, srcpos_t));
+        if (class->length)
+            *(size_t *) ((char *) copy + class->length) = length;
+        if (data)
+            memcpy((char *) copy + class->size, data, size - class->size);
+        arity = tree_arity(copy);
+        children = tree_children(copy);
+        while (arity--)
+            tree_serial_push(serial, &children[arity]);
+        return copy;
 
     default:
         assert("Command not implemented");
@@ -432,6 +1823,30 @@ tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
+tree_class_t tree_class =
+// ----------------------------------------------------------------------------
+//   Descriptor for the base tree type
+// ----------------------------------------------------------------------------
+{
+    .name       = "tree",
+    .handler    = tree_handler,
+    .parent     = NULL,
+    .size       = sizeof(tree_t),
+};
+
+
+tree_class_p const tree_immediate_classes[4] =
+// ----------------------------------------------------------------------------
+//   Classes of immediate trees, indexed by bits 1 and 2 of the tag
+// ----------------------------------------------------------------------------
+{
+    &natural_class,                     // TREE_IMMEDIATE_NATURAL
+    &integer_class,                     // TREE_IMMEDIATE_INTEGER
+    &text_class,                        // TREE_IMMEDIATE_TEXT
+    &name_class,                        // TREE_IMMEDIATE_NAME
+};
+
+
 const char *tree_cmd_name(tree_cmd_t cmd)
 // ----------------------------------------------------------------------------
 //   Return the name associated with a tree cmd
@@ -440,11 +1855,6 @@ const char *tree_cmd_name(tree_cmd_t cmd)
     static const char *names[] =
     {
         "TREE_EVALUATE",
-        "TREE_TYPENAME",
-        "TREE_SIZE",
-        "TREE_ARITY",
-        "TREE_CHILDREN",
-        "TREE_CAST",
         "TREE_INITIALIZE",
         "TREE_DELETE",
         "TREE_COPY",
@@ -27,6 +27,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 
@@ -49,6 +50,7 @@ typedef struct postfix  *postfix_p;
 typedef struct infix    *infix_p;
 typedef struct array    *array_p;
 typedef struct renderer *renderer_p;
+typedef struct arena    *arena_p;
 
 // Macros to indicate source position
 #define SOURCE__(L)         #L
@@ -67,20 +69,20 @@ typedef enum tree_cmd
 // ----------------------------------------------------------------------------
 //   Commands that all info handlers must accept
 // ----------------------------------------------------------------------------
+//   Static properties of a tree, like its type name, size, arity or
+//   children, are read directly from the tree_class_t descriptor below.
+//   TREE_FREEZE takes a tree_serial_p and returns the tree if successful.
+//   TREE_THAW is sent with a NULL tree, takes a tree_serial_p, the class
+//   and the position of the tree, and returns the new tree or NULL.
 {
     TREE_EVALUATE,                      // Evaluate the tree
-    TREE_TYPENAME,                      // Return a unique type name for tree
-    TREE_SIZE,                          // Return the size for the tree
-    TREE_ARITY,                         // Return the arity for the tree
-    TREE_CHILDREN,                      // Return pointer to children of tree
-    TREE_CAST,                          // Check class of pointer
     TREE_INITIALIZE,                    // Initialized the tree (from tree_new)
     TREE_DELETE,                        // Delete the tree and its children
     TREE_COPY,                          // Shallow copy of the tree
     TREE_CLONE,                         // Deep copy of the tree
     TREE_RENDER,                        // Render tree in text form
-    TREE_FREEZE,                        // Serialize tree
-    TREE_THAW,                          // De-serialize tree
+    TREE_FREEZE,                        // Serialize tree (see tree_freeze)
+    TREE_THAW,                          // De-serialize tree (see tree_thaw)
 } tree_cmd_t;
 extern const char *tree_cmd_name(tree_cmd_t);
 
@@ -90,23 +92,139 @@ typedef tree_p (*tree_handler_fn)(tree_cmd_t cmd, tree_p tree, va_list va);
 // Input and output functions, returns amount of data read or written
 typedef unsigned (*tree_io_fn)(void *stream, unsigned sz, void *data);
 
+// State while freezing or thawing trees, passed to TREE_FREEZE / TREE_THAW
+typedef struct tree_serial *tree_serial_p;
+
 // Position indicator in files
 typedef uintptr_t srcpos_t;
 
+// Compact layout for trees, see tree_t below
+#ifndef TREE_COMPACT
+#define TREE_COMPACT            0
+#endif // TREE_COMPACT
+
 // Reference counting
-typedef uintptr_t refcnt_t;
+typedef uint32_t refcnt_t;
+
+// Flags in trees, telling how they were allocated
+#define TREE_ARENA              1       // Allocated in an arena, see arena.h
+#define TREE_INTERNED           2       // Unique name, see name_intern
+
+
+// Maximum depth of class hierarchy for constant-time casts
+#define TREE_CLASS_DISPLAY      8
+
+typedef struct tree_class
+// ----------------------------------------------------------------------------
+//   Static description of a tree type, shared by all trees of that type
+// ----------------------------------------------------------------------------
+//   Trees may have a variable-sized part, e.g. blobs or arrays.
+//   In that case, 'length' is the offset of the length field in the tree,
+//   and each of the 'length' items adds 'item_size' bytes to the size
+//   and 'item_arity' children to the arity of the tree.
+//
+//   The display lists the ancestors of the class, starting with tree_class
+//   at index 0 and ending with the class itself at index 'depth'. It is
+//   computed when the class is registered, and makes a cast to a class
+//   a single comparison: display[target->depth] == target.
+//
+//   Trees in an arena may be released with the arena without receiving
+//   TREE_DELETE, unless their class sets custom_delete.
+{
+    const char *        name;         // Type name, e.g. "infix"
+    tree_handler_fn     handler;      // Handler for extensible commands
+    struct tree_class * parent;       // Base type, NULL for tree
+    size_t              size;         // Size of the fixed part in bytes
+    size_t              arity;        // Number of children in fixed part
+    size_t              children;     // Offset of first child, if any
+    size_t              length;       // Offset of length field, 0 if none
+    size_t              item_size;    // Size of each variable-sized item
+    size_t              item_arity;   // Children in each variable-sized item
+    unsigned            depth;        // Depth in the class hierarchy
+    bool                custom_delete; // TREE_DELETE does more than free
+    struct tree_class * display[TREE_CLASS_DISPLAY]; // Ancestors, see above
+    struct tree_class * next;         // Next registered class
+#if TREE_COMPACT
+    unsigned            id;           // Index in tree_class_table
+#endif // TREE_COMPACT
+} tree_class_t, *tree_class_p;
 
 
 typedef struct tree
 // ----------------------------------------------------------------------------
 //   Base tree structure
 // ----------------------------------------------------------------------------
+//   The compact layout replaces the class with its index among registered
+//   classes, and only keeps 32 bits of position.
+//   Use tree_class_of and tree_set_class rather than the fields.
+//   The flags describe the memory of the tree, and are set by tree_malloc.
+//   Copies do not inherit them.
 {
-    tree_handler_fn     handler;      // Handler function for the tree
+#if TREE_COMPACT
+    uint16_t            class_id;     // Index in tree_class_table
+    uint16_t            flags;        // Allocation flags, e.g. TREE_ARENA
     refcnt_t            refcount;     // Reference count (garbage collection)
+    uint32_t            position;     // Source code position, 0 if too large
+#else
+    tree_class_p        class;        // Type descriptor for the tree
+    refcnt_t            refcount;     // Reference count (garbage collection)
+    uint32_t            flags;        // Allocation flags, e.g. TREE_ARENA
     srcpos_t            position;     // Source code position
+#endif // TREE_COMPACT
 } tree_t, *tree_p;
 
+// Descriptor for the base tree type
+extern tree_class_t tree_class;
+
+#if TREE_COMPACT
+// Registered classes, indexed by the class_id of trees
+#define TREE_CLASS_MAX          (1 << 16)
+#define TREE_POSITION_MAX       ((srcpos_t) UINT32_MAX)
+extern tree_class_p tree_class_table[TREE_CLASS_MAX];
+#else
+#define TREE_POSITION_MAX       ((srcpos_t) UINTPTR_MAX)
+#endif // TREE_COMPACT
+
+
+// Immediate trees: small numbers and short texts encoded in the tree_p itself
+//   Bit 0 is set, which is never the case for the address of a tree.
+//   Bits 1 and 2 select the class, bits 3 to 31 hold the value and
+//   the high 32 bits hold the position. This requires 64-bit pointers.
+//   Texts and names keep their length in bits 3 and 4, and their bytes
+//   in bits 8 to 31.
+#ifndef TREE_IMMEDIATES
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define TREE_IMMEDIATES         1
+#else
+#define TREE_IMMEDIATES         0
+#endif
+#endif // TREE_IMMEDIATES
+
+#define TREE_IMMEDIATE_NONE     0       // Type has no immediate form
+#define TREE_IMMEDIATE_NATURAL  1       // Tag for natural immediates
+#define TREE_IMMEDIATE_INTEGER  3       // Tag for integer immediates
+#define TREE_IMMEDIATE_TEXT     5       // Tag for text immediates
+#define TREE_IMMEDIATE_NAME     7       // Tag for name immediates
+#define TREE_IMMEDIATE_BITS     29      // Bits available for the value
+#define TREE_IMMEDIATE_LENGTH   3       // Bytes available for a text
+
+// Classes of immediate trees, indexed by bits 1 and 2 of the tag
+extern tree_class_p const tree_immediate_classes[4];
+
+typedef struct tree_box
+// ----------------------------------------------------------------------------
+//   Room to expand an immediate tree, laid out like numbers and blob_t
+// ----------------------------------------------------------------------------
+{
+    tree_t              tree;
+    union
+    {
+        long long       value;          // Value of a number
+        size_t          length;         // Length of a text or name
+    };
+    char                data[TREE_IMMEDIATE_LENGTH];
+} tree_box_t;
+
 #ifdef TREE_C
 #define inline extern inline
 #endif // TREE_C
@@ -132,24 +250,57 @@ inline tree_p      tree_clone(tree_p tree);
 extern text_p      tree_text(tree_p tree);
 extern void        tree_print(FILE *stream, tree_p tree);
 extern void        tree_render(tree_p tree, renderer_p renderer);
-inline bool        tree_freeze(tree_p tree, tree_io_fn output, void *stream);
-inline tree_p      tree_thaw(tree_io_fn input, void *stream);
+extern bool        tree_freeze(tree_p tree, tree_io_fn output, void *stream);
+extern tree_p      tree_thaw(tree_io_fn input, void *stream);
+extern bool        tree_freeze_relative(tree_p tree, srcpos_t base,
+                                        tree_io_fn output, void *stream);
+extern tree_p      tree_thaw_relative(srcpos_t base,
+                                      tree_io_fn input, void *stream);
 extern tree_p      tree_io(tree_cmd_t cmd, tree_p tree, ...);
-inline tree_p      tree_cast_(tree_p tree, ...);
+inline tree_p      tree_cast_(tree_p tree, tree_class_p class);
+inline bool        tree_is_immediate(tree_p tree);
+inline tree_class_p tree_class_of(tree_p tree);
+inline void        tree_set_class(tree_p tree, tree_class_p class);
+inline void        tree_set_position(tree_p tree, srcpos_t position);
+inline tree_p      tree_immediate(unsigned tag, srcpos_t pos, intptr_t value);
+inline tree_p      tree_immediate_text(unsigned tag, srcpos_t pos,
+                                       size_t size, const char *data);
+inline intptr_t    tree_immediate_value(tree_p tree);
+inline tree_p      tree_unbox(tree_p tree, tree_box_t *box);
+inline void        tree_copy_memory(tree_p copy, tree_p tree, size_t size);
 
 
 // Internal tree operations - Normally no need to call directly
 extern tree_p   tree_handler(tree_cmd_t cmd, tree_p tree, va_list va);
-extern tree_p   tree_make(tree_handler_fn handler, srcpos_t position, ...);
+extern tree_p   tree_make(tree_class_p class, srcpos_t position, ...);
+extern void     tree_class_register(tree_class_p class);
+extern tree_class_p tree_class_find(size_t size, const char *name);
+extern tree_p   tree_cast_slow(tree_p tree, tree_class_p class);
 extern unsigned tree_memcheck(unsigned tree_count);
+extern void     tree_pool_statistics(void);
+extern void     tree_pool_release(void);
 extern tree_p   tree_malloc_(const char *where, size_t size);
 extern tree_p   tree_realloc_(const char *where, tree_p old, size_t new_size);
 extern void     tree_free_(const char *where, tree_p tree);
-inline tree_handler_fn          tree_cast_handler(va_list va);
+extern arena_p  tree_set_arena(arena_p arena);
+extern bool     tree_arena_delete(tree_p tree);
+extern bool     tree_freeze_unsigned(tree_serial_p, uintmax_t value);
+extern bool     tree_thaw_unsigned(tree_serial_p, uintmax_t *value);
+extern bool     tree_freeze_signed(tree_serial_p, intmax_t value);
+extern bool     tree_thaw_signed(tree_serial_p, intmax_t *value);
+extern bool     tree_freeze_bytes(tree_serial_p, size_t size, const void *);
+extern bool     tree_thaw_bytes(tree_serial_p, size_t size, void *value);
+extern bool     tree_freeze_value(tree_serial_p, size_t size, const void *);
+extern bool     tree_thaw_value(tree_serial_p, size_t size, void *value);
+extern bool     tree_freeze_string(tree_serial_p, size_t size, const char *);
+extern const char *tree_thaw_string(tree_serial_p, size_t *size);
+extern bool     tree_freeze_child(tree_serial_p, tree_p child);
+extern bool     tree_thaw_child(tree_serial_p, tree_p *child);
+inline size_t                   tree_variable_length(tree_p tree);
 #define tree_malloc(sz)         tree_malloc_(SOURCE, (sz))
 #define tree_realloc(old, sz)   tree_realloc_(SOURCE, (old), (sz))
 #define tree_free(t)            tree_free_(SOURCE, (t))
-#define tree_cast(type, tree)   ((type##_p) tree_cast_(tree, type##_handler))
+#define tree_cast(type, tree)   ((type##_p) tree_cast_(tree, &type##_class))
 
 // Macro to loop on tree children
 #define tree_children_loop(tree, body)            \
@@ -184,7 +335,135 @@ inline tree_p tree_new(srcpos_t position)
 //   Create a new tree with the default tree handler
 // ----------------------------------------------------------------------------
 {
-    return tree_make(tree_handler, position);
+    return tree_make(&tree_class, position);
+}
+
+
+inline bool tree_is_immediate(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Check if a tree is an immediate, i.e. not a pointer to a tree
+// ----------------------------------------------------------------------------
+{
+    return TREE_IMMEDIATES && ((uintptr_t) tree & 1);
+}
+
+
+inline tree_class_p tree_class_of(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the class of a tree, including for immediates
+// ----------------------------------------------------------------------------
+{
+    if (tree_is_immediate(tree))
+        return tree_immediate_classes[((uintptr_t) tree >> 1) & 3];
+#if TREE_COMPACT
+    return tree_class_table[tree->class_id];
+#else
+    return tree->class;
+#endif // TREE_COMPACT
+}
+
+
+inline void tree_set_class(tree_p tree, tree_class_p class)
+// ----------------------------------------------------------------------------
+//   Set the class of a tree that is being built
+// ----------------------------------------------------------------------------
+//   In the compact layout, the class must have been registered
+{
+#if TREE_COMPACT
+    assert(tree_class_table[class->id] == class && "Class must be registered");
+    tree->class_id = class->id;
+#else
+    tree->class = class;
+#endif // TREE_COMPACT
+}
+
+
+inline void tree_set_position(tree_p tree, srcpos_t position)
+// ----------------------------------------------------------------------------
+//   Set the position of a tree that is being built
+// ----------------------------------------------------------------------------
+//   Positions that do not fit are replaced with 0, i.e. unknown position
+{
+    tree->position = position <= TREE_POSITION_MAX ? position : 0;
+}
+
+
+inline tree_p tree_immediate(unsigned tag, srcpos_t pos, intptr_t value)
+// ----------------------------------------------------------------------------
+//   Return an immediate tree for the value, or NULL if it does not fit
+// ----------------------------------------------------------------------------
+{
+    const intptr_t limit = (intptr_t) 1 << TREE_IMMEDIATE_BITS;
+    if (!TREE_IMMEDIATES || tag == TREE_IMMEDIATE_NONE || pos > 0xFFFFFFFFu)
+        return NULL;
+    if (tag == TREE_IMMEDIATE_NATURAL
+        ? (uintptr_t) value >= (uintptr_t) limit
+        : value < -limit / 2 || value >= limit / 2)
+        return NULL;
+    uintptr_t bits = ((uintptr_t) value << 3) & 0xFFFFFFFFu;
+    return (tree_p) (((uintptr_t) pos << 16 << 16) | bits | tag);
+}
+
+
+inline tree_p tree_immediate_text(unsigned tag, srcpos_t pos,
+                                  size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Return an immediate text or name, or NULL if it does not fit
+// ----------------------------------------------------------------------------
+{
+    if (!TREE_IMMEDIATES || size > TREE_IMMEDIATE_LENGTH || pos > 0xFFFFFFFFu)
+        return NULL;
+    uintptr_t bits = size << 3 | tag;
+    for (size_t i = 0; i < size; i++)
+        bits |= (uintptr_t) (uint8_t) data[i] << (8 + 8 * i);
+    return (tree_p) (((uintptr_t) pos << 16 << 16) | bits);
+}
+
+
+inline intptr_t tree_immediate_value(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the value of an immediate number
+// ----------------------------------------------------------------------------
+{
+    uint32_t bits = (uint32_t) (uintptr_t) tree;
+    if (bits & 2)
+        return (int32_t) bits >> 3;
+    return bits >> 3;
+}
+
+
+inline tree_p tree_unbox(tree_p tree, tree_box_t *box)
+// ----------------------------------------------------------------------------
+//   Return the tree, or a copy of an immediate in the box to call handlers
+// ----------------------------------------------------------------------------
+//   The box holds a reference, so that handlers never try to delete it.
+{
+    if (!tree_is_immediate(tree))
+        return tree;
+    tree_class_p class = tree_class_of(tree);
+#if TREE_COMPACT
+    tree_class_register(class);         // Immediates are not from tree_make
+#endif // TREE_COMPACT
+    tree_set_class(&box->tree, class);
+    box->tree.refcount = 1;
+    box->tree.flags = 0;
+    tree_set_position(&box->tree, tree_position(tree));
+
+    uint32_t bits = (uint32_t) (uintptr_t) tree;
+    if ((bits & TREE_IMMEDIATE_TEXT) == TREE_IMMEDIATE_TEXT)
+    {
+        // Texts and names: the length is where blob_t has it. Callers read
+        // it as a blob_t, so copy it as bytes, which alias with any type
+        size_t size = (bits >> 3) & 3;
+        memcpy(&box->length, &size, sizeof(size));
+        for (size_t i = 0; i < size; i++)
+            box->data[i] = bits >> (8 + 8 * i);
+    }
+    else
+    {
+        box->value = tree_immediate_value(tree);
+    }
+    return &box->tree;
 }
 
 
@@ -192,14 +471,45 @@ inline void tree_delete(tree_p tree)
 // ----------------------------------------------------------------------------
 //   Delete a tree by calling its handler
 // ----------------------------------------------------------------------------
+//   Immediates are never deleted. Trees in an arena may be deleted with
+//   the whole arena, see tree_arena_delete.
+{
+    if (tree_is_immediate(tree))
+        return;
+    if ((tree->flags & TREE_ARENA) && tree_arena_delete(tree))
+        return;
+    tree_class_of(tree)->handler(TREE_DELETE, tree, NULL);
+}
+
+
+inline void tree_copy_memory(tree_p copy, tree_p tree, size_t size)
+// ----------------------------------------------------------------------------
+//   Copy the memory of a tree to a new tree from tree_malloc, without refs
+// ----------------------------------------------------------------------------
+//   The flags of the new tree describe its own memory, so they are kept.
 {
-    tree->handler(TREE_DELETE, tree, NULL);
+    unsigned flags = copy->flags;
+    memcpy(copy, tree, size);
+    copy->refcount = 0;
+    copy->flags = flags;
 }
 
 
 #ifdef __GNUC__
 
 // GCC-compatible compiler: use built-in atomic operations
+#define tree_load(Value)                                     \
+    __atomic_load_n(&Value, __ATOMIC_ACQUIRE)
+
+#define tree_store(Value, New)                               \
+    __atomic_store_n(&Value, New, __ATOMIC_RELEASE)
+
+#define tree_load_relaxed(Value)                             \
+    __atomic_load_n(&Value, __ATOMIC_RELAXED)
+
+#define tree_store_relaxed(Value, New)                       \
+    __atomic_store_n(&Value, New, __ATOMIC_RELAXED)
+
 #define tree_fetch_add(Value, Offset)                        \
     __atomic_fetch_add(&Value, Offset, __ATOMIC_ACQUIRE)
 
@@ -213,6 +523,10 @@ inline void tree_delete(tree_p tree)
 #else // ! __GNUC__
 
 #warning "Compiler not supported yet - Not thread safe"
+#define tree_load(Value)                (Value)
+#define tree_store(Value, New)          (Value = New)
+#define tree_load_relaxed(Value)        (Value)
+#define tree_store_relaxed(Value, New)  (Value = New)
 #define tree_fetch_add(Value, OFfset)   (Value += Offset)
 #define tree_add_fetch(Value, Offset)   ((Value += Offset), Value)
 #define tree_compare_exchange(Value, Expected, New)   ((Value = New), true)
@@ -225,7 +539,9 @@ inline refcnt_t tree_refcount(tree_p tree)
 //   Return reference count of the tree
 // ----------------------------------------------------------------------------
 {
-    return tree ? tree->refcount : (refcnt_t) -1;
+    if (tree_is_immediate(tree))
+        return 1;
+    return tree ? tree_load(tree->refcount) : (refcnt_t) -1;
 }
 
 
@@ -233,9 +549,13 @@ inline refcnt_t tree_ref(tree_p tree)
 // ----------------------------------------------------------------------------
 //   Increment reference count of the tree
 // ----------------------------------------------------------------------------
+//   Immediates behave as if they always had exactly one reference
 {
-    assert(tree->refcount + 1 != 0 && "Suspiciously too many references");
-    return tree_fetch_add(tree->refcount, 1);
+    if (tree_is_immediate(tree))
+        return 1;
+    refcnt_t count = tree_fetch_add(tree->refcount, 1);
+    assert(count + 1 != 0 && "Suspiciously too many references");
+    return count;
 }
 
 
@@ -244,8 +564,10 @@ inline refcnt_t tree_unref(tree_p tree)
 //   Decrement reference count of the tree
 // ----------------------------------------------------------------------------
 {
-    assert(tree->refcount && "Cannot unref if never referenced");
+    if (tree_is_immediate(tree))
+        return 1;
     refcnt_t count = tree_add_fetch(tree->refcount, -1);
+    assert(count + 1 != 0 && "Cannot unref if never referenced");
     return count;
 }
 
@@ -258,7 +580,7 @@ inline void tree_dispose(tree_p *tree)
 {
     if (*tree)
     {
-        if ((*tree)->refcount == 0 || tree_unref(*tree) == 0)
+        if (tree_refcount(*tree) == 0 || tree_unref(*tree) == 0)
             tree_delete(*tree);
         *tree = NULL;
     }
@@ -297,7 +619,19 @@ inline const char *tree_typename(tree_p tree)
 //   Return the type name for the tree
 // ----------------------------------------------------------------------------
 {
-    return (const char *) tree->handler(TREE_TYPENAME, tree, NULL);
+    return tree_class_of(tree)->name;
+}
+
+
+inline size_t tree_variable_length(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the number of items in the variable-sized part of the tree
+// ----------------------------------------------------------------------------
+{
+    size_t offset = tree_class_of(tree)->length;
+    if (offset && tree_is_immediate(tree))
+        return ((uintptr_t) tree >> 3) & 3;     // Immediate text or name
+    return offset ? *(size_t *) ((char *) tree + offset) : 0;
 }
 
 
@@ -306,7 +640,8 @@ inline size_t tree_size(tree_p tree)
 //   Return the size of the tree in bytes
 // ----------------------------------------------------------------------------
 {
-    return (size_t) tree->handler(TREE_SIZE, tree, NULL);
+    tree_class_p class = tree_class_of(tree);
+    return class->size + tree_variable_length(tree) * class->item_size;
 }
 
 
@@ -315,7 +650,8 @@ inline size_t tree_arity(tree_p tree)
 //   Return the arity (number of children) of the tree in bytes
 // ----------------------------------------------------------------------------
 {
-    return (size_t) tree->handler(TREE_ARITY, tree, NULL);
+    tree_class_p class = tree_class_of(tree);
+    return class->arity + tree_variable_length(tree) * class->item_arity;
 }
 
 
@@ -324,6 +660,8 @@ inline srcpos_t tree_position(tree_p tree)
 //   Return the arity (number of children) of the tree in bytes
 // ----------------------------------------------------------------------------
 {
+    if (tree_is_immediate(tree))
+        return (uintptr_t) tree >> 16 >> 16;
     return tree ? tree->position : 0;
 }
 
@@ -333,7 +671,7 @@ inline tree_p *tree_children(tree_p tree)
 //   Return a pointer to the children for that tree
 // ----------------------------------------------------------------------------
 {
-    return (tree_p *) tree->handler(TREE_CHILDREN, tree, NULL);
+    return (tree_p *) ((char *) tree + tree_class_of(tree)->children);
 }
 
 
@@ -364,8 +702,11 @@ inline tree_p tree_copy(tree_p tree)
 // ----------------------------------------------------------------------------
 //   Return a shallow copy of the current tree
 // ----------------------------------------------------------------------------
+//   Immediates cannot change, so they are their own copy
 {
-    return tree->handler(TREE_COPY, tree, NULL);
+    if (tree_is_immediate(tree))
+        return tree;
+    return tree_class_of(tree)->handler(TREE_COPY, tree, NULL);
 }
 
 
@@ -374,54 +715,30 @@ inline tree_p tree_clone(tree_p tree)
 //   Return a deep copy of the current tree
 // ----------------------------------------------------------------------------
 {
-    return tree->handler(TREE_CLONE, tree, NULL);
-}
-
-
-inline bool tree_freeze(tree_p tree, tree_io_fn output, void *stream)
-// ----------------------------------------------------------------------------
-//   Freeze (serialize) the tree and return true if successful
-// ----------------------------------------------------------------------------
-{
-    return tree_io(TREE_FREEZE, tree, output, stream) == tree;
-}
-
-
-inline tree_p tree_thaw(tree_io_fn input, void *stream)
-// ----------------------------------------------------------------------------
-//   Thaw (deserialize) the tree from the given input
-// ----------------------------------------------------------------------------
-{
-    return tree_io(TREE_THAW, NULL, input, stream);
-}
-
-
-inline tree_p tree_cast_(tree_p tree, ...)
-// ----------------------------------------------------------------------------
-//   Convert the tree to the type given by handler, or return NULL
-// ----------------------------------------------------------------------------
-{
-    if (tree)
-    {
-        va_list va;
-        va_start(va, tree);
-        tree = tree->handler(TREE_CAST, tree, va);
-        va_end(va);
-    }
-    return tree;
+    if (tree_is_immediate(tree))
+        return tree;
+    return tree_class_of(tree)->handler(TREE_CLONE, tree, NULL);
 }
 
 
-inline tree_handler_fn tree_cast_handler(va_list va)
+inline tree_p tree_cast_(tree_p tree, tree_class_p class)
 // ----------------------------------------------------------------------------
-//    Extract the handler function passed to tree_cast_
+//   Convert the tree to the given type or a derived type, or return NULL
 // ----------------------------------------------------------------------------
+//   The class of an existing tree is always registered, so once the target
+//   class is registered with a non-zero depth, the display gives the answer.
+//   A depth of 0 is either tree_class, a class that is not registered yet,
+//   or one too deep for the display. The slow path deals with the last two.
 {
-    va_list va2;
-    va_copy(va2, va);
-    tree_handler_fn result = va_arg(va2, tree_handler_fn);
-    va_end(va2);
-    return result;
+    if (!tree)
+        return NULL;
+    tree_class_p type = tree_class_of(tree);
+    unsigned depth = tree_load_relaxed(class->depth);
+    if (type->display[depth] == class)
+        return tree;
+    if (depth)
+        return NULL;
+    return tree_cast_slow(tree, class);
 }
 
 
@@ -437,7 +754,7 @@ inline tree_handler_fn tree_cast_handler(va_list va)
                                                                         \
     typedef struct type *type##_p;                                      \
                                                                         \
-    extern tree_p type##_handler(tree_cmd_t cmd,tree_p tree,va_list va);\
+    extern tree_class_t type##_class;                                   \
                                                                         \
                                                                         \
     inline void type##_delete(type##_p type)                            \